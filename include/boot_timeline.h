@@ -0,0 +1,93 @@
+#pragma once
+
+/**
+ * Timestamps of the boot phases, from reset to the network services being up.
+ *
+ * Every phase is marked with micros() once it is done. Only the first mark of a phase counts, so
+ * the phases finishing in the background can be marked from loop() on every pass.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+template <uint8_t Phases>
+class BootTimeline {
+public:
+  BootTimeline(const char *const *names) : _names(names) {}
+
+  void mark(uint8_t phase, uint32_t nowMicros)
+  {
+    if (!_times[phase]) {
+      // 0 means not reached
+      _times[phase] = nowMicros ? nowMicros : 1;
+    }
+  }
+
+  bool reached(uint8_t phase) const { return _times[phase] != 0; }
+
+  // Microseconds from reset to the end of the phase, 0 if not reached yet
+  uint32_t at(uint8_t phase) const { return _times[phase]; }
+
+  // Microseconds since the end of the last phase reached before, 0 if not reached yet
+  uint32_t duration(uint8_t phase) const
+  {
+    if (!_times[phase]) {
+      return 0;
+    }
+
+    uint32_t start = 0;
+    for (uint8_t i = 0; i < phase; i++) {
+      if (_times[i] && _times[i] <= _times[phase] && _times[i] > start) {
+        start = _times[i];
+      }
+    }
+
+    return _times[phase] - start;
+  }
+
+  const char *name(uint8_t phase) const { return _names[phase]; }
+
+  /**
+   * Reached phases as JSON object of microseconds since reset, returns the length like snprintf()
+   */
+  int format(char *buffer, size_t size) const
+  {
+    int length = snprintf(buffer, size, "{");
+
+    for (uint8_t phase = 0; phase < Phases; phase++) {
+      if (_times[phase] && length >= 0 && (size_t)length < size) {
+        length += snprintf(buffer + length, size - length, "%s\"%s\":%lu", length > 1 ? "," : "", _names[phase],
+                           (unsigned long)_times[phase]);
+      }
+    }
+    if (length >= 0 && (size_t)length < size) {
+      length += snprintf(buffer + length, size - length, "}");
+    }
+
+    return length;
+  }
+
+  /**
+   * Write the reached phases in the Prometheus text format, line by line: write(line, length)
+   */
+  template <typename Write>
+  void writeMetrics(Write write) const
+  {
+    char line[96];
+    int length = snprintf(line, sizeof(line), "# TYPE flower_boot_phase_microseconds gauge\n");
+    write(line, length);
+
+    for (uint8_t phase = 0; phase < Phases; phase++) {
+      if (_times[phase]) {
+        length = snprintf(line, sizeof(line), "flower_boot_phase_microseconds{phase=\"%s\"} %lu\n", _names[phase],
+                          (unsigned long)_times[phase]);
+        write(line, length);
+      }
+    }
+  }
+
+private:
+  const char *const *_names;
+  uint32_t _times[Phases] = {};
+};
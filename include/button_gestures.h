@@ -0,0 +1,146 @@
+#pragma once
+
+/**
+ * Gesture state machine for the push button.
+ *
+ * Fed with the debounced button down/up events (microsecond timestamps from the input queue) and
+ * ticked from loop() for the timeouts. Every call runs in constant time without any allocation
+ * and returns the recognized gestures as a bit mask of ButtonGesture flags.
+ *
+ * A single click is reported once the double click window expired without a second press, a
+ * double click once it expired again without a third press, a triple click with the third press.
+ * Holding the button reports a long press, followed by hold repeats until it is released.
+ */
+
+#include <stdint.h>
+
+enum ButtonGesture : uint8_t {
+  BUTTON_PRESS = 1 << 0,
+  BUTTON_RELEASE = 1 << 1,
+  BUTTON_CLICK = 1 << 2,
+  BUTTON_DOUBLE_CLICK = 1 << 3,
+  BUTTON_LONG_PRESS = 1 << 4,
+  BUTTON_HOLD_REPEAT = 1 << 5,
+  BUTTON_TRIPLE_CLICK = 1 << 6,
+};
+
+class ButtonGestures {
+public:
+  ButtonGestures(uint32_t doubleClickMicros, uint32_t longPressMicros, uint32_t repeatMicros)
+      : _doubleClickMicros(doubleClickMicros), _longPressMicros(longPressMicros), _repeatMicros(repeatMicros)
+  {
+  }
+
+  uint8_t down(uint32_t micros)
+  {
+    uint8_t gestures = BUTTON_PRESS;
+
+    switch (_state) {
+    case WAIT_SECOND:
+      _state = SECOND_PRESSED;
+      break;
+
+    case WAIT_THIRD:
+      gestures |= BUTTON_TRIPLE_CLICK;
+      _state = THIRD_PRESSED;
+      break;
+
+    default:
+      _state = PRESSED;
+      break;
+    }
+
+    _since = micros;
+
+    return gestures;
+  }
+
+  uint8_t up(uint32_t micros)
+  {
+    uint8_t gestures = BUTTON_RELEASE;
+
+    switch (_state) {
+    case PRESSED:
+      // Might become a double click
+      _state = WAIT_SECOND;
+      _since = micros;
+      break;
+
+    case SECOND_PRESSED:
+      // Might become a triple click
+      _state = WAIT_THIRD;
+      _since = micros;
+      break;
+
+    default:
+      _state = IDLE;
+      break;
+    }
+
+    return gestures;
+  }
+
+  uint8_t tick(uint32_t micros)
+  {
+    uint32_t elapsed = micros - _since;
+
+    switch (_state) {
+    case PRESSED:
+    case SECOND_PRESSED:
+    case THIRD_PRESSED:
+      if (elapsed >= _longPressMicros) {
+        _state = HOLDING;
+        _since = micros;
+        return BUTTON_LONG_PRESS;
+      }
+      break;
+
+    case HOLDING:
+      if (elapsed >= _repeatMicros) {
+        _since += _repeatMicros;
+        return BUTTON_HOLD_REPEAT;
+      }
+      break;
+
+    case WAIT_SECOND:
+      if (elapsed >= _doubleClickMicros) {
+        _state = IDLE;
+        return BUTTON_CLICK;
+      }
+      break;
+
+    case WAIT_THIRD:
+      if (elapsed >= _doubleClickMicros) {
+        _state = IDLE;
+        return BUTTON_DOUBLE_CLICK;
+      }
+      break;
+
+    case IDLE:
+      break;
+    }
+
+    return 0;
+  }
+
+  // The button is held down beyond the long press time
+  bool holding() const { return _state == HOLDING; }
+
+private:
+  enum State : uint8_t {
+    IDLE,
+    PRESSED,        // First press, might become a click, double click or long press
+    WAIT_SECOND,    // Released after the first press, waiting for a second one
+    SECOND_PRESSED, // Second press, might become a double or triple click or long press
+    WAIT_THIRD,     // Released after the second press, waiting for a third one
+    THIRD_PRESSED,  // Third press of a triple click
+    HOLDING,        // Long press
+  };
+
+  const uint32_t _doubleClickMicros;
+  const uint32_t _longPressMicros;
+  const uint32_t _repeatMicros;
+
+  State _state = IDLE;
+  uint32_t _since = 0;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+/**
+ * Color wheel and perceptual brightness lookup tables.
+ *
+ * The tables are generated at compile time and stored in flash, so the per-frame color path
+ * is a constant time table lookup without any branches or multiplications.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "interpolation.h"
+
+/**
+ * Table of N values generated at compile time by calling Generator for each index.
+ */
+template <typename T, size_t N, T (*Generator)(size_t)>
+struct LookupTable {
+  T values[N];
+
+  constexpr LookupTable() : values()
+  {
+    for (size_t i = 0; i < N; i++) {
+      values[i] = Generator(i);
+    }
+  }
+};
+
+/**
+ * Input a value 0 to 255 to get a color value packed as 0x00RRGGBB.
+ * The colours are a transiting
+ *
+ * on r - g - b - back to r.
+ */
+constexpr uint32_t wheelColor(size_t index)
+{
+  uint32_t WheelPos = 255 - index;
+
+  if (WheelPos < 85)
+  {
+    return ((255 - WheelPos * 3) << 16) | (WheelPos * 3);
+  }
+  else if (WheelPos < 170)
+  {
+    WheelPos -= 85;
+    return ((WheelPos * 3) << 8) | (255 - WheelPos * 3);
+  }
+  else
+  {
+    WheelPos -= 170;
+    return ((WheelPos * 3) << 16) | ((255 - WheelPos * 3) << 8);
+  }
+}
+
+/**
+ * Perceived lightness (CIE 1931, L* 0..100 mapped to 0..255) to linear LED intensity in Q16.
+ * Dimming along this curve looks even to the eye, especially at low brightness.
+ */
+constexpr uint16_t perceptualValue(size_t index)
+{
+  double L = index * 100.0 / 255.0;
+  double Y = L <= 8.0 ? L / 903.3 : ((L + 16.0) / 116.0) * ((L + 16.0) / 116.0) * ((L + 16.0) / 116.0);
+
+  return uint16_t(Y * 65535.0 + 0.5);
+}
+
+typedef LookupTable<uint32_t, 256, wheelColor> WheelTable;
+typedef LookupTable<uint16_t, 256, perceptualValue> PerceptualTable;
+
+extern const WheelTable wheelTable;
+extern const PerceptualTable perceptualTable;
+
+/**
+ * Get the color wheel value 0 to 255 packed as 0x00RRGGBB.
+ */
+inline uint32_t wheelPacked(byte WheelPos)
+{
+  return pgm_read_dword(&wheelTable.values[WheelPos]);
+}
+
+inline RgbColor unpackColor(uint32_t color)
+{
+  return RgbColor{(uint8_t)(color >> 16), (uint8_t)(color >> 8), (uint8_t)color};
+}
+
+/**
+ * Get the color wheel value 0 to 255 as color.
+ */
+inline RgbColor Wheel(byte WheelPos)
+{
+  return unpackColor(wheelPacked(WheelPos));
+}
+
+/**
+ * Scale a packed color by scale / 256 (0 to 256). Red and blue are scaled with a single
+ * multiplication, their lanes can not overflow into each other.
+ */
+inline uint32_t scaleColor(uint32_t color, uint16_t scale)
+{
+  return (((color & 0xff00ff) * scale >> 8) & 0xff00ff) | (((color & 0x00ff00) * scale >> 8) & 0x00ff00);
+}
+
+/**
+ * Blend two packed colors: amount 0 is from, 256 is to
+ */
+inline uint32_t blendColor(uint32_t from, uint32_t to, uint16_t amount)
+{
+  uint32_t rb = ((from & 0xff00ff) * (256 - amount) + (to & 0xff00ff) * amount) >> 8;
+  uint32_t g = ((from & 0x00ff00) * (256 - amount) + (to & 0x00ff00) * amount) >> 8;
+
+  return (rb & 0xff00ff) | (g & 0x00ff00);
+}
+
+/**
+ * Map a linear animation ratio onto the perceptual brightness curve.
+ * Interpolates between the table entries, keeps both endpoints and is monotonic.
+ */
+inline FixedInterpolator::Ratio perceptualRatio(FixedInterpolator::Ratio r)
+{
+  if (r >= FixedInterpolator::ONE) {
+    return FixedInterpolator::ONE;
+  }
+
+  uint32_t index = r >> 8;
+  uint32_t fraction = r & 0xff;
+  uint32_t from = pgm_read_word(&perceptualTable.values[index]);
+  uint32_t to = index < 255 ? pgm_read_word(&perceptualTable.values[index + 1]) : FixedInterpolator::ONE;
+
+  return from + (((to - from) * fraction) >> 8);
+}
+
+inline FloatInterpolator::Ratio perceptualRatio(FloatInterpolator::Ratio r)
+{
+  return perceptualRatio(FixedInterpolator::Ratio(r * FixedInterpolator::ONE)) / float(FixedInterpolator::ONE);
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+// Overall debugging enabled e.g. to log details on Serial
+#define DEBUG false
+// Should the wifi manager run in blocking mode until wifi connection is established or completely non blocking?
+#define WIFI_MANAGER_NON_BLOCKING true
+// Non blocking mode: start the config portal when stored credentials did not connect within that many milliseconds
+#define WIFI_CONNECT_TIMEOUT 30000
+// Is MQTT client enabled?
+#define MQTT_ENABLED false
+
+// Define which LED library to use in the code
+#define LED_LIB_FASTLED 0x01
+#define LED_LIB_ADAFRUITNEOPIXEL 0x02
+#define LED_LIB LED_LIB_FASTLED
+
+// Servo open/closed values for min/max rotation
+// TODO: check this values
+// #define SERVO_OPEN 530 // min position = 0°
+#define SERVO_OPEN 2080
+#define SERVO_CLOSED 2530 // max position = 180°
+
+// LED animation status variables
+#define BRIGHTNESS_START 0
+#define BRIGHTNESS_END 255
+
+#define NUM_LEDS 32
+
+#define FRAMES_PER_SECOND 60
+
+// Use Q16 fixed point math for the petal animation instead of (soft) float math
+#define ANIMATION_FIXED_POINT true
+// Dim the LEDs along the perceptual brightness curve instead of linearly while opening/closing
+#define LED_PERCEPTUAL_BRIGHTNESS true
+
+// Rotary encoder acceleration: turning with ENCODER_SLOW_MICROS (or more) between detents moves
+// the color wheel one step per detent, turning with ENCODER_FAST_MICROS (or less) ENCODER_MAX_STEPS
+#define ENCODER_ACCELERATION true
+#define ENCODER_SLOW_MICROS 80000
+#define ENCODER_FAST_MICROS 8000
+#define ENCODER_MAX_STEPS 12
+
+// Push button gestures: double click window, long press time and hold repeat interval
+#define BUTTON_DOUBLE_CLICK_MICROS 300000
+#define BUTTON_LONG_PRESS_MICROS 600000
+#define BUTTON_REPEAT_MICROS 100000
+// Brightness steps per frame while holding the button to dim
+#define BUTTON_DIM_STEP 1
+// Sleep timer in seconds toggled by a double click
+#define BUTTON_TIMER 1800
+
+// Animation periods of the LED effects in milliseconds (see effects.h), selected by a triple click
+#define EFFECT_RAINBOW_PERIOD 10000
+#define EFFECT_BREATHING_PERIOD 5000
+#define EFFECT_CANDLE_STEP 120
+#define EFFECT_CHASE_PERIOD 3000
+#define EFFECT_PALETTE_PERIOD 30000
+
+// Crossfade the LEDs to a new color or effect within CROSSFADE_DURATION milliseconds, a JSON
+// command may change it ("fade") up to CROSSFADE_MAX
+#define CROSSFADE_ENABLED true
+#define CROSSFADE_DURATION 400
+#define CROSSFADE_MAX 10000
+
+// Version of the persisted settings, increase it whenever the layout of a persisted field changes.
+// New fields are appended to the journal instead: snapshots only need the first
+// SETTINGS_SNAPSHOT_FIELDS fields, the effect is missing in those written before it existed.
+#define SETTINGS_VERSION 1
+#define SETTINGS_SNAPSHOT_FIELDS 6
+// Settings are written behind: once they did not change for SETTINGS_QUIET_TIME milliseconds,
+// but at the latest SETTINGS_MAX_WRITE_DELAY milliseconds after the first change
+#define SETTINGS_QUIET_TIME 2000
+#define SETTINGS_MAX_WRITE_DELAY 10000
+
+// Limits of the transition time (milliseconds of a complete petal movement) of a JSON command,
+// at most 65535 for the Q16 interpolation
+#define TRANSITION_MIN 100
+#define TRANSITION_MAX 60000
+
+// MQTT reconnects back off exponentially from MQTT_BACKOFF_MIN up to MQTT_BACKOFF_MAX milliseconds
+#define MQTT_BACKOFF_MIN 1000
+#define MQTT_BACKOFF_MAX 60000
+// A connect attempt (broker lookup, TCP connect and CONNACK) is given up after MQTT_CONNECT_TIMEOUT
+// milliseconds. It runs in the background, loop() never waits for it.
+#define MQTT_CONNECT_TIMEOUT 2000
+// Keep alive interval in seconds, the connection is dropped if the broker does not answer a ping
+#define MQTT_KEEPALIVE 15
+// Largest MQTT packet sent or received in bytes, larger received ones are dropped
+#define MQTT_PACKET_SIZE 256
+// Bytes received but not yet handled by loop(), a power of two
+#define MQTT_RECEIVE_BUFFER_SIZE 1024
+
+// State changes are collected for STATE_PUBLISH_WINDOW milliseconds before they are published.
+// A running sleep timer is published again after counting down STATE_TIMER_RESOLUTION seconds.
+#define STATE_PUBLISH_WINDOW 1000
+#define STATE_TIMER_RESOLUTION 60
+
+// Realtime pixel streaming (DDP) over UDP, e.g. from desktop light sync tools.
+// Normal rendering takes over again PIXEL_STREAM_TIMEOUT milliseconds after the last packet.
+#define PIXEL_STREAM_ENABLED true
+#define PIXEL_STREAM_PORT 4048
+#define PIXEL_STREAM_TIMEOUT 2500
+
+// Synchronize the movements of several lamps in one room over UDP multicast.
+// Movements start TIME_SYNC_LEAD milliseconds after they have been triggered on all lamps at once.
+#define TIME_SYNC_ENABLED false
+#define TIME_SYNC_GROUP 239, 255, 42, 42
+#define TIME_SYNC_PORT 4049
+#define TIME_SYNC_INTERVAL 1000
+#define TIME_SYNC_LEAD 100
+
+// Local control API: REST (GET /api/state, POST /api/command) and a WebSocket channel pushing
+// state changes at most every WEBSOCKET_PUSH_INTERVAL milliseconds. The HTTP port differs from
+// 80, which the WiFi manager config portal uses.
+#define HTTP_API_ENABLED true
+#define HTTP_API_PORT 8080
+#define WEBSOCKET_PORT 81
+#define WEBSOCKET_PUSH_INTERVAL 50
+
+// Time the loop() stages with the CPU cycle counter. Reported on Serial (DEBUG), via MQTT every
+// METRICS_INTERVAL milliseconds and on the local API as /metrics (Prometheus format).
+#define LOOP_PROFILER_ENABLED true
+#define METRICS_INTERVAL 60000
+
+// Heap watchdog, sampled every HEAP_SAMPLE_INTERVAL milliseconds. Alerts when the free heap or its
+// largest block stays below the byte thresholds or the fragmentation above the percentage.
+#define HEAP_MONITOR_ENABLED true
+#define HEAP_SAMPLE_INTERVAL 1000
+#define HEAP_ALERT_FREE 8192
+#define HEAP_ALERT_LARGEST_BLOCK 4096
+#define HEAP_ALERT_FRAGMENTATION 50
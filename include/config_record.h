@@ -0,0 +1,76 @@
+#pragma once
+
+/**
+ * OTA and MQTT configuration as fixed layout binary record, stored as /config.bin.
+ *
+ * Loading is a single read of the record into memory followed by a CRC check, nothing is parsed
+ * or allocated. The layout is the in-memory one of the ESP8266 (little endian), the record never
+ * leaves the device: /config.json stays the format to import and export the configuration.
+ *
+ * Layout: magic (1), version (1), CRC16 (2) of the rest, OTA port (2), MQTT port (2),
+ * then OTA password, MQTT server, device ID, MQTT user, MQTT password (32 each, NUL terminated).
+ * A version change discards the record, the JSON file is imported again.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "settings_journal.h"
+
+#define CONFIG_RECORD_MAGIC 0xC7
+#define CONFIG_RECORD_VERSION 1
+#define CONFIG_STRING_SIZE 32
+
+struct ConfigRecord {
+  uint8_t magic;
+  uint8_t version;
+  uint16_t crc;
+  uint16_t otaPort;
+  uint16_t mqttPort;
+  char otaPassword[CONFIG_STRING_SIZE];
+  char mqttServer[CONFIG_STRING_SIZE];
+  char deviceId[CONFIG_STRING_SIZE];
+  char mqttUser[CONFIG_STRING_SIZE];
+  char mqttPass[CONFIG_STRING_SIZE];
+};
+
+static_assert(sizeof(ConfigRecord) == 8 + 5 * CONFIG_STRING_SIZE, "Config record layout has padding");
+
+/**
+ * Bounded copy, always NUL terminated. nullptr copies an empty string.
+ */
+inline void copyConfigString(char *destination, const char *source, size_t size)
+{
+  size_t length = source ? strnlen(source, size - 1) : 0;
+
+  if (length) {
+    memcpy(destination, source, length);
+  }
+  destination[length] = '\0';
+}
+
+inline uint16_t configRecordCrc(const ConfigRecord &record)
+{
+  const size_t start = offsetof(ConfigRecord, otaPort);
+
+  return crc16((const uint8_t *)&record + start, sizeof(ConfigRecord) - start);
+}
+
+/**
+ * Set magic, version and CRC before storing the record
+ */
+inline void sealConfigRecord(ConfigRecord &record)
+{
+  record.magic = CONFIG_RECORD_MAGIC;
+  record.version = CONFIG_RECORD_VERSION;
+  record.crc = configRecordCrc(record);
+}
+
+inline bool validConfigRecord(const ConfigRecord &record)
+{
+  return record.magic == CONFIG_RECORD_MAGIC && record.version == CONFIG_RECORD_VERSION &&
+         record.crc == configRecordCrc(record) && record.otaPassword[CONFIG_STRING_SIZE - 1] == '\0' &&
+         record.mqttServer[CONFIG_STRING_SIZE - 1] == '\0' && record.deviceId[CONFIG_STRING_SIZE - 1] == '\0' &&
+         record.mqttUser[CONFIG_STRING_SIZE - 1] == '\0' && record.mqttPass[CONFIG_STRING_SIZE - 1] == '\0';
+}
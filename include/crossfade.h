@@ -0,0 +1,113 @@
+#pragma once
+
+/**
+ * Per-pixel crossfade from the colors shown to a target frame.
+ *
+ * The effect renders into the target buffer. Every channel is kept as a 16 bit accumulator
+ * (8.8 fixed point), so a slow fade over few levels moves in even steps instead of stalling and
+ * jumping like 8 bit per-frame increments would. The global brightness is applied to the 16 bit
+ * value before it is rounded to 8 bits: at low brightness a fade steps evenly through the few
+ * output levels left, scaling already rounded channels in the LED driver would band.
+ *
+ * A new target during a fade starts the next fade from the current accumulators, so it does not
+ * jump back or to the old target. The fade advances once per frame (advance() from the frame
+ * tick), rendering the output any number of times in between does not speed it up.
+ */
+
+#include <stdint.h>
+
+#include "hal.h"
+
+template <uint16_t N>
+class Crossfade {
+public:
+  static constexpr uint32_t ONE = 1UL << 16;
+
+  /**
+   * Buffer to render the target frame into
+   */
+  RgbColor *target() { return _target; }
+
+  /**
+   * The target changed: fade from the current colors to it within the given number of frames.
+   * A target before anything was rendered and 0 frames are shown right away.
+   */
+  void retarget(uint16_t frames)
+  {
+    const uint8_t *target = (const uint8_t *)_target;
+    bool immediate = !_started || frames == 0;
+
+    for (uint16_t i = 0; i < CHANNELS; i++) {
+      _start[i] = immediate ? target[i] << 8 : _current[i];
+    }
+
+    _started = true;
+    _progress = immediate ? ONE : 0;
+    _increment = frames ? (ONE + frames - 1) / frames : ONE;
+    _fading = true;
+  }
+
+  /**
+   * Step the running fade by one frame. Returns true if the output changed and has to be rendered.
+   */
+  bool advance()
+  {
+    if (!_fading) {
+      return false;
+    }
+
+    _progress = _progress + _increment < ONE ? _progress + _increment : ONE;
+
+    return true;
+  }
+
+  /**
+   * Write the current colors of the fade into the pixels, the target itself once it is over.
+   * The pixels are scaled by the brightness like the LED drivers do, send them with full brightness.
+   */
+  void render(RgbColor *pixels, uint8_t brightness = 255)
+  {
+    const uint8_t *target = (const uint8_t *)_target;
+    uint8_t *output = (uint8_t *)pixels;
+    uint32_t scale = brightness + 1;
+
+    if (!_fading) {
+      for (uint16_t i = 0; i < CHANNELS; i++) {
+        _current[i] = target[i] << 8;
+        output[i] = (target[i] * scale + 0x80) >> 8;
+      }
+      // Shown, so the next target fades from here even if it never was retargeted
+      _started = true;
+      return;
+    }
+
+    // Q15 progress keeps the product within 32 bits
+    int32_t progress = _progress >> 1;
+
+    for (uint16_t i = 0; i < CHANNELS; i++) {
+      int32_t difference = (int32_t)(target[i] << 8) - _start[i];
+      uint16_t current = _start[i] + ((difference * progress) >> 15);
+
+      _current[i] = current;
+      output[i] = (current * scale + 0x8000) >> 16;
+    }
+
+    if (_progress >= ONE) {
+      _fading = false;
+    }
+  }
+
+  bool fading() const { return _fading; }
+
+private:
+  static constexpr uint16_t CHANNELS = N * sizeof(RgbColor);
+
+  RgbColor _target[N] = {};
+  uint16_t _start[CHANNELS] = {};
+  uint16_t _current[CHANNELS] = {};
+
+  uint32_t _progress = ONE; // Q16
+  uint32_t _increment = ONE;
+  bool _fading = false;
+  bool _started = false;
+};
@@ -0,0 +1,333 @@
+#pragma once
+
+/**
+ * LED effects, rendered into the back buffer of the frame committer.
+ *
+ * Every effect is a specialization of Effect<Id, N>, so it is compiled for the number of LEDs
+ * with constant loop bounds, steps and modulos. Effects are stateless functions of the frame
+ * time and the color wheel position using integer math only: colors are handled packed as
+ * 0x00RRGGBB and scaled or blended two channels per multiplication (see color.h).
+ *
+ * Each effect declares its budget per frame. EffectEngine dispatches through a table built at
+ * compile time, times every render with the cycle counter and counts the renders beyond the
+ * budget.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "hal.h"
+#include "color.h"
+
+enum EffectId : uint8_t {
+  EFFECT_WHEEL,       // Wheel color and its counterpart on the two halves
+  EFFECT_RAINBOW,     // Whole color wheel across the LEDs, rotating
+  EFFECT_BREATHING,   // Wheel colors fading in and out
+  EFFECT_CANDLE,      // Warm flicker of every LED on its own, ignores the wheel
+  EFFECT_PETAL_CHASE, // Wheel color running around with a fading tail
+  EFFECT_PALETTE,     // Gradient of a palette, drifting. The wheel picks the palette and offset
+};
+
+#define EFFECT_COUNT 6
+
+#define EFFECT_PALETTES 4
+#define EFFECT_PALETTE_STOPS 4
+
+// Stops of the palettes as 0x00RRGGBB
+extern const uint32_t effectPalettes[EFFECT_PALETTES][EFFECT_PALETTE_STOPS];
+
+struct EffectFrame {
+  uint32_t millis;       // Time of the frame
+  uint8_t wheelPosition; // Color wheel position
+};
+
+/**
+ * Effect specialization interface:
+ *
+ *   static constexpr const char *NAME             Name in commands and state
+ *   static constexpr uint16_t BUDGET_MICROS       Render time per frame
+ *   static constexpr bool ANIMATED                Changes over time, rendered every frame
+ *   static void render(RgbColor *, const EffectFrame &)
+ */
+template <EffectId Id, uint16_t N>
+struct Effect;
+
+/**
+ * 8 bit hash of a number, the noise source of the candle
+ */
+inline uint8_t effectNoise(uint32_t x)
+{
+  x *= 0x9e3779b1;
+  x ^= x >> 15;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+
+  return x >> 24;
+}
+
+template <uint16_t N>
+struct Effect<EFFECT_WHEEL, N> {
+  static constexpr const char *NAME = "wheel";
+  static constexpr uint16_t BUDGET_MICROS = 100;
+  static constexpr bool ANIMATED = false;
+
+  static void render(RgbColor *pixels, const EffectFrame &frame)
+  {
+    RgbColor color = Wheel(frame.wheelPosition);
+    RgbColor color2 = Wheel(128 - frame.wheelPosition);
+
+    for (uint16_t i = 0; i < N / 2; i++) {
+      pixels[i] = color;
+    }
+    for (uint16_t i = N / 2; i < N; i++) {
+      pixels[i] = color2;
+    }
+  }
+};
+
+template <uint16_t N>
+struct Effect<EFFECT_RAINBOW, N> {
+  static constexpr const char *NAME = "rainbow";
+  static constexpr uint16_t BUDGET_MICROS = 200;
+  static constexpr bool ANIMATED = true;
+
+  static void render(RgbColor *pixels, const EffectFrame &frame)
+  {
+    // Wheel position in 1/256 steps, one turn across the LEDs
+    uint16_t hue = (frame.wheelPosition + (frame.millis % EFFECT_RAINBOW_PERIOD) * 256 / EFFECT_RAINBOW_PERIOD) << 8;
+    constexpr uint16_t step = 65536 / N;
+
+    for (uint16_t i = 0; i < N; i++) {
+      pixels[i] = Wheel(hue >> 8);
+      hue += step;
+    }
+  }
+};
+
+template <uint16_t N>
+struct Effect<EFFECT_BREATHING, N> {
+  static constexpr const char *NAME = "breathing";
+  static constexpr uint16_t BUDGET_MICROS = 100;
+  static constexpr bool ANIMATED = true;
+
+  // Lowest level, the LEDs never go completely dark
+  static constexpr uint16_t MIN_LEVEL = 24;
+
+  static void render(RgbColor *pixels, const EffectFrame &frame)
+  {
+    uint32_t t = frame.millis % EFFECT_BREATHING_PERIOD;
+    uint32_t triangle = (t < EFFECT_BREATHING_PERIOD / 2 ? t : EFFECT_BREATHING_PERIOD - t) * 512 / EFFECT_BREATHING_PERIOD;
+    // Smoothstep 3t² - 2t³ in 1/256
+    uint32_t eased = (triangle * triangle >> 8) * (768 - 2 * triangle) >> 8;
+    uint16_t level = MIN_LEVEL + (eased * (256 - MIN_LEVEL) >> 8);
+
+    RgbColor color = unpackColor(scaleColor(wheelPacked(frame.wheelPosition), level));
+    RgbColor color2 = unpackColor(scaleColor(wheelPacked(128 - frame.wheelPosition), level));
+
+    for (uint16_t i = 0; i < N / 2; i++) {
+      pixels[i] = color;
+    }
+    for (uint16_t i = N / 2; i < N; i++) {
+      pixels[i] = color2;
+    }
+  }
+};
+
+template <uint16_t N>
+struct Effect<EFFECT_CANDLE, N> {
+  static constexpr const char *NAME = "candle";
+  static constexpr uint16_t BUDGET_MICROS = 300;
+  static constexpr bool ANIMATED = true;
+
+  static constexpr uint32_t COLOR = 0xff7010;
+  static constexpr uint16_t MIN_LEVEL = 96;
+
+  static void render(RgbColor *pixels, const EffectFrame &frame)
+  {
+    // Every LED moves between random levels, a new one every EFFECT_CANDLE_STEP
+    uint32_t key = frame.millis / EFFECT_CANDLE_STEP * N;
+    uint16_t amount = (frame.millis % EFFECT_CANDLE_STEP) * 256 / EFFECT_CANDLE_STEP;
+
+    for (uint16_t i = 0; i < N; i++) {
+      uint16_t from = effectNoise(key + i);
+      uint16_t to = effectNoise(key + N + i);
+      uint16_t noise = (from * (256 - amount) + to * amount) >> 8;
+
+      pixels[i] = unpackColor(scaleColor(COLOR, MIN_LEVEL + (noise * (256 - MIN_LEVEL) >> 8)));
+    }
+  }
+};
+
+template <uint16_t N>
+struct Effect<EFFECT_PETAL_CHASE, N> {
+  static constexpr const char *NAME = "petal_chase";
+  static constexpr uint16_t BUDGET_MICROS = 200;
+  static constexpr bool ANIMATED = true;
+
+  // Length of the tail in LEDs, level of the background
+  static constexpr uint32_t TAIL = N / 4 ? N / 4 : 1;
+  static constexpr uint16_t BACKGROUND_LEVEL = 24;
+
+  static void render(RgbColor *pixels, const EffectFrame &frame)
+  {
+    constexpr uint32_t length = (uint32_t)N * 256;
+    // Position of the head in 1/256 LEDs
+    uint32_t head = (frame.millis % EFFECT_CHASE_PERIOD) * length / EFFECT_CHASE_PERIOD;
+    uint32_t color = wheelPacked(frame.wheelPosition);
+    uint32_t background = scaleColor(wheelPacked(128 - frame.wheelPosition), BACKGROUND_LEVEL);
+
+    for (uint16_t i = 0; i < N; i++) {
+      // Distance behind the head
+      uint32_t distance = (head + length - i * 256) % length;
+
+      pixels[i] = distance < TAIL * 256 ? unpackColor(blendColor(background, color, 256 - distance / TAIL))
+                                        : unpackColor(background);
+    }
+  }
+};
+
+template <uint16_t N>
+struct Effect<EFFECT_PALETTE, N> {
+  static constexpr const char *NAME = "palette";
+  static constexpr uint16_t BUDGET_MICROS = 200;
+  static constexpr bool ANIMATED = true;
+
+  static void render(RgbColor *pixels, const EffectFrame &frame)
+  {
+    constexpr uint32_t length = EFFECT_PALETTE_STOPS * 256;
+    constexpr uint32_t step = length / N;
+    const uint32_t *palette = effectPalettes[frame.wheelPosition * EFFECT_PALETTES / 256];
+
+    uint32_t stops[EFFECT_PALETTE_STOPS];
+    for (uint8_t i = 0; i < EFFECT_PALETTE_STOPS; i++) {
+      stops[i] = pgm_read_dword(&palette[i]);
+    }
+
+    // The wheel position within the palette and the time shift the gradient
+    uint32_t position = (frame.wheelPosition * EFFECT_PALETTES % 256) * EFFECT_PALETTE_STOPS +
+                        (frame.millis % EFFECT_PALETTE_PERIOD) * length / EFFECT_PALETTE_PERIOD;
+
+    for (uint16_t i = 0; i < N; i++) {
+      uint32_t p = (position + i * step) % length;
+      uint8_t stop = p >> 8;
+
+      pixels[i] = unpackColor(blendColor(stops[stop], stops[(stop + 1) % EFFECT_PALETTE_STOPS], p & 0xff));
+    }
+  }
+};
+
+template <uint16_t N>
+class EffectEngine {
+public:
+  struct Entry {
+    const char *name;
+    void (*render)(RgbColor *, const EffectFrame &);
+    uint16_t budgetMicros;
+    bool animated;
+  };
+
+  /**
+   * Render the effect into the pixels. Returns false if it took longer than its budget.
+   */
+  bool render(uint8_t effect, RgbColor *pixels, const EffectFrame &frame, uint32_t cyclesPerMicrosecond)
+  {
+    effect = valid(effect);
+
+    uint32_t start = cycleCount();
+    entries()[effect].render(pixels, frame);
+    uint32_t cycles = cycleCount() - start;
+
+    if (cycles > _maxCycles[effect]) {
+      _maxCycles[effect] = cycles;
+    }
+    if (cycles > entries()[effect].budgetMicros * cyclesPerMicrosecond) {
+      _overruns[effect]++;
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Look up an effect by its name, not NUL terminated
+   */
+  static bool find(const char *name, size_t length, uint8_t &effect)
+  {
+    for (uint8_t i = 0; i < EFFECT_COUNT; i++) {
+      if (strlen(entries()[i].name) == length && memcmp(entries()[i].name, name, length) == 0) {
+        effect = i;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Unknown effects (e.g. from older settings) fall back to the wheel
+  static uint8_t valid(uint8_t effect) { return effect < EFFECT_COUNT ? effect : (uint8_t)EFFECT_WHEEL; }
+
+  static const char *name(uint8_t effect) { return entries()[valid(effect)].name; }
+  static bool animated(uint8_t effect) { return entries()[valid(effect)].animated; }
+  static uint16_t budgetMicros(uint8_t effect) { return entries()[valid(effect)].budgetMicros; }
+
+  uint32_t maxCycles(uint8_t effect) const { return _maxCycles[valid(effect)]; }
+  unsigned long overruns(uint8_t effect) const { return _overruns[valid(effect)]; }
+
+  /**
+   * Write the longest render and the budget overruns of each effect in the Prometheus text
+   * format, line by line: write(line, length)
+   */
+  template <typename Write>
+  void writeMetrics(Write write, uint32_t cyclesPerMicrosecond) const
+  {
+    char line[96];
+    int length;
+
+    length = snprintf(line, sizeof(line), "# TYPE flower_effect_render_max_microseconds gauge\n");
+    write(line, length);
+    for (uint8_t i = 0; i < EFFECT_COUNT; i++) {
+      length = snprintf(line, sizeof(line), "flower_effect_render_max_microseconds{effect=\"%s\"} %lu\n",
+                        entries()[i].name, (unsigned long)(_maxCycles[i] / cyclesPerMicrosecond));
+      write(line, length);
+    }
+
+    length = snprintf(line, sizeof(line), "# TYPE flower_effect_budget_overruns_total counter\n");
+    write(line, length);
+    for (uint8_t i = 0; i < EFFECT_COUNT; i++) {
+      length = snprintf(line, sizeof(line), "flower_effect_budget_overruns_total{effect=\"%s\"} %lu\n",
+                        entries()[i].name, _overruns[i]);
+      write(line, length);
+    }
+  }
+
+private:
+  template <EffectId Id>
+  static constexpr Entry entry()
+  {
+    typedef Effect<Id, N> E;
+    static_assert(E::BUDGET_MICROS * 4 <= 1000000 / FRAMES_PER_SECOND, "An effect may take a quarter of a frame");
+
+    return Entry{E::NAME, E::render, E::BUDGET_MICROS, E::ANIMATED};
+  }
+
+  // In the order of the effect IDs
+  static const Entry *entries()
+  {
+    static constexpr Entry table[EFFECT_COUNT] = {
+      entry<EFFECT_WHEEL>(),
+      entry<EFFECT_RAINBOW>(),
+      entry<EFFECT_BREATHING>(),
+      entry<EFFECT_CANDLE>(),
+      entry<EFFECT_PETAL_CHASE>(),
+      entry<EFFECT_PALETTE>(),
+    };
+
+    return table;
+  }
+
+  uint32_t _maxCycles[EFFECT_COUNT] = {};
+  unsigned long _overruns[EFFECT_COUNT] = {};
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+/**
+ * Velocity aware acceleration for the rotary encoder.
+ *
+ * The time between detents is taken from the input event timestamps. Slow turns move the color
+ * wheel by one step per detent, fast spins by up to maxSteps per detent, with a linear ramp in
+ * between based on the turning speed (detents per second).
+ */
+
+#include <stdint.h>
+
+class EncoderAcceleration {
+public:
+  /**
+   * slowMicros: detent interval (and slower) which moves one step per detent
+   * fastMicros: detent interval (and faster) which moves maxSteps per detent
+   */
+  EncoderAcceleration(uint32_t slowMicros, uint32_t fastMicros, uint8_t maxSteps)
+      : _slowRate(1000000UL / slowMicros), _fastRate(1000000UL / fastMicros), _maxSteps(maxSteps)
+  {
+  }
+
+  /**
+   * Steps to move for the given detents (signed) turned at the given time.
+   */
+  int16_t steps(int8_t detents, uint32_t micros)
+  {
+    if (detents == 0) {
+      return 0;
+    }
+
+    int8_t direction = detents > 0 ? 1 : -1;
+    uint8_t count = detents > 0 ? detents : -detents;
+    uint32_t interval = (micros - _lastMicros) / count;
+
+    _lastMicros = micros;
+
+    // Changing the direction or pausing starts over slow
+    if (direction != _direction || interval >= SLOW_LIMIT_MICROS) {
+      _direction = direction;
+      _interval = SLOW_LIMIT_MICROS;
+    } else {
+      // Smooth the interval a bit, single detents are not evenly spaced
+      _interval = (_interval * 3 + interval) / 4;
+    }
+
+    return direction * count * factor();
+  }
+
+  /**
+   * Steps per detent for the current (smoothed) speed.
+   */
+  uint8_t factor() const
+  {
+    uint32_t rate = 1000000UL / (_interval ? _interval : 1);
+
+    if (rate <= _slowRate) {
+      return 1;
+    }
+    if (rate >= _fastRate) {
+      return _maxSteps;
+    }
+
+    return 1 + (rate - _slowRate) * (_maxSteps - 1) / (_fastRate - _slowRate);
+  }
+
+private:
+  // Intervals longer than this count as a new turn
+  static constexpr uint32_t SLOW_LIMIT_MICROS = 250000;
+
+  const uint32_t _slowRate;
+  const uint32_t _fastRate;
+  const uint8_t _maxSteps;
+
+  uint32_t _lastMicros = 0;
+  uint32_t _interval = SLOW_LIMIT_MICROS;
+  int8_t _direction = 0;
+};
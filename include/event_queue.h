@@ -0,0 +1,79 @@
+#pragma once
+
+/**
+ * Lock-free single-producer/single-consumer ring buffer for input events.
+ *
+ * The producer is the interrupt context: on the ESP8266 all GPIO interrupts are dispatched by one
+ * handler and never nest, so the rotary encoder and the push button ISRs together form a single
+ * producer. The consumer is loop(), which drains the queue in batches.
+ */
+
+#include <atomic>
+#include <stdint.h>
+
+#include "hal.h"
+
+enum InputEventType : uint8_t {
+  INPUT_EVENT_ROTATION,    // value: detents turned since the last rotation event (signed)
+  INPUT_EVENT_BUTTON_DOWN, // button pressed
+  INPUT_EVENT_BUTTON_UP,   // button released
+};
+
+struct InputEvent {
+  uint32_t micros;
+  InputEventType type;
+  int8_t value;
+};
+
+template <typename T, uint8_t Size>
+class EventQueue {
+  static_assert(Size > 1 && Size <= 128 && (Size & (Size - 1)) == 0, "Size must be a power of two up to 128");
+
+public:
+  /**
+   * Producer side (ISR). Returns false and counts an overflow if the queue is full.
+   */
+  IRAM_ATTR bool push(const T &event)
+  {
+    uint8_t head = _head.load(std::memory_order_relaxed);
+
+    if ((uint8_t)(head - _tail.load(std::memory_order_acquire)) == Size) {
+      _overflows++;
+      return false;
+    }
+
+    _events[head & (Size - 1)] = event;
+    _head.store(head + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  /**
+   * Consumer side (loop). Copies up to max events into events, returns the number of events.
+   */
+  uint8_t drain(T *events, uint8_t max)
+  {
+    uint8_t tail = _tail.load(std::memory_order_relaxed);
+    uint8_t available = _head.load(std::memory_order_acquire) - tail;
+    uint8_t count = available < max ? available : max;
+
+    for (uint8_t i = 0; i < count; i++) {
+      events[i] = _events[(uint8_t)(tail + i) & (Size - 1)];
+    }
+
+    _tail.store(tail + count, std::memory_order_release);
+
+    return count;
+  }
+
+  bool empty() const { return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_relaxed); }
+
+  // Events rejected because the queue was full
+  unsigned long overflows() const { return _overflows; }
+
+private:
+  T _events[Size];
+  std::atomic<uint8_t> _head{0};
+  std::atomic<uint8_t> _tail{0};
+  volatile unsigned long _overflows = 0;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+/**
+ * OTA and MQTT configuration stored on the file system: loaded from the binary record
+ * /config.bin at boot, imported from and exported to /config.json.
+ */
+
+#include "config.h"
+#include "hal.h"
+#include "config_record.h"
+
+// Upper bound of /config.json, larger files are not imported
+#define CONFIG_JSON_SIZE 512
+
+// OTA settings
+extern unsigned int otaPort;
+extern char otaPassword[CONFIG_STRING_SIZE];
+
+// MQTT settings
+extern char mqtt_server[CONFIG_STRING_SIZE];
+extern unsigned int mqtt_port;
+extern char device_id[CONFIG_STRING_SIZE];
+extern char mqtt_user[CONFIG_STRING_SIZE];
+extern char mqtt_pass[CONFIG_STRING_SIZE];
+
+/**
+ * Mount the file system and load the configuration, importing /config.json once if there is no
+ * valid binary record yet.
+ */
+void prepareFileSystem();
+
+// Binary record /config.bin
+bool loadConfigRecord();
+bool storeConfigRecord();
+
+// JSON file /config.json
+bool importConfigJson();
+bool exportConfigJson();
+
+#if DEBUG == true
+void printConfig();
+#endif
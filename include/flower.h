@@ -0,0 +1,118 @@
+#pragma once
+
+/**
+ * Hardware independent animation core: settings, petal movement and LED colors.
+ */
+
+#include "config.h"
+#include "hal.h"
+#include "color.h"
+#include "frame_commit.h"
+#include "led_output.h"
+#include "effects.h"
+#include "crossfade.h"
+#include "frame_scheduler.h"
+#include "settings_journal.h"
+#include "interpolation.h"
+#include "mqtt_command.h"
+#include "state_publisher.h"
+#include "pixel_stream.h"
+#include "time_sync.h"
+
+#if ANIMATION_FIXED_POINT == true
+typedef FixedInterpolator Interpolator;
+#else
+typedef FloatInterpolator Interpolator;
+#endif
+
+// Settings struct persisted in the settings journal
+struct Settings {
+  int servoPosition = SERVO_CLOSED;
+  float_t brightness = BRIGHTNESS_START;
+  byte wheelPosition = 0;
+  bool flowerGoalState = false;
+  uint8_t brightnessMax = 50;
+  uint16_t timer = 0;
+  uint8_t effect = EFFECT_WHEEL;
+};
+
+// Settings struct as the EEPROM library stored it at the start of the settings sector, before the
+// settings journal. The goal state byte may hold any value.
+struct LegacySettings {
+  int servoPosition;
+  float_t brightness;
+  uint8_t wheelPosition;
+  uint8_t flowerGoalState;
+  uint8_t brightnessMax;
+  uint16_t timer;
+};
+
+extern Settings settings;
+
+extern SettingsJournal<Settings, 7> settingsJournal;
+
+// Settings changed but not yet written to flash
+extern bool settingsDirty;
+// Longest flash write of the settings in microseconds
+extern unsigned long maxSettingsFlushMicros;
+
+extern Servo myServo;
+
+// Do some color or brightness change
+extern bool doColorChange;
+
+// Petal animation timing variables
+extern int frameDuration;
+extern int frameElapsed;
+extern unsigned long previousMillis;
+extern int movementDirection;
+
+extern unsigned long targetTimer;
+
+extern FrameScheduler frameScheduler;
+
+// LED frames: render into the back buffer, committed once per frame
+extern FrameCommitter<NUM_LEDS, LedOutput> frameCommitter;
+
+extern EffectEngine<NUM_LEDS> effectEngine;
+
+// Crossfade to new colors and effects, duration in milliseconds
+extern Crossfade<NUM_LEDS> crossfade;
+extern int fadeDuration;
+
+extern PixelStream<NUM_LEDS> pixelStream;
+
+// MQTT topics
+extern const char mqtt_topic_brightness[];
+extern const char mqtt_topic_timer[];
+extern const char mqtt_topic_color[];
+extern const char mqtt_topic_toggle[];
+extern const char mqtt_topic_command[];
+extern const char mqtt_topic_effect[];
+extern const char mqtt_topic_metrics[];
+extern const char *const mqtt_state_topics[STATE_FIELD_COUNT];
+
+extern const MqttTopicHandler mqttTopicHandlers[];
+extern const uint8_t mqttTopicHandlerCount;
+
+bool restoreSettings();
+void storeSettings();
+void persistSettings();
+void flushSettings();
+void setWheel(byte WheelPos, Interpolator::Ratio brightness);
+void setEffect(uint8_t effect);
+void nextEffect();
+RgbColor *streamedPixels();
+void showStreamedPixels();
+void updatePixelStream();
+void setFlowerGoalState(bool on);
+void toggleFlower();
+void scheduleMovement(const SyncCommand &command);
+bool takeMovementBroadcast(SyncCommand &command);
+void updateScheduledMovement();
+void prepareTargetTimer();
+LampState currentLampState();
+int formatLampState(char *buffer, size_t size);
+void updateFlower();
+bool applyCommand(const char *json, size_t length);
+void mqttCallback(char *topic, byte *payload, unsigned int length);
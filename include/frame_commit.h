@@ -0,0 +1,182 @@
+#pragma once
+
+/**
+ * Triple buffered render/commit pipeline in front of the LED strip.
+ *
+ * Render: a frame is drawn completely into the back buffer and presented, which swaps it with the
+ * ready buffer. Commit: once per frame the ready buffer is swapped with the front buffer and sent.
+ * Nothing ever writes into a presented or sent buffer, so a frame can not tear no matter who draws
+ * (effects, commands, the pixel stream), and rendering several times within a frame costs no
+ * transfers: only the latest presented frame is sent.
+ *
+ * Sending a frame blocks interrupts for about 1 ms (FASTLED_ALLOW_INTERRUPTS 0), which is when
+ * the rotary encoder ISR drops ticks. Frames equal to the last one sent are therefore skipped
+ * instead of being transferred again.
+ *
+ * The Output policy (see led_output.h) sends the front buffer. Render and commit durations are
+ * recorded separately in cycles.
+ */
+
+#include <string.h>
+
+#include "hal.h"
+#include "loop_profiler.h"
+
+template <uint16_t N, typename Output>
+class FrameCommitter {
+public:
+  /**
+   * Set up the LED output, it starts black.
+   */
+  void begin(uint8_t brightness)
+  {
+    _output.begin(_front, brightness);
+    _brightness = brightness;
+    _valid = true;
+  }
+
+  /**
+   * Buffer to draw the next frame into, its content is undefined: draw every pixel.
+   * Starts timing the render.
+   */
+  RgbColor *render()
+  {
+    _renderStart = cycleCount();
+    _rendering = true;
+
+    return _back;
+  }
+
+  /**
+   * Back buffer without render timing, e.g. for pixels received over the network
+   */
+  RgbColor *back() { return _back; }
+
+  /**
+   * The latest presented frame, whether it has been sent or not
+   */
+  const RgbColor *latest() const { return _pending ? _ready : _front; }
+
+  /**
+   * The back buffer holds a complete frame: it replaces any frame still waiting for the commit.
+   */
+  void present(uint8_t brightness)
+  {
+    if (_rendering) {
+      _renderCycles.record(cycleCount() - _renderStart);
+      _rendering = false;
+    }
+
+    RgbColor *ready = _ready;
+    _ready = _back;
+    _back = ready;
+    _readyBrightness = brightness;
+    _pending = true;
+    _presented++;
+  }
+
+  /**
+   * Send the latest presented frame to the LED strip unless it equals the last sent frame.
+   * Returns true if a frame has been sent.
+   */
+  bool commit()
+  {
+    if (!_pending) {
+      return false;
+    }
+
+    _pending = false;
+    if (_valid && _readyBrightness == _brightness && memcmp(_ready, _front, sizeof(RgbColor) * N) == 0) {
+      _skipped++;
+      return false;
+    }
+
+    uint32_t start = cycleCount();
+
+    RgbColor *front = _front;
+    _front = _ready;
+    _ready = front;
+    _brightness = _readyBrightness;
+    _valid = true;
+
+    _output.show(_front, _brightness);
+    _shown++;
+
+    _commitCycles.record(cycleCount() - start);
+
+    return true;
+  }
+
+  /**
+   * Forget the last sent frame e.g. if the LED strip has been written by someone else.
+   */
+  void invalidate() { _valid = false; }
+
+  // A presented frame waits for the commit
+  bool pending() const { return _pending; }
+
+  unsigned long presented() const { return _presented; }
+  unsigned long shown() const { return _shown; }
+  unsigned long skipped() const { return _skipped; }
+
+  const LogHistogram &renderCycles() const { return _renderCycles; }
+  const LogHistogram &commitCycles() const { return _commitCycles; }
+
+  Output &output() { return _output; }
+
+  /**
+   * Write the render and commit durations and the frame counts in the Prometheus text format,
+   * line by line: write(line, length)
+   */
+  template <typename Write>
+  void writeMetrics(Write write, uint32_t cyclesPerMicrosecond) const
+  {
+    char line[160];
+    int length;
+    const char *names[] = {"render", "commit"};
+    const LogHistogram *histograms[] = {&_renderCycles, &_commitCycles};
+
+    for (uint8_t i = 0; i < 2; i++) {
+      length = snprintf(line, sizeof(line),
+                        "# TYPE flower_frame_%s_microseconds summary\n"
+                        "flower_frame_%s_microseconds{quantile=\"0.5\"} %lu\n"
+                        "flower_frame_%s_microseconds{quantile=\"0.99\"} %lu\n",
+                        names[i], names[i], (unsigned long)(histograms[i]->percentile(50) / cyclesPerMicrosecond),
+                        names[i], (unsigned long)(histograms[i]->percentile(99) / cyclesPerMicrosecond));
+      write(line, length);
+      length = snprintf(line, sizeof(line), "flower_frame_%s_microseconds_count %lu\n", names[i],
+                        (unsigned long)histograms[i]->count());
+      write(line, length);
+    }
+
+    length = snprintf(line, sizeof(line),
+                      "# TYPE flower_frames_total counter\n"
+                      "flower_frames_total{result=\"presented\"} %lu\n"
+                      "flower_frames_total{result=\"shown\"} %lu\n"
+                      "flower_frames_total{result=\"skipped\"} %lu\n",
+                      _presented, _shown, _skipped);
+    write(line, length);
+  }
+
+private:
+  Output _output;
+
+  RgbColor _buffers[3][N] = {};
+  RgbColor *_back = _buffers[0];
+  RgbColor *_ready = _buffers[1];
+  RgbColor *_front = _buffers[2];
+
+  uint8_t _readyBrightness = 0;
+  bool _pending = false;
+  uint8_t _brightness = 0;
+  bool _valid = false;
+
+  uint32_t _renderStart = 0;
+  bool _rendering = false;
+  LogHistogram _renderCycles;
+  LogHistogram _commitCycles;
+
+  unsigned long _presented = 0;
+  unsigned long _shown = 0;
+  unsigned long _skipped = 0;
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+/**
+ * Cooperative fixed rate frame scheduler.
+ *
+ * loop() polls the scheduler on every iteration. A frame is due on a fixed grid of
+ * 1 s / framesPerSecond. Everything else loop() does (WiFi, MDNS, MQTT, ...) runs in the slack
+ * time between two frames. If loop() is late by more than one frame period, the missed frames
+ * are dropped and the grid is kept, so the cadence stays deterministic instead of bursting.
+ */
+
+#include <stdint.h>
+
+class FrameScheduler {
+public:
+  // Jitter histogram: JITTER_BUCKETS buckets of JITTER_BUCKET_MICROS each, the last one is open ended
+  static constexpr uint8_t JITTER_BUCKETS = 32;
+  static constexpr uint32_t JITTER_BUCKET_MICROS = 512;
+
+  explicit FrameScheduler(uint16_t framesPerSecond)
+      : _period(1000000UL / framesPerSecond),
+        _periodRemainder(1000000UL % framesPerSecond),
+        _framesPerSecond(framesPerSecond)
+  {
+  }
+
+  /**
+   * Start the frame grid at the given time.
+   */
+  void begin(uint32_t nowMicros)
+  {
+    _next = nowMicros;
+    _remainder = 0;
+    _started = true;
+  }
+
+  /**
+   * Returns true if a frame should be rendered now.
+   */
+  bool poll(uint32_t nowMicros)
+  {
+    if (!_started) {
+      begin(nowMicros);
+    }
+
+    int32_t lateness = (int32_t)(nowMicros - _next);
+    if (lateness < 0) {
+      return false;
+    }
+
+    _frames++;
+    recordJitter(lateness);
+
+    // Advance the grid by one frame and drop every further frame already missed
+    advance();
+    if ((int32_t)(nowMicros - _next) >= 0) {
+      _late++;
+
+      while ((int32_t)(nowMicros - _next) >= 0) {
+        advance();
+        _dropped++;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Time until the next frame is due, i.e. the slack left for other tasks.
+   */
+  uint32_t slackMicros(uint32_t nowMicros) const
+  {
+    int32_t slack = (int32_t)(_next - nowMicros);
+
+    return slack > 0 ? slack : 0;
+  }
+
+  /**
+   * Jitter percentile (0 - 100) of the frame start times in microseconds.
+   * Resolution is one histogram bucket, the upper bucket bound is reported.
+   */
+  uint32_t jitterPercentile(uint8_t percentile) const
+  {
+    if (_frames == 0) {
+      return 0;
+    }
+
+    uint64_t target = ((uint64_t)_frames * percentile + 99) / 100;
+    uint64_t count = 0;
+
+    for (uint8_t i = 0; i < JITTER_BUCKETS; i++) {
+      count += _jitter[i];
+
+      if (count >= target) {
+        return (i + 1) * JITTER_BUCKET_MICROS;
+      }
+    }
+
+    return JITTER_BUCKETS * JITTER_BUCKET_MICROS;
+  }
+
+  uint32_t periodMicros() const { return _period; }
+
+  // Rendered frames
+  unsigned long frames() const { return _frames; }
+  // Frames started more than one period late
+  unsigned long late() const { return _late; }
+  // Frames skipped because loop() was late
+  unsigned long dropped() const { return _dropped; }
+
+private:
+  void advance()
+  {
+    _next += _period;
+    _remainder += _periodRemainder;
+
+    if (_remainder >= _framesPerSecond) {
+      _remainder -= _framesPerSecond;
+      _next++;
+    }
+  }
+
+  void recordJitter(int32_t lateness)
+  {
+    uint32_t bucket = (uint32_t)lateness / JITTER_BUCKET_MICROS;
+
+    _jitter[bucket < JITTER_BUCKETS ? bucket : JITTER_BUCKETS - 1]++;
+  }
+
+  const uint32_t _period;
+  const uint32_t _periodRemainder;
+  const uint16_t _framesPerSecond;
+
+  uint32_t _next = 0;
+  uint32_t _remainder = 0;
+  bool _started = false;
+
+  unsigned long _frames = 0;
+  unsigned long _late = 0;
+  unsigned long _dropped = 0;
+  unsigned long _jitter[JITTER_BUCKETS] = {};
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+/**
+ * Thin hardware abstraction for the animation core.
+ *
+ * On the device this pulls in the ESP8266 Arduino core. On the host (native env) it pulls in
+ * the stand-ins from hal_native.h so the very same core code can be compiled and benchmarked.
+ */
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+  #include "LittleFS.h"
+  #include <Servo.h>
+#else
+  #include "hal_native.h"
+#endif
+
+/**
+ * A single LED color, independent from the used LED library.
+ */
+struct RgbColor {
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+};
+
+// Size of the flash sector reserved for the settings (the sector of the former EEPROM emulation)
+#define FLASH_SECTOR_SIZE 4096
+
+/**
+ * Raw access to the settings flash sector. Like NOR flash, writing can only clear bits,
+ * erasing sets the whole sector to 0xFF. Offsets and sizes must be multiples of 4.
+ * Implemented by the firmware (main.cpp) and by the host stand-ins.
+ */
+bool flashSectorErase();
+bool flashSectorWrite(uint32_t offset, const uint32_t *data, size_t size);
+bool flashSectorRead(uint32_t offset, uint32_t *data, size_t size);
+
+/**
+ * CPU cycle counter for timing short code sections, wraps around.
+ * Implemented by the firmware (main.cpp) and by the host stand-ins (nanoseconds).
+ */
+uint32_t cycleCount();
+uint32_t cyclesPerMicrosecond();
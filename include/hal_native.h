@@ -0,0 +1,116 @@
+#pragma once
+
+/**
+ * Host stand-ins for the parts of the ESP8266 Arduino core used by the animation core.
+ * Only compiled into the native env, see src/native/hal_native.cpp.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define IRAM_ATTR
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+
+#define LOW 0x0
+#define HIGH 0x1
+
+/*** Time ***/
+
+// The host clock is simulated: it only moves when advanceMillis()/advanceMicros() is called.
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+namespace hal {
+void advanceMillis(unsigned long ms);
+void advanceMicros(unsigned long us);
+}
+
+/*** Serial ***/
+
+class HostSerial {
+public:
+  void begin(unsigned long) {}
+  void print(const char *s) { fputs(s, stdout); }
+  void print(long v) { printf("%ld", v); }
+  void print(unsigned long v) { printf("%lu", v); }
+  void print(int v) { printf("%d", v); }
+  void print(unsigned int v) { printf("%u", v); }
+  void print(double v) { printf("%.2f", v); }
+  template <typename T> void println(T v) { print(v); println(); }
+  void println() { fputs("\n", stdout); }
+  template <typename... Args> void printf(const char *format, Args... args) { ::printf(format, args...); }
+};
+
+extern HostSerial Serial;
+
+/*** Servo ***/
+
+class Servo {
+public:
+  uint8_t attach(int pin, int min, int max, int value);
+  void write(int value);
+  int read() const { return _value; }
+  int readMicroseconds() const { return _value; }
+
+  // Number of write() calls, used by the benchmarks
+  unsigned long writes = 0;
+
+private:
+  int _value = 0;
+};
+
+/*** Flash ***/
+
+namespace hal {
+// Sector erases and write calls of the simulated settings flash sector
+extern unsigned long flashErases;
+extern unsigned long flashWrites;
+}
+
+/*** LittleFS ***/
+
+class File {
+public:
+  File() {}
+  File(std::string *content, bool write) : _content(content), _write(write) {}
+
+  explicit operator bool() const { return _content != nullptr; }
+  size_t size() const { return _content ? _content->size() : 0; }
+  size_t readBytes(char *buffer, size_t length);
+  size_t write(const uint8_t *buffer, size_t length);
+  size_t write(uint8_t c) { return write(&c, 1); }
+  void close() { _content = nullptr; }
+
+private:
+  std::string *_content = nullptr;
+  bool _write = false;
+  size_t _position = 0;
+};
+
+class FS {
+public:
+  bool begin() { return true; }
+  bool exists(const char *path) const { return _files.count(path) > 0; }
+  File open(const char *path, const char *mode);
+  bool remove(const char *path) { return _files.erase(path) > 0; }
+
+private:
+  std::map<std::string, std::string> _files;
+};
+
+extern FS LittleFS;
@@ -0,0 +1,146 @@
+#pragma once
+
+/**
+ * Watchdog of the heap: free bytes, the largest free block and the fragmentation derived from
+ * both (the share of the free heap not usable in one block).
+ *
+ * Sampled periodically from loop(), it keeps the current values and the worst ones since boot.
+ * The alert is raised once the heap violated a threshold for ALERT_SAMPLES samples in a row and
+ * cleared after as many samples within all thresholds again, so short allocation peaks e.g. of a
+ * HTTP request do not toggle it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+class HeapMonitor {
+public:
+  static constexpr uint8_t ALERT_SAMPLES = 3;
+
+  /**
+   * Thresholds: minimum free bytes, minimum largest free block, maximum fragmentation in percent
+   */
+  HeapMonitor(uint32_t minFree, uint32_t minLargest, uint8_t maxFragmentation)
+      : _minFreeThreshold(minFree), _minLargestThreshold(minLargest), _maxFragmentationThreshold(maxFragmentation)
+  {
+  }
+
+  /**
+   * Record a sample. Returns true if the alert has been raised or cleared by it.
+   */
+  bool sample(uint32_t freeHeap, uint32_t largest)
+  {
+    _free = freeHeap;
+    _largest = largest;
+    _fragmentation = fragmentation(freeHeap, largest);
+    _samples++;
+
+    if (_samples == 1 || freeHeap < _minFree) {
+      _minFree = freeHeap;
+    }
+    if (_samples == 1 || largest < _minLargest) {
+      _minLargest = largest;
+    }
+    if (_fragmentation > _maxFragmentation) {
+      _maxFragmentation = _fragmentation;
+    }
+
+    bool violated = freeHeap < _minFreeThreshold || largest < _minLargestThreshold ||
+                    _fragmentation > _maxFragmentationThreshold;
+
+    // Samples in a row contradicting the alert state
+    _streak = violated != _alert ? _streak + 1 : 0;
+    if (_streak < ALERT_SAMPLES) {
+      return false;
+    }
+
+    _alert = violated;
+    _streak = 0;
+    if (_alert) {
+      _alerts++;
+    }
+
+    return true;
+  }
+
+  static uint8_t fragmentation(uint32_t freeHeap, uint32_t largest)
+  {
+    return freeHeap && largest < freeHeap ? 100 - (uint64_t)largest * 100 / freeHeap : 0;
+  }
+
+  bool alert() const { return _alert; }
+  unsigned long alerts() const { return _alerts; }
+
+  uint32_t freeHeap() const { return _free; }
+  uint32_t largestBlock() const { return _largest; }
+  uint8_t fragmentation() const { return _fragmentation; }
+
+  // Worst values since boot
+  uint32_t minFree() const { return _minFree; }
+  uint32_t minLargestBlock() const { return _minLargest; }
+  uint8_t maxFragmentation() const { return _maxFragmentation; }
+
+  /**
+   * Current and worst values as JSON, returns the length like snprintf()
+   */
+  int format(char *buffer, size_t size) const
+  {
+    return snprintf(buffer, size,
+                    "{\"free\":%lu,\"largest\":%lu,\"fragmentation\":%u,\"min_free\":%lu,\"min_largest\":%lu,"
+                    "\"max_fragmentation\":%u,\"alert\":%s}",
+                    (unsigned long)_free, (unsigned long)_largest, _fragmentation, (unsigned long)_minFree,
+                    (unsigned long)_minLargest, _maxFragmentation, _alert ? "true" : "false");
+  }
+
+  /**
+   * Write the values in the Prometheus text format, line by line: write(line, length)
+   */
+  template <typename Write>
+  void writeMetrics(Write write) const
+  {
+    char line[160];
+    int length;
+
+    length = snprintf(line, sizeof(line), "# TYPE flower_heap_free_bytes gauge\nflower_heap_free_bytes %lu\n",
+                      (unsigned long)_free);
+    write(line, length);
+    length = snprintf(line, sizeof(line),
+                      "# TYPE flower_heap_largest_block_bytes gauge\nflower_heap_largest_block_bytes %lu\n",
+                      (unsigned long)_largest);
+    write(line, length);
+    length = snprintf(line, sizeof(line),
+                      "# TYPE flower_heap_fragmentation_percent gauge\nflower_heap_fragmentation_percent %u\n",
+                      _fragmentation);
+    write(line, length);
+    length = snprintf(line, sizeof(line), "# TYPE flower_heap_min_free_bytes gauge\nflower_heap_min_free_bytes %lu\n",
+                      (unsigned long)_minFree);
+    write(line, length);
+    length = snprintf(line, sizeof(line),
+                      "# TYPE flower_heap_min_largest_block_bytes gauge\nflower_heap_min_largest_block_bytes %lu\n",
+                      (unsigned long)_minLargest);
+    write(line, length);
+    length = snprintf(line, sizeof(line), "# TYPE flower_heap_alert gauge\nflower_heap_alert %u\n"
+                                          "# TYPE flower_heap_alerts_total counter\nflower_heap_alerts_total %lu\n",
+                      _alert ? 1 : 0, _alerts);
+    write(line, length);
+  }
+
+private:
+  const uint32_t _minFreeThreshold;
+  const uint32_t _minLargestThreshold;
+  const uint8_t _maxFragmentationThreshold;
+
+  uint32_t _free = 0;
+  uint32_t _largest = 0;
+  uint8_t _fragmentation = 0;
+
+  uint32_t _minFree = 0;
+  uint32_t _minLargest = 0;
+  uint8_t _maxFragmentation = 0;
+  unsigned long _samples = 0;
+
+  bool _alert = false;
+  uint8_t _streak = 0;
+  unsigned long _alerts = 0;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+/**
+ * Interpolation engines for the petal animation (servo position and brightness).
+ *
+ * The ESP8266 has no FPU, every float operation is a soft-float library call. The fixed point
+ * engine uses Q16 ratios instead and only needs integer math. Both engines share the same
+ * interface so the animation core can select one at compile time (see ANIMATION_FIXED_POINT).
+ */
+
+#include <stdint.h>
+
+/**
+ * Float based interpolation, the original implementation.
+ */
+struct FloatInterpolator {
+  typedef float Ratio;
+
+  static constexpr Ratio ZERO = 0.0f;
+  static constexpr Ratio ONE = 1.0f;
+
+  /**
+   * Ratio of elapsed to duration, clamped to [ZERO, ONE].
+   */
+  static Ratio ratio(int32_t elapsed, int32_t duration)
+  {
+    Ratio r = float(elapsed) / float(duration);
+
+    if (r <= ZERO) {
+      return ZERO;
+    }
+    if (r >= ONE) {
+      return ONE;
+    }
+
+    return r;
+  }
+
+  /**
+   * Interpolate between from and to.
+   */
+  static int32_t lerp(int32_t from, int32_t to, Ratio r)
+  {
+    return from + int32_t(r * (to - from));
+  }
+};
+
+/**
+ * Q16 fixed point interpolation: a ratio of 65536 equals 1.0.
+ */
+struct FixedInterpolator {
+  typedef uint32_t Ratio;
+
+  static constexpr Ratio ZERO = 0;
+  static constexpr Ratio ONE = 1UL << 16;
+
+  /**
+   * Ratio of elapsed to duration, clamped to [ZERO, ONE].
+   */
+  static Ratio ratio(int32_t elapsed, int32_t duration)
+  {
+    if (elapsed <= 0) {
+      return ZERO;
+    }
+    if (elapsed >= duration) {
+      return ONE;
+    }
+
+    return ((uint32_t)elapsed << 16) / (uint32_t)duration;
+  }
+
+  /**
+   * Interpolate between from and to. The endpoints are hit exactly and the result is
+   * monotonic in r. Requires |to - from| < 32768.
+   */
+  static int32_t lerp(int32_t from, int32_t to, Ratio r)
+  {
+    return from + (((to - from) * (int32_t)r) / (int32_t)ONE);
+  }
+};
@@ -0,0 +1,141 @@
+#pragma once
+
+/**
+ * LED output policies: the driver behind the frame committer, chosen at compile time.
+ *
+ * All rendering goes into the RgbColor frame buffers of the committer. A policy only moves a
+ * finished frame out to the strip, so a new driver does not touch any render code. Interface:
+ *
+ *   void begin(RgbColor *frame, uint8_t brightness)        Set up the driver, show the frame
+ *   void show(RgbColor *frame, uint8_t brightness)         Send the frame with the global brightness
+ *
+ * The frame stays untouched until the next show(), a driver may send straight from it.
+ *
+ * LedOutput is the policy of the build: FastLED or Adafruit NeoPixel (LED_LIB) on the device,
+ * the mock on the host.
+ */
+
+#include "config.h"
+#include "hal.h"
+
+/**
+ * Host mock, records the shown frames
+ */
+template <uint16_t N>
+class HostLedOutput {
+public:
+  void begin(RgbColor *frame, uint8_t brightness) { show(frame, brightness); }
+
+  void show(RgbColor *frame, uint8_t brightness)
+  {
+    _frame = frame;
+    _brightness = brightness;
+    _shows++;
+  }
+
+  const RgbColor *frame() const { return _frame; }
+  uint8_t brightness() const { return _brightness; }
+  unsigned long shows() const { return _shows; }
+
+private:
+  const RgbColor *_frame = nullptr;
+  uint8_t _brightness = 0;
+  unsigned long _shows = 0;
+};
+
+#ifdef ARDUINO
+
+#define PIN_LED D3
+
+#if LED_LIB == LED_LIB_FASTLED
+  #define FASTLED_ALLOW_INTERRUPTS 0
+
+  #include <FastLED.h>
+
+  #define CHIPSET NEOPIXEL
+  #define COLOR_ORDER RGB // Not required for NeoPixel
+
+  // #define CHIPSET WS2812
+  // #define COLOR_ORDER GRB
+
+/**
+ * FastLED sends straight from the frame, CRGB has the same layout as RgbColor
+ */
+template <uint16_t N, uint8_t Pin>
+class FastLedOutput {
+  static_assert(sizeof(CRGB) == sizeof(RgbColor), "FastLED sends the RgbColor frame buffer as is");
+
+public:
+  void begin(RgbColor *frame, uint8_t brightness)
+  {
+#if (CHIPSET == NEOPIXEL)
+    FastLED.addLeds<CHIPSET, Pin>((CRGB *)frame, N);
+#else
+    FastLED.addLeds<CHIPSET, Pin, COLOR_ORDER>((CRGB *)frame, N);
+#endif
+    //.setCorrection(TypicalLEDStrip);
+
+    // FastLED.setMaxRefreshRate(60);
+
+    show(frame, brightness);
+  }
+
+  void show(RgbColor *frame, uint8_t brightness)
+  {
+    FastLED[0].setLeds((CRGB *)frame, N);
+    FastLED.setBrightness(brightness);
+    FastLED.show();
+    delayMicroseconds(100);
+  }
+};
+
+typedef FastLedOutput<NUM_LEDS, PIN_LED> LedOutput;
+#elif LED_LIB == LED_LIB_ADAFRUITNEOPIXEL
+  #include <Adafruit_NeoPixel.h>
+
+/**
+ * Adafruit NeoPixel keeps its own pixel buffer in the wire order, the frame is copied into it
+ * with the brightness applied.
+ *
+ * Type: pixel type flags, add together as needed:
+ *   NEO_KHZ800  800 KHz bitstream (most NeoPixel products w/WS2812 LEDs)
+ *   NEO_KHZ400  400 KHz (classic 'v1' (not v2) FLORA pixels, WS2811 drivers)
+ *   NEO_GRB     Pixels are wired for GRB bitstream (most NeoPixel products)
+ *   NEO_RGB     Pixels are wired for RGB bitstream (v1 FLORA pixels, not v2)
+ *   NEO_RGBW    Pixels are wired for RGBW bitstream (NeoPixel RGBW products)
+ */
+template <uint16_t N, uint8_t Pin, neoPixelType Type>
+class NeoPixelOutput {
+public:
+  NeoPixelOutput() : _strip(N, Pin, Type) {}
+
+  void begin(RgbColor *frame, uint8_t brightness)
+  {
+    _strip.begin();
+    show(frame, brightness);
+  }
+
+  void show(RgbColor *frame, uint8_t brightness)
+  {
+    _strip.setBrightness(brightness);
+
+    for (uint16_t i = 0; i < N; i++)
+    {
+      _strip.setPixelColor(i, frame[i].r, frame[i].g, frame[i].b);
+    }
+
+    _strip.show();
+  }
+
+private:
+  Adafruit_NeoPixel _strip;
+};
+
+typedef NeoPixelOutput<NUM_LEDS, PIN_LED, NEO_GRB + NEO_KHZ800> LedOutput;
+#else
+  #error "No valid LED library selected!"
+#endif
+
+#else
+typedef HostLedOutput<NUM_LEDS> LedOutput;
+#endif
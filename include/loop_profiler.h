@@ -0,0 +1,220 @@
+#pragma once
+
+/**
+ * Cycle counter based timing of the loop() stages.
+ *
+ * Every stage records its duration into a histogram with power of two buckets. Recording takes a
+ * count leading zeros and a few increments, cheap enough to stay enabled in the firmware. Durations
+ * are kept in CPU cycles and converted to microseconds only for the reports.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Histogram with 32 buckets: bucket i holds values from 2^i to 2^(i+1) - 1 (bucket 0 also 0).
+ */
+class LogHistogram {
+public:
+  static constexpr uint8_t BUCKETS = 32;
+
+  void record(uint32_t value)
+  {
+    // Halve all counts before they overflow, the distribution stays the same
+    if (_count == 0x80000000UL) {
+      halve();
+    }
+
+    _counts[bucket(value)]++;
+    _count++;
+    _sum += value;
+    if (value > _max) {
+      _max = value;
+    }
+  }
+
+  /**
+   * Upper bound of the bucket holding the p-th percentile
+   */
+  uint32_t percentile(uint8_t p) const
+  {
+    uint32_t rank = (uint64_t)_count * p / 100;
+    uint32_t seen = 0;
+
+    for (uint8_t i = 0; i < BUCKETS; i++) {
+      seen += _counts[i];
+      if (seen > rank) {
+        return upperBound(i) < _max ? upperBound(i) : _max;
+      }
+    }
+
+    return _max;
+  }
+
+  /**
+   * Summary of cycle counts in microseconds as JSON, returns the length like snprintf()
+   */
+  int format(char *buffer, size_t size, uint32_t cyclesPerMicrosecond) const
+  {
+    return snprintf(buffer, size, "{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu}", (unsigned long)_count,
+                    (unsigned long)(percentile(50) / cyclesPerMicrosecond),
+                    (unsigned long)(percentile(99) / cyclesPerMicrosecond),
+                    (unsigned long)(_max / cyclesPerMicrosecond));
+  }
+
+  uint32_t count() const { return _count; }
+  uint32_t count(uint8_t bucket) const { return _counts[bucket]; }
+  uint64_t sum() const { return _sum; }
+  uint32_t max() const { return _max; }
+
+  static uint8_t bucket(uint32_t value) { return value ? 31 - __builtin_clz(value) : 0; }
+  static uint32_t upperBound(uint8_t bucket) { return bucket == 31 ? UINT32_MAX : (2UL << bucket) - 1; }
+
+private:
+  void halve()
+  {
+    _count = 0;
+    for (uint8_t i = 0; i < BUCKETS; i++) {
+      _counts[i] /= 2;
+      _count += _counts[i];
+    }
+    _sum /= 2;
+  }
+
+  uint32_t _counts[BUCKETS] = {};
+  uint32_t _count = 0;
+  uint64_t _sum = 0;
+  uint32_t _max = 0;
+};
+
+/**
+ * Timing of Stages consecutive loop() stages plus the whole loop, which is reported as stage
+ * number Stages. names: Stages + 1 names.
+ */
+template <uint8_t Stages>
+class LoopProfiler {
+public:
+  LoopProfiler(const char *const *names) : _names(names) {}
+
+  // Start of loop()
+  void begin(uint32_t cycles) { _start = _lap = cycles; }
+
+  // End of the given stage
+  void lap(uint8_t stage, uint32_t cycles)
+  {
+    _histograms[stage].record(cycles - _lap);
+    _lap = cycles;
+  }
+
+  // End of loop()
+  void end(uint32_t cycles) { _histograms[Stages].record(cycles - _start); }
+
+  /**
+   * Time count empty laps, clock() reading the cycle counter like PROFILE_LAP does. The average
+   * cost of a lap is reported with the metrics. Call it once before the first loop(), it starts
+   * the histograms over.
+   */
+  template <typename Clock>
+  uint32_t measureLap(Clock clock, uint16_t count = 256)
+  {
+    uint32_t start = clock();
+    _lap = start;
+    for (uint16_t i = 0; i < count; i++) {
+      lap(0, clock());
+    }
+    _lapCycles = (clock() - start) / count;
+
+    for (LogHistogram &histogram : _histograms) {
+      histogram = LogHistogram();
+    }
+
+    return _lapCycles;
+  }
+
+  // Average cost of an empty lap in cycles, 0 if not measured
+  uint32_t lapCycles() const { return _lapCycles; }
+
+  const LogHistogram &histogram(uint8_t stage) const { return _histograms[stage]; }
+  const char *name(uint8_t stage) const { return _names[stage]; }
+
+  /**
+   * Summary of a stage in microseconds as JSON, returns the length like snprintf()
+   */
+  int formatStage(uint8_t stage, char *buffer, size_t size, uint32_t cyclesPerMicrosecond) const
+  {
+    return _histograms[stage].format(buffer, size, cyclesPerMicrosecond);
+  }
+
+  /**
+   * Write all histograms in the Prometheus text format, line by line: write(line, length).
+   * Only the buckets from the lowest to the highest used one are written.
+   */
+  template <typename Write>
+  void writeMetrics(Write write, uint32_t cyclesPerMicrosecond) const
+  {
+    char line[160];
+    int length;
+
+    length = snprintf(line, sizeof(line), "# TYPE flower_cpu_cycles_per_microsecond gauge\n"
+                                          "flower_cpu_cycles_per_microsecond %lu\n",
+                      (unsigned long)cyclesPerMicrosecond);
+    write(line, length);
+    length = snprintf(line, sizeof(line), "# TYPE flower_loop_lap_cycles gauge\n"
+                                          "flower_loop_lap_cycles %lu\n",
+                      (unsigned long)_lapCycles);
+    write(line, length);
+    length = snprintf(line, sizeof(line), "# TYPE flower_loop_cycles histogram\n");
+    write(line, length);
+
+    for (uint8_t stage = 0; stage <= Stages; stage++) {
+      const LogHistogram &h = _histograms[stage];
+      uint8_t first = LogHistogram::BUCKETS, last = 0;
+
+      for (uint8_t i = 0; i < LogHistogram::BUCKETS; i++) {
+        if (h.count(i)) {
+          first = i < first ? i : first;
+          last = i;
+        }
+      }
+
+      uint32_t cumulative = 0;
+      for (uint8_t i = first; i <= last && first < LogHistogram::BUCKETS; i++) {
+        cumulative += h.count(i);
+        length = snprintf(line, sizeof(line), "flower_loop_cycles_bucket{stage=\"%s\",le=\"%lu\"} %lu\n", _names[stage],
+                          (unsigned long)LogHistogram::upperBound(i), (unsigned long)cumulative);
+        write(line, length);
+      }
+
+      char sum[21];
+      length = snprintf(line, sizeof(line),
+                        "flower_loop_cycles_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+                        "flower_loop_cycles_sum{stage=\"%s\"} %s\n",
+                        _names[stage], (unsigned long)h.count(), _names[stage], formatUnsigned(h.sum(), sum));
+      write(line, length);
+      length = snprintf(line, sizeof(line), "flower_loop_cycles_count{stage=\"%s\"} %lu\n", _names[stage],
+                        (unsigned long)h.count());
+      write(line, length);
+    }
+  }
+
+private:
+  // Not every printf() implementation supports 64 bit integers
+  static const char *formatUnsigned(uint64_t value, char *buffer)
+  {
+    char *p = buffer + 20;
+    *p = '\0';
+    do {
+      *--p = '0' + value % 10;
+      value /= 10;
+    } while (value);
+
+    return p;
+  }
+
+  const char *const *_names;
+  LogHistogram _histograms[Stages + 1];
+  uint32_t _start = 0;
+  uint32_t _lap = 0;
+  uint32_t _lapCycles = 0;
+};
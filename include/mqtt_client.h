@@ -0,0 +1,338 @@
+#pragma once
+
+/**
+ * Minimal MQTT 3.1.1 client that never waits on the network.
+ *
+ * Replaces PubSubClient, whose connect() runs the lookup, the TCP connect and the wait for the
+ * CONNACK in one blocking call. Here each of them is a step polled by MqttConnection from loop():
+ * resolve(), connect() and handshake() return NET_PENDING until they are done. Subscriptions
+ * and messages are QoS 0, commands arrive through the callback from loop(). Packets larger than
+ * Size are dropped. Nothing is allocated.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tcp_transport.h"
+
+template <typename Transport, uint16_t Size>
+class MqttClient {
+public:
+  typedef void (*Callback)(char *topic, uint8_t *payload, unsigned int length);
+
+  /**
+   * The broker and the credentials are read at every connect, they may change in between.
+   */
+  MqttClient(const char *host, const unsigned int &port, const char *id, const char *user, const char *password,
+             uint16_t keepAliveSeconds)
+      : _host(host), _port(port), _id(id), _user(user), _password(password), _keepAlive(keepAliveSeconds)
+  {
+  }
+
+  void setCallback(Callback callback) { _callback = callback; }
+
+  /*** Connect steps, polled by MqttConnection ***/
+
+  NetProgress resolve() { return _transport.resolve(_host); }
+
+  NetProgress connect() { return _transport.connect(_port); }
+
+  /**
+   * Send the CONNECT, then wait for the CONNACK
+   */
+  NetProgress handshake(uint32_t nowMillis)
+  {
+    if (!_connectSent) {
+      _connectSent = true;
+      _now = _lastIn = _lastOut = nowMillis;
+      _pingOutstanding = false;
+      _packet = PACKET_NONE;
+      return sendConnect() ? NET_PENDING : NET_FAILED;
+    }
+
+    if (!_transport.connected()) {
+      return NET_FAILED;
+    }
+    if (!receive()) {
+      return NET_PENDING;
+    }
+
+    _packet = PACKET_NONE;
+    // Return code 0: accepted
+    if ((_header & 0xf0) != CONNACK || _length != 2 || _buffer[1] != 0) {
+      return NET_FAILED;
+    }
+
+    _session = true;
+    return NET_DONE;
+  }
+
+  /**
+   * Give up the connection or the attempt. The broker is looked up again for the next one, it may
+   * have moved.
+   */
+  void abort()
+  {
+    _transport.stop();
+    _transport.forget();
+    _connectSent = false;
+    _session = false;
+  }
+
+  /*** Session ***/
+
+  bool connected() { return _session && _transport.connected(); }
+
+  /**
+   * Handle at most one received packet and keep the connection alive. Call it from loop().
+   */
+  void loop(uint32_t nowMillis)
+  {
+    if (!connected()) {
+      return;
+    }
+
+    _now = nowMillis;
+    if (receive()) {
+      _packet = PACKET_NONE;
+      _lastIn = nowMillis;
+
+      switch (_header & 0xf0) {
+      case PUBLISH:
+        dispatch();
+        break;
+      case PINGRESP:
+        _pingOutstanding = false;
+        break;
+      }
+    }
+
+    uint32_t keepAlive = _keepAlive * 1000UL;
+    if (nowMillis - _lastIn > keepAlive || nowMillis - _lastOut > keepAlive) {
+      if (_pingOutstanding) {
+        // No answer within the keep alive interval
+        abort();
+        return;
+      }
+
+      uint8_t ping[2] = {PINGREQ, 0};
+      _transport.write(ping, sizeof(ping));
+      _lastIn = _lastOut = nowMillis;
+      _pingOutstanding = true;
+    }
+  }
+
+  bool subscribe(const char *topic)
+  {
+    uint16_t length = strlen(topic);
+    if (!connected() || 7 + length > Size) {
+      return false;
+    }
+
+    _nextId = _nextId == UINT16_MAX ? 1 : _nextId + 1;
+
+    uint8_t *p = _out + begin(SUBSCRIBE | 0x02, 2 + 2 + length + 1);
+    *p++ = _nextId >> 8;
+    *p++ = _nextId;
+    p = putString(p, topic, length);
+    *p++ = 0; // QoS 0
+
+    return send(p - _out);
+  }
+
+  bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained)
+  {
+    uint16_t topicLength = strlen(topic);
+    if (!connected() || 5 + topicLength + length > Size) {
+      return false;
+    }
+
+    uint8_t *p = _out + begin(PUBLISH | (retained ? 0x01 : 0x00), 2 + topicLength + length);
+    p = putString(p, topic, topicLength);
+    memcpy(p, payload, length);
+
+    return send(p + length - _out);
+  }
+
+private:
+  enum PacketType : uint8_t {
+    CONNECT = 0x10,
+    CONNACK = 0x20,
+    PUBLISH = 0x30,
+    PUBACK = 0x40,
+    SUBSCRIBE = 0x80,
+    PINGREQ = 0xc0,
+    PINGRESP = 0xd0,
+  };
+
+  // Progress of the packet being received
+  enum Receiving : uint8_t {
+    PACKET_NONE,   // Waiting for the fixed header
+    PACKET_LENGTH, // Reading the remaining length
+    PACKET_BODY,   // Reading the rest
+  };
+
+  bool sendConnect()
+  {
+    uint16_t idLength = strlen(_id);
+    uint16_t userLength = strlen(_user);
+    uint16_t passwordLength = userLength ? strlen(_password) : 0;
+    uint32_t length = 10 + 2 + idLength + (userLength ? 2 + userLength : 0) + (passwordLength ? 2 + passwordLength : 0);
+    if (length + 5 > Size) {
+      return false;
+    }
+
+    uint8_t *p = _out + begin(CONNECT, length);
+    p = putString(p, "MQTT", 4);
+    *p++ = 4;                                                                // Protocol level 3.1.1
+    *p++ = 0x02 | (userLength ? 0x80 : 0x00) | (passwordLength ? 0x40 : 0x00); // Clean session
+    *p++ = _keepAlive >> 8;
+    *p++ = _keepAlive;
+    p = putString(p, _id, idLength);
+    if (userLength) {
+      p = putString(p, _user, userLength);
+    }
+    if (passwordLength) {
+      p = putString(p, _password, passwordLength);
+    }
+
+    return send(p - _out);
+  }
+
+  /**
+   * Write the fixed header into the send buffer, returns its size
+   */
+  uint8_t begin(uint8_t header, uint32_t length)
+  {
+    uint8_t size = 0;
+    _out[size++] = header;
+    do {
+      uint8_t digit = length % 128;
+      length /= 128;
+      _out[size++] = digit | (length ? 0x80 : 0x00);
+    } while (length);
+    return size;
+  }
+
+  static uint8_t *putString(uint8_t *p, const char *s, uint16_t length)
+  {
+    *p++ = length >> 8;
+    *p++ = length;
+    memcpy(p, s, length);
+    return p + length;
+  }
+
+  bool send(size_t size)
+  {
+    if (_transport.write(_out, size) != size) {
+      // Does not fit into the send buffer right now, the message is lost
+      return false;
+    }
+    _lastOut = _now;
+    return true;
+  }
+
+  /**
+   * Read what has arrived of the current packet. Returns true once it is complete, the body is
+   * in _buffer then unless it was too large.
+   */
+  bool receive()
+  {
+    while (_transport.available()) {
+      uint8_t byte;
+
+      switch (_packet) {
+      case PACKET_NONE:
+        _transport.read(&_header, 1);
+        _length = 0;
+        _shift = 0;
+        _received = 0;
+        _packet = PACKET_LENGTH;
+        break;
+
+      case PACKET_LENGTH:
+        _transport.read(&byte, 1);
+        _length |= (uint32_t)(byte & 0x7f) << _shift;
+        _shift += 7;
+        if (!(byte & 0x80) || _shift > 21) {
+          _packet = PACKET_BODY;
+          if (_length == 0) {
+            return true;
+          }
+        }
+        break;
+
+      case PACKET_BODY:
+        if (_received < Size) {
+          uint32_t wanted = (_length < Size ? _length : Size) - _received;
+          _received += _transport.read(_buffer + _received, wanted);
+        } else {
+          // Too large: skip the rest
+          _transport.read(&byte, 1);
+          _received++;
+        }
+        if (_received >= _length) {
+          if (_length > Size) {
+            _packet = PACKET_NONE;
+            break;
+          }
+          return true;
+        }
+        break;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Hand a received PUBLISH to the callback, with the topic null terminated in place
+   */
+  void dispatch()
+  {
+    uint8_t qos = (_header >> 1) & 0x03;
+    uint16_t topicLength = _buffer[0] << 8 | _buffer[1];
+    uint32_t payloadOffset = 2 + topicLength + (qos ? 2 : 0);
+    if (payloadOffset > _length) {
+      return;
+    }
+
+    if (qos == 1) {
+      uint8_t ack[4] = {PUBACK, 2, _buffer[2 + topicLength], _buffer[3 + topicLength]};
+      _transport.write(ack, sizeof(ack));
+    }
+
+    // The topic moves one byte down over its length, the terminator takes its last byte
+    memmove(_buffer + 1, _buffer + 2, topicLength);
+    _buffer[1 + topicLength] = '\0';
+
+    if (_callback) {
+      _callback((char *)_buffer + 1, _buffer + payloadOffset, _length - payloadOffset);
+    }
+  }
+
+  Transport _transport;
+  const char *_host;
+  const unsigned int &_port;
+  const char *_id;
+  const char *_user;
+  const char *_password;
+  const uint16_t _keepAlive;
+  Callback _callback = nullptr;
+
+  bool _connectSent = false;
+  bool _session = false;
+  bool _pingOutstanding = false;
+  uint32_t _now = 0; // Time of the last handshake() or loop()
+  uint32_t _lastIn = 0;
+  uint32_t _lastOut = 0;
+  uint16_t _nextId = 0;
+
+  Receiving _packet = PACKET_NONE;
+  uint8_t _header = 0;
+  uint8_t _shift = 0;
+  uint32_t _length = 0;
+  uint32_t _received = 0;
+  uint8_t _buffer[Size];
+  uint8_t _out[Size];
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+/**
+ * Allocation free MQTT command handling: bounds checked payload parsing straight from the
+ * received buffer and a topic dispatch table.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hal.h"
+
+/**
+ * Handler of a single command topic
+ */
+struct MqttTopicHandler {
+  const char *topic;
+  uint8_t length;
+  void (*handle)(const byte *payload, unsigned int length);
+};
+
+/**
+ * Parse a decimal integer from a payload which is not null terminated.
+ * Surrounding whitespace and a sign are allowed, anything else or a value outside of
+ * [min, max] is rejected.
+ */
+inline bool parseInteger(const byte *payload, unsigned int length, long min, long max, long &value)
+{
+  unsigned int i = 0;
+
+  while (i < length && (payload[i] == ' ' || payload[i] == '\t' || payload[i] == '\r' || payload[i] == '\n')) {
+    i++;
+  }
+
+  bool negative = false;
+  if (i < length && (payload[i] == '-' || payload[i] == '+')) {
+    negative = payload[i] == '-';
+    i++;
+  }
+
+  unsigned int digits = 0;
+  long result = 0;
+  while (i < length && payload[i] >= '0' && payload[i] <= '9') {
+    result = result * 10 + (payload[i] - '0');
+    i++;
+    digits++;
+
+    // Stop early, before the value could overflow
+    if (result > max && result > -min) {
+      return false;
+    }
+  }
+
+  while (i < length && (payload[i] == ' ' || payload[i] == '\t' || payload[i] == '\r' || payload[i] == '\n')) {
+    i++;
+  }
+
+  if (digits == 0 || i != length) {
+    return false;
+  }
+
+  result = negative ? -result : result;
+  if (result < min || result > max) {
+    return false;
+  }
+
+  value = result;
+
+  return true;
+}
+
+/**
+ * Find the handler of a topic. Compares lengths first, so usually a single memcmp() is needed.
+ */
+inline const MqttTopicHandler *findTopicHandler(const MqttTopicHandler *handlers, uint8_t count, const char *topic)
+{
+  size_t length = strlen(topic);
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (handlers[i].length == length && memcmp(handlers[i].topic, topic, length) == 0) {
+      return &handlers[i];
+    }
+  }
+
+  return nullptr;
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+/**
+ * MQTT connection state machine.
+ *
+ * Replaces the reconnect attempt every 5 s, which connected and subscribed all topics in one go.
+ * An attempt is split into the broker lookup, the TCP connect and the MQTT handshake; each poll()
+ * checks on the current step without waiting for it, or sends a single subscription. A step that
+ * fails or takes longer than the connect timeout gives the attempt up. Failed attempts back off
+ * exponentially with jitter, so an unreachable broker is tried every few seconds up to once a minute.
+ *
+ * The client has to provide the steps resolve(), connect() and handshake(now), each returning
+ * NetProgress, abort(), connected() and subscribe(topic).
+ */
+
+#include <stdint.h>
+
+#include "mqtt_command.h"
+#include "tcp_transport.h"
+
+template <typename Client>
+class MqttConnection {
+public:
+  MqttConnection(Client &client, const MqttTopicHandler *handlers, uint8_t handlerCount, uint32_t minBackoffMillis,
+                 uint32_t maxBackoffMillis, uint32_t timeoutMillis)
+      : _client(client), _handlers(handlers), _handlerCount(handlerCount), _minBackoff(minBackoffMillis),
+        _maxBackoff(maxBackoffMillis), _timeout(timeoutMillis), _backoff(minBackoffMillis)
+  {
+  }
+
+  /**
+   * Advance the connection by at most one network step. Call it from loop().
+   * random: any random number, used for the jitter of the backoff
+   */
+  void poll(uint32_t nowMillis, uint32_t random)
+  {
+    switch (_state) {
+    case WAITING:
+      if (nowMillis - _since < _delay) {
+        break;
+      }
+
+      _attempts++;
+      _state = RESOLVING;
+      _since = nowMillis;
+      // fall through
+
+    case RESOLVING:
+      step(_client.resolve(), CONNECTING, nowMillis, random);
+      break;
+
+    case CONNECTING:
+      step(_client.connect(), HANDSHAKE, nowMillis, random);
+      break;
+
+    case HANDSHAKE:
+      step(_client.handshake(nowMillis), SUBSCRIBING, nowMillis, random);
+      if (_state == SUBSCRIBING) {
+        _subscribed = 0;
+        _backoff = _minBackoff;
+      }
+      break;
+
+    case SUBSCRIBING:
+      if (!_client.connected()) {
+        giveUp(nowMillis, random);
+        break;
+      }
+
+      if (_subscribed < _handlerCount) {
+        _client.subscribe(_handlers[_subscribed++].topic);
+      }
+      if (_subscribed == _handlerCount) {
+        _state = CONNECTED;
+        _connects++;
+      }
+      break;
+
+    case CONNECTED:
+      if (!_client.connected()) {
+        // Lost the connection: start over with the shortest backoff
+        _backoff = _minBackoff;
+        giveUp(nowMillis, random);
+      }
+      break;
+    }
+  }
+
+  /**
+   * Drop the connection or the attempt, e.g. while the network is down. The next attempt starts
+   * with the shortest backoff once poll() is called again.
+   */
+  void reset(uint32_t nowMillis)
+  {
+    if (_state == WAITING && _delay == 0) {
+      // Nothing to drop
+      return;
+    }
+
+    _client.abort();
+    _state = WAITING;
+    _since = nowMillis;
+    _delay = 0;
+    _backoff = _minBackoff;
+  }
+
+  // Connected and all topics subscribed
+  bool connected() const { return _state == CONNECTED; }
+
+  unsigned long attempts() const { return _attempts; }
+  unsigned long connects() const { return _connects; }
+
+private:
+  enum State : uint8_t {
+    WAITING,     // Waiting for the next connect attempt
+    RESOLVING,   // Looking the broker up
+    CONNECTING,  // TCP connect
+    HANDSHAKE,   // Waiting for the CONNACK
+    SUBSCRIBING, // Connected, subscribing one topic per poll
+    CONNECTED,
+  };
+
+  /**
+   * Move on to the next state once a connect step is done, give the attempt up if it failed or
+   * the attempt took too long
+   */
+  void step(NetProgress progress, State next, uint32_t nowMillis, uint32_t random)
+  {
+    if (progress == NET_DONE) {
+      _state = next;
+    } else if (progress == NET_FAILED || nowMillis - _since >= _timeout) {
+      giveUp(nowMillis, random);
+    }
+  }
+
+  void giveUp(uint32_t nowMillis, uint32_t random)
+  {
+    _client.abort();
+    retry(nowMillis, random);
+  }
+
+  /**
+   * Schedule the next attempt after the current backoff with "equal jitter": a random delay
+   * between half and the full backoff keeps several lamps from hitting the broker in sync.
+   */
+  void retry(uint32_t nowMillis, uint32_t random)
+  {
+    _state = WAITING;
+    _since = nowMillis;
+    _delay = _backoff / 2 + random % (_backoff / 2 + 1);
+
+    _backoff = _backoff < _maxBackoff / 2 ? _backoff * 2 : _maxBackoff;
+  }
+
+  Client &_client;
+  const MqttTopicHandler *_handlers;
+  const uint8_t _handlerCount;
+  const uint32_t _minBackoff;
+  const uint32_t _maxBackoff;
+  const uint32_t _timeout; // For the whole connect attempt
+
+  State _state = WAITING;
+  uint32_t _backoff;
+  uint32_t _since = 0; // Start of the wait or of the attempt
+  uint32_t _delay = 0; // First attempt right away
+  uint8_t _subscribed = 0;
+
+  unsigned long _attempts = 0;
+  unsigned long _connects = 0;
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+/**
+ * Realtime pixel streaming in the DDP (Distributed Display Protocol) format, as sent by desktop
+ * light sync tools.
+ *
+ * Only the 10 byte header is parsed here. The RGB data of an accepted packet is read by the
+ * caller straight into the pixel buffer at the returned offset, a packet with the push flag
+ * completes a frame. Sequence numbers (1-15, 0 = not used) detect lost and duplicated packets.
+ * Without packets for the timeout the stream ends and the normal rendering takes over again.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+#define DDP_HEADER_SIZE 10
+
+static_assert(sizeof(RgbColor) == 3, "Pixel data is read straight into RgbColor arrays");
+
+// Target of the pixel data of an accepted packet
+struct PixelStreamChunk {
+  uint32_t offset; // Byte offset into the pixel buffer
+  uint16_t length; // Bytes of pixel data following the header
+  bool push;       // Last packet of a frame
+};
+
+template <uint16_t N>
+class PixelStream {
+public:
+  PixelStream(uint32_t timeoutMicros) : _timeoutMicros(timeoutMicros) {}
+
+  /**
+   * Validate the header of a received packet of the given size (header included).
+   * Returns false for packets to be ignored: malformed, not fitting the pixel buffer or duplicated.
+   */
+  bool receive(const uint8_t *header, size_t size, uint32_t nowMicros, PixelStreamChunk &chunk)
+  {
+    uint8_t flags = header[0];
+    uint8_t sequence = header[1] & 0x0f;
+    uint8_t dataType = header[2];
+    uint8_t destination = header[3];
+    uint32_t offset = (uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 | (uint32_t)header[6] << 8 | header[7];
+    uint16_t length = header[8] << 8 | header[9];
+
+    // Version 1 without time code, query or reply flags, RGB 8 bit (or undefined) to the display
+    if (size < DDP_HEADER_SIZE || (flags & 0xfe) != FLAG_VERSION_1 ||
+        (dataType != 0x00 && dataType != 0x01 && dataType != 0x0b) || (destination != 0 && destination != 1) ||
+        length > size - DDP_HEADER_SIZE || offset > BUFFER_SIZE || length > BUFFER_SIZE - offset) {
+      _rejected++;
+      return false;
+    }
+
+    // The same packet again, e.g. resent by the network
+    if (sequence && sequence == _sequence) {
+      _duplicates++;
+      return false;
+    }
+
+    if (sequence && _sequence) {
+      // Packets lost in between, sequence numbers wrap from 15 to 1
+      _lost += (sequence + 15 - _sequence - 1) % 15;
+    }
+    _sequence = sequence;
+
+    chunk.offset = offset;
+    chunk.length = length;
+    chunk.push = flags & FLAG_PUSH;
+
+    _active = true;
+    _lastMicros = nowMicros;
+    _packets++;
+    if (chunk.push) {
+      _frames++;
+    }
+
+    return true;
+  }
+
+  /**
+   * Returns true once when the stream timed out.
+   */
+  bool expire(uint32_t nowMicros)
+  {
+    if (!_active || nowMicros - _lastMicros < _timeoutMicros) {
+      return false;
+    }
+
+    _active = false;
+    _sequence = 0;
+
+    return true;
+  }
+
+  // The stream owns the pixels
+  bool active() const { return _active; }
+
+  unsigned long packets() const { return _packets; }
+  unsigned long frames() const { return _frames; }
+  unsigned long lost() const { return _lost; }
+  unsigned long rejected() const { return _rejected; }
+  unsigned long duplicates() const { return _duplicates; }
+
+private:
+  static constexpr uint8_t FLAG_VERSION_1 = 0x40;
+  static constexpr uint8_t FLAG_PUSH = 0x01;
+  static constexpr uint32_t BUFFER_SIZE = (uint32_t)N * sizeof(RgbColor);
+
+  const uint32_t _timeoutMicros;
+
+  bool _active = false;
+  uint8_t _sequence = 0;
+  uint32_t _lastMicros = 0;
+
+  unsigned long _packets = 0;
+  unsigned long _frames = 0;
+  unsigned long _lost = 0;
+  unsigned long _rejected = 0;
+  unsigned long _duplicates = 0;
+};
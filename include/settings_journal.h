@@ -0,0 +1,275 @@
+#pragma once
+
+/**
+ * Append-only, wear-leveled settings journal on the raw settings flash sector.
+ *
+ * Instead of erasing the sector on every change (what EEPROM.commit() does), each change appends
+ * a record containing only the changed fields into the erased part of the sector. Only when the
+ * sector is full, it is erased once and a full snapshot is written as the first record.
+ *
+ * Record layout (4 byte aligned):
+ *   magic (1), version (1), field mask (1), payload length (1), sequence (2), CRC16 (2),
+ *   payload: the changed fields in field table order, padded to 4 bytes.
+ *
+ * On boot all records are replayed in order. Replaying stops at the first erased or invalid
+ * record (e.g. a torn write on power loss); the next store() then compacts the sector.
+ *
+ * Compaction is the one window in which the settings can be lost: a power loss between the erase
+ * and the snapshot leaves an erased sector and the next boot uses the defaults. There is no second
+ * sector to ping-pong with, the settings own only the sector of the former EEPROM emulation. The
+ * window is a single record write and opens once per sector full of changes.
+ *
+ * New fields are appended to the field table without changing the version: snapshots written
+ * before only have to contain the first snapshotFieldCount fields, the new ones keep their
+ * defaults until they are stored.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hal.h"
+
+/**
+ * A single persisted field of the settings struct.
+ */
+struct JournalField {
+  uint8_t offset;
+  uint8_t size;
+};
+
+/**
+ * CRC16-CCITT (polynomial 0x1021, init 0xFFFF), a nibble at a time with a 16 entry table.
+ */
+inline uint16_t crc16(const uint8_t *data, size_t length, uint16_t crc = 0xFFFF)
+{
+  static const uint16_t table[16] = {0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+                                     0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef};
+
+  while (length--) {
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (*data >> 4)];
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (*data++ & 0x0f)];
+  }
+
+  return crc;
+}
+
+template <typename T, uint8_t FieldCount>
+class SettingsJournal {
+  static_assert(FieldCount <= 8, "The field mask supports up to 8 fields");
+  static_assert(sizeof(T) <= 255, "The payload length is stored in one byte");
+
+public:
+  static constexpr uint8_t MAGIC = 0x5A;
+  static constexpr uint8_t ALL_FIELDS = (uint8_t)((1U << FieldCount) - 1);
+
+  SettingsJournal(const JournalField (&fields)[FieldCount], uint8_t version, uint8_t snapshotFieldCount = FieldCount)
+      : _fields(fields), _version(version), _snapshotFields((uint8_t)((1U << snapshotFieldCount) - 1))
+  {
+  }
+
+  /**
+   * Replay all valid records from the flash sector into settings.
+   * Returns false (and leaves settings untouched) if no valid snapshot was found.
+   */
+  bool restore(T &settings)
+  {
+    T restored = settings;
+    uint32_t offset = 0;
+    bool found = false;
+
+    _writeOffset = FLASH_SECTOR_SIZE;
+
+    while (offset + sizeof(Header) <= FLASH_SECTOR_SIZE) {
+      Record record;
+      flashSectorRead(offset, record.words, sizeof(record.header));
+
+      if (isErased(record.header)) {
+        _writeOffset = offset;
+        break;
+      }
+
+      uint32_t size = recordSize(record.header.length);
+      if (record.header.magic != MAGIC || record.header.version != _version || (record.header.fields & ~ALL_FIELDS) ||
+          record.header.length > sizeof(T) || offset + size > FLASH_SECTOR_SIZE ||
+          (!found && (record.header.fields & _snapshotFields) != _snapshotFields) ||
+          (found && record.header.sequence != (uint16_t)(_sequence + 1))) {
+        break;
+      }
+
+      flashSectorRead(offset + sizeof(record.header), record.words + sizeof(record.header) / 4,
+                      size - sizeof(record.header));
+      if (record.header.crc != crc(record)) {
+        break;
+      }
+
+      apply(restored, record);
+      _sequence = record.header.sequence;
+      offset += size;
+      found = true;
+    }
+
+    if (!found) {
+      // Nothing usable, the next store() starts over with a full snapshot
+      _writeOffset = FLASH_SECTOR_SIZE;
+      _valid = false;
+      return false;
+    }
+
+    settings = restored;
+    _persisted = restored;
+    _valid = true;
+
+    return true;
+  }
+
+  /**
+   * Append the fields changed since the last store()/restore().
+   * Nothing is written if nothing changed.
+   */
+  bool store(const T &settings)
+  {
+    uint8_t fields = _valid ? changedFields(settings) : ALL_FIELDS;
+    if (fields == 0) {
+      return true;
+    }
+
+    Record record;
+    uint32_t size = build(record, settings, fields);
+
+    if (_writeOffset + size > FLASH_SECTOR_SIZE) {
+      // Sector full (or invalid): erase once and start over with a full snapshot
+      if (!flashSectorErase()) {
+        return false;
+      }
+      _erases++;
+      _writeOffset = 0;
+
+      size = build(record, settings, ALL_FIELDS);
+    }
+
+    if (!flashSectorWrite(_writeOffset, record.words, size)) {
+      // Force a compaction on the next store
+      _writeOffset = FLASH_SECTOR_SIZE;
+      return false;
+    }
+
+    _writeOffset += size;
+    _sequence = record.header.sequence;
+    _persisted = settings;
+    _valid = true;
+    _records++;
+    _bytesWritten += size;
+
+    return true;
+  }
+
+  // Sector erases done by this journal since boot
+  unsigned long erases() const { return _erases; }
+  // Records appended since boot
+  unsigned long records() const { return _records; }
+  // Bytes written to flash since boot
+  unsigned long bytesWritten() const { return _bytesWritten; }
+
+private:
+  struct Header {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t fields;
+    uint8_t length;
+    uint16_t sequence;
+    uint16_t crc;
+  };
+
+  union Record {
+    Header header;
+    uint32_t words[(sizeof(Header) + sizeof(T) + 3) / 4];
+    uint8_t bytes[sizeof(words)];
+  };
+
+  static_assert(sizeof(Header) % 4 == 0, "Records must be 4 byte aligned");
+
+  static uint32_t recordSize(uint8_t length) { return sizeof(Header) + ((length + 3) & ~3U); }
+
+  static bool isErased(const Header &header)
+  {
+    const uint8_t *bytes = (const uint8_t *)&header;
+
+    for (size_t i = 0; i < sizeof(header); i++) {
+      if (bytes[i] != 0xFF) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  static uint16_t crc(const Record &record)
+  {
+    uint16_t value = crc16(record.bytes, offsetof(Header, crc));
+
+    return crc16(record.bytes + sizeof(Header), record.header.length, value);
+  }
+
+  uint8_t changedFields(const T &settings) const
+  {
+    uint8_t fields = 0;
+
+    for (uint8_t i = 0; i < FieldCount; i++) {
+      const JournalField &field = _fields[i];
+
+      if (memcmp((const uint8_t *)&settings + field.offset, (const uint8_t *)&_persisted + field.offset, field.size) != 0) {
+        fields |= 1 << i;
+      }
+    }
+
+    return fields;
+  }
+
+  uint32_t build(Record &record, const T &settings, uint8_t fields) const
+  {
+    memset(record.bytes, 0, sizeof(record.bytes));
+
+    uint8_t length = 0;
+    for (uint8_t i = 0; i < FieldCount; i++) {
+      if (fields & (1 << i)) {
+        memcpy(record.bytes + sizeof(Header) + length, (const uint8_t *)&settings + _fields[i].offset, _fields[i].size);
+        length += _fields[i].size;
+      }
+    }
+
+    record.header.magic = MAGIC;
+    record.header.version = _version;
+    record.header.fields = fields;
+    record.header.length = length;
+    record.header.sequence = _sequence + 1;
+    record.header.crc = crc(record);
+
+    return recordSize(length);
+  }
+
+  void apply(T &settings, const Record &record) const
+  {
+    uint8_t position = 0;
+
+    for (uint8_t i = 0; i < FieldCount; i++) {
+      if (record.header.fields & (1 << i)) {
+        memcpy((uint8_t *)&settings + _fields[i].offset, record.bytes + sizeof(Header) + position, _fields[i].size);
+        position += _fields[i].size;
+      }
+    }
+  }
+
+  const JournalField *_fields;
+  const uint8_t _version;
+  const uint8_t _snapshotFields;
+
+  T _persisted;
+  bool _valid = false;
+  uint32_t _writeOffset = FLASH_SECTOR_SIZE;
+  uint16_t _sequence = 0;
+
+  unsigned long _erases = 0;
+  unsigned long _records = 0;
+  unsigned long _bytesWritten = 0;
+};
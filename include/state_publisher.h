@@ -0,0 +1,193 @@
+#pragma once
+
+/**
+ * Coalescing publisher for the retained MQTT state topics.
+ *
+ * The lamp state is compared with the last published one on every poll. Changes are collected
+ * for a window starting with the first unpublished change, then only the changed fields are
+ * published, so spinning the encoder or a petal movement results in one message per field and
+ * window. Payloads are formatted on the stack.
+ *
+ * The client has to provide publish(topic, payload, length, retained).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+struct LampState {
+  bool on;                // Goal state of the flower
+  uint8_t brightness;     // Maximum brightness
+  uint8_t color;          // Color wheel position
+  uint16_t timer;         // Remaining seconds of the sleep timer, 0 if not running
+  uint16_t servoPosition; // Servo position in microseconds
+  const char *effect;     // Name of the LED effect, compared by address
+};
+
+inline bool operator==(const LampState &a, const LampState &b)
+{
+  return a.on == b.on && a.brightness == b.brightness && a.color == b.color && a.timer == b.timer &&
+         a.servoPosition == b.servoPosition && a.effect == b.effect;
+}
+
+inline bool operator!=(const LampState &a, const LampState &b) { return !(a == b); }
+
+// Buffer size for formatLampState()
+#define LAMP_STATE_JSON_SIZE 128
+
+enum StateField : uint8_t {
+  STATE_ON = 1 << 0,
+  STATE_BRIGHTNESS = 1 << 1,
+  STATE_COLOR = 1 << 2,
+  STATE_TIMER = 1 << 3,
+  STATE_SERVO = 1 << 4,
+  STATE_EFFECT = 1 << 5,
+};
+
+#define STATE_FIELD_COUNT 6
+
+template <typename Client>
+class StatePublisher {
+public:
+  /**
+   * topics: state topic of each field, in the order of the StateField flags
+   * windowMillis: changes are collected that long before they are published
+   * timerResolution: a running timer counting down is only published again after that many seconds
+   */
+  StatePublisher(Client &client, const char *const *topics, uint32_t windowMillis, uint16_t timerResolution)
+      : _client(client), _topics(topics), _window(windowMillis), _timerResolution(timerResolution)
+  {
+  }
+
+  /**
+   * Publish all fields with the next poll e.g. after (re)connecting.
+   */
+  void invalidate() { _forced = ALL_FIELDS; }
+
+  /**
+   * Collect changes of the state and publish them once the window is over. Call it from loop()
+   * while connected. Returns true if anything has been published.
+   */
+  bool poll(const LampState &state, uint32_t nowMillis)
+  {
+    uint8_t pending = changedFields(state) | _forced;
+
+    if (!pending) {
+      _pending = false;
+      return false;
+    }
+    if (!_pending) {
+      _pending = true;
+      _pendingSince = nowMillis;
+    }
+    if (nowMillis - _pendingSince < _window) {
+      return false;
+    }
+
+    bool published = false;
+    for (uint8_t i = 0; i < STATE_FIELD_COUNT; i++) {
+      uint8_t field = 1 << i;
+      if (!(pending & field)) {
+        continue;
+      }
+
+      if (!publish(i, state)) {
+        // Disconnected in between: retry the remaining fields with the next poll
+        return published;
+      }
+
+      published = true;
+      _forced &= ~field;
+      copyField(field, state);
+    }
+
+    _pending = false;
+
+    return published;
+  }
+
+  // Published messages and bytes (topics and payloads)
+  unsigned long messages() const { return _messages; }
+  unsigned long bytes() const { return _bytes; }
+
+private:
+  static constexpr uint8_t ALL_FIELDS = (1 << STATE_FIELD_COUNT) - 1;
+
+  uint8_t changedFields(const LampState &state) const
+  {
+    uint8_t fields = 0;
+
+    if (state.on != _published.on) {
+      fields |= STATE_ON;
+    }
+    if (state.brightness != _published.brightness) {
+      fields |= STATE_BRIGHTNESS;
+    }
+    if (state.color != _published.color) {
+      fields |= STATE_COLOR;
+    }
+    if (state.servoPosition != _published.servoPosition) {
+      fields |= STATE_SERVO;
+    }
+    if (state.effect != _published.effect) {
+      fields |= STATE_EFFECT;
+    }
+
+    // Started, stopped or counted down by more than the resolution
+    uint16_t difference = state.timer > _published.timer ? state.timer - _published.timer : _published.timer - state.timer;
+    if ((state.timer == 0) != (_published.timer == 0) || difference >= _timerResolution) {
+      fields |= STATE_TIMER;
+    }
+
+    return fields;
+  }
+
+  void copyField(uint8_t field, const LampState &state)
+  {
+    switch (field) {
+    case STATE_ON: _published.on = state.on; break;
+    case STATE_BRIGHTNESS: _published.brightness = state.brightness; break;
+    case STATE_COLOR: _published.color = state.color; break;
+    case STATE_TIMER: _published.timer = state.timer; break;
+    case STATE_SERVO: _published.servoPosition = state.servoPosition; break;
+    case STATE_EFFECT: _published.effect = state.effect; break;
+    }
+  }
+
+  bool publish(uint8_t index, const LampState &state)
+  {
+    char payload[16];
+    int length;
+
+    switch (1 << index) {
+    case STATE_ON: length = snprintf(payload, sizeof(payload), "%s", state.on ? "ON" : "OFF"); break;
+    case STATE_BRIGHTNESS: length = snprintf(payload, sizeof(payload), "%u", state.brightness); break;
+    case STATE_COLOR: length = snprintf(payload, sizeof(payload), "%u", state.color); break;
+    case STATE_TIMER: length = snprintf(payload, sizeof(payload), "%u", state.timer); break;
+    case STATE_EFFECT: length = snprintf(payload, sizeof(payload), "%s", state.effect); break;
+    default: length = snprintf(payload, sizeof(payload), "%u", state.servoPosition); break;
+    }
+
+    if (!_client.publish(_topics[index], (const uint8_t *)payload, length, true)) {
+      return false;
+    }
+
+    _messages++;
+    _bytes += strlen(_topics[index]) + length;
+
+    return true;
+  }
+
+  Client &_client;
+  const char *const *_topics;
+  const uint32_t _window;
+  const uint16_t _timerResolution;
+
+  LampState _published = {};
+  uint8_t _forced = ALL_FIELDS; // Nothing published yet
+  bool _pending = false;
+  uint32_t _pendingSince = 0;
+
+  unsigned long _messages = 0;
+  unsigned long _bytes = 0;
+};
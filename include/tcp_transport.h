@@ -0,0 +1,339 @@
+#pragma once
+
+/**
+ * Non-blocking TCP transports for the MQTT client.
+ *
+ * Nothing here waits on the network: a lookup and a connect are started by the first call and
+ * polled by the following ones from loop(), received data is buffered until it is read. Interface:
+ *
+ *   NetProgress resolve(const char *host)    Look the host up, the address is kept until forget()
+ *   NetProgress connect(uint16_t port)       Connect to the resolved address
+ *   bool connected()
+ *   size_t available()
+ *   size_t read(uint8_t *buffer, size_t size)
+ *   size_t write(const uint8_t *data, size_t size)    All or nothing, 0 if it does not fit now
+ *   void stop()                              Close the connection
+ *   void forget()                            Drop the resolved address, the next resolve() looks up again
+ *
+ * TcpTransport is the transport of the build: ESPAsyncTCP with an lwIP lookup on the device, POSIX
+ * sockets on the host.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/**
+ * Progress of a step that is polled until it is done
+ */
+enum NetProgress : uint8_t {
+  NET_PENDING,
+  NET_DONE,
+  NET_FAILED,
+};
+
+#ifdef ARDUINO
+
+#include <ESPAsyncTCP.h>
+#include <lwip/dns.h>
+
+/**
+ * AsyncClient of ESPAsyncTCP: the connect returns at once and completes in the lwIP callbacks.
+ * Those run between two loop() calls and never in between, so the receive buffer needs no locking.
+ */
+template <uint16_t ReceiveSize>
+class AsyncTcpTransport {
+public:
+  NetProgress resolve(const char *host)
+  {
+    switch (_lookup) {
+    case LOOKUP_NONE:
+      _lookup = LOOKUP_PENDING;
+      switch (dns_gethostbyname(host, &_address, dnsFound, this)) {
+      case ERR_OK:
+        // Cached or a literal address
+        _lookup = LOOKUP_DONE;
+        return NET_DONE;
+      case ERR_INPROGRESS:
+        return NET_PENDING;
+      default:
+        _lookup = LOOKUP_NONE;
+        return NET_FAILED;
+      }
+
+    case LOOKUP_PENDING:
+      return NET_PENDING;
+
+    case LOOKUP_DONE:
+      return NET_DONE;
+
+    default:
+      _lookup = LOOKUP_NONE;
+      return NET_FAILED;
+    }
+  }
+
+  NetProgress connect(uint16_t port)
+  {
+    switch (_tcp) {
+    case TCP_CLOSED:
+      _head = _tail = 0;
+      _overflow = false;
+      _client.onConnect([](void *self, AsyncClient *) { ((AsyncTcpTransport *)self)->_tcp = TCP_CONNECTED; }, this);
+      _client.onDisconnect([](void *self, AsyncClient *) { ((AsyncTcpTransport *)self)->_tcp = TCP_FAILED; }, this);
+      _client.onError([](void *self, AsyncClient *, int8_t) { ((AsyncTcpTransport *)self)->_tcp = TCP_FAILED; }, this);
+      _client.onData([](void *self, AsyncClient *, void *data, size_t length) {
+        ((AsyncTcpTransport *)self)->receive((const uint8_t *)data, length);
+      }, this);
+
+      // The packets are small, a command should not wait for the ACK of the previous one
+      _client.setNoDelay(true);
+      _tcp = TCP_CONNECTING;
+      if (!_client.connect(IPAddress(_address), port)) {
+        _tcp = TCP_CLOSED;
+        return NET_FAILED;
+      }
+      return NET_PENDING;
+
+    case TCP_CONNECTING:
+      return NET_PENDING;
+
+    case TCP_CONNECTED:
+      return NET_DONE;
+
+    default:
+      return NET_FAILED;
+    }
+  }
+
+  bool connected() const { return _tcp == TCP_CONNECTED && !_overflow; }
+
+  size_t available() const { return (uint16_t)(_head - _tail); }
+
+  size_t read(uint8_t *buffer, size_t size)
+  {
+    size_t count = 0;
+    while (count < size && _tail != _head) {
+      buffer[count++] = _receive[_tail++ % ReceiveSize];
+    }
+    return count;
+  }
+
+  size_t write(const uint8_t *data, size_t size)
+  {
+    // add() would take a part of it, which breaks the stream
+    if (!connected() || _client.space() < size) {
+      return 0;
+    }
+
+    _client.add((const char *)data, size);
+    _client.send();
+    return size;
+  }
+
+  void stop()
+  {
+    if (_tcp != TCP_CLOSED) {
+      _client.close(true);
+    }
+    _tcp = TCP_CLOSED;
+  }
+
+  void forget()
+  {
+    // A lookup still running reports to a transport that no longer waits for it
+    _lookup = LOOKUP_NONE;
+  }
+
+private:
+  enum Lookup : uint8_t { LOOKUP_NONE, LOOKUP_PENDING, LOOKUP_DONE, LOOKUP_FAILED };
+  enum Tcp : uint8_t { TCP_CLOSED, TCP_CONNECTING, TCP_CONNECTED, TCP_FAILED };
+
+  static void dnsFound(const char *, const ip_addr_t *address, void *self)
+  {
+    AsyncTcpTransport *transport = (AsyncTcpTransport *)self;
+    if (transport->_lookup != LOOKUP_PENDING) {
+      return;
+    }
+
+    if (address) {
+      transport->_address = *address;
+      transport->_lookup = LOOKUP_DONE;
+    } else {
+      transport->_lookup = LOOKUP_FAILED;
+    }
+  }
+
+  void receive(const uint8_t *data, size_t length)
+  {
+    if (length > ReceiveSize - available()) {
+      // More than loop() has read: the stream is broken, the connection is given up
+      _overflow = true;
+      return;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+      _receive[_head++ % ReceiveSize] = data[i];
+    }
+  }
+
+  static_assert((ReceiveSize & (ReceiveSize - 1)) == 0, "ReceiveSize must be a power of two");
+
+  AsyncClient _client;
+  ip_addr_t _address = {};
+  volatile Lookup _lookup = LOOKUP_NONE;
+  volatile Tcp _tcp = TCP_CLOSED;
+  volatile bool _overflow = false;
+
+  uint8_t _receive[ReceiveSize];
+  volatile uint16_t _head = 0;
+  uint16_t _tail = 0;
+};
+
+typedef AsyncTcpTransport<MQTT_RECEIVE_BUFFER_SIZE> TcpTransport;
+
+#else
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Host transport on a non-blocking POSIX socket. Host names other than literal addresses are
+ * looked up with getaddrinfo(), which blocks; the tests use the loopback address.
+ */
+class HostTcpTransport {
+public:
+  ~HostTcpTransport() { stop(); }
+
+  NetProgress resolve(const char *host)
+  {
+    if (_resolved) {
+      return NET_DONE;
+    }
+
+    if (inet_pton(AF_INET, host, &_address) != 1) {
+      addrinfo hints = {};
+      addrinfo *result = nullptr;
+      hints.ai_family = AF_INET;
+      if (getaddrinfo(host, nullptr, &hints, &result) != 0 || !result) {
+        return NET_FAILED;
+      }
+      _address = ((sockaddr_in *)result->ai_addr)->sin_addr;
+      freeaddrinfo(result);
+    }
+
+    _resolved = true;
+    return NET_DONE;
+  }
+
+  NetProgress connect(uint16_t port)
+  {
+    if (_socket < 0) {
+      sockaddr_in address = {};
+      int noDelay = 1;
+      address.sin_family = AF_INET;
+      address.sin_port = htons(port);
+      address.sin_addr = _address;
+
+      _socket = socket(AF_INET, SOCK_STREAM, 0);
+      if (_socket < 0) {
+        return NET_FAILED;
+      }
+      fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL) | O_NONBLOCK);
+      setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+      if (::connect(_socket, (sockaddr *)&address, sizeof(address)) == 0) {
+        _connected = true;
+      } else if (errno != EINPROGRESS) {
+        stop();
+        return NET_FAILED;
+      }
+    }
+
+    if (!_connected) {
+      pollfd pending = {_socket, POLLOUT, 0};
+      if (poll(&pending, 1, 0) == 0) {
+        return NET_PENDING;
+      }
+
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (getsockopt(_socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+        stop();
+        return NET_FAILED;
+      }
+      _connected = true;
+    }
+
+    return NET_DONE;
+  }
+
+  bool connected()
+  {
+    if (!_connected) {
+      return false;
+    }
+
+    // A closed connection reads as end of stream
+    uint8_t peek;
+    ssize_t result = recv(_socket, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      stop();
+      return false;
+    }
+    return true;
+  }
+
+  size_t available()
+  {
+    int count = 0;
+    return _connected && ioctl(_socket, FIONREAD, &count) == 0 ? count : 0;
+  }
+
+  size_t read(uint8_t *buffer, size_t size)
+  {
+    ssize_t result = _connected ? recv(_socket, buffer, size, MSG_DONTWAIT) : -1;
+    return result > 0 ? result : 0;
+  }
+
+  size_t write(const uint8_t *data, size_t size)
+  {
+    ssize_t result = _connected ? send(_socket, data, size, MSG_DONTWAIT | MSG_NOSIGNAL) : -1;
+    if (result != (ssize_t)size) {
+      // A part of a packet breaks the stream
+      stop();
+      return 0;
+    }
+    return size;
+  }
+
+  void stop()
+  {
+    if (_socket >= 0) {
+      close(_socket);
+    }
+    _socket = -1;
+    _connected = false;
+  }
+
+  void forget() { _resolved = false; }
+
+private:
+  in_addr _address = {};
+  bool _resolved = false;
+  int _socket = -1;
+  bool _connected = false;
+};
+
+typedef HostTcpTransport TcpTransport;
+
+#endif
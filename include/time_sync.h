@@ -0,0 +1,215 @@
+#pragma once
+
+/**
+ * Leader/follower time sync for several lamps in one room, over UDP multicast.
+ *
+ * The lamp with the lowest id is the leader and multicasts its clock (micros) periodically. A
+ * lamp becomes leader itself when it did not hear a lower id for three intervals. Followers
+ * estimate the offset to the leader clock from the last samples: network delays only make a
+ * sample smaller, so the largest one is taken.
+ *
+ * Movement commands carry their start time on the leader clock, so every lamp can convert it to
+ * its own clock and start the movement at the same time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIME_SYNC_PACKET_SIZE 15
+
+// Movement to start at the same time on all lamps
+struct SyncCommand {
+  uint32_t startMicros; // Local clock
+  bool goalState;
+  uint8_t wheelPosition;
+  uint8_t brightnessMax;
+};
+
+class TimeSync {
+public:
+  TimeSync(uint32_t id, uint32_t intervalMicros) : _id(id), _intervalMicros(intervalMicros), _leaderId(id) {}
+
+  /**
+   * Returns the length of a packet to multicast now, 0 if there is none. Call it from loop().
+   */
+  size_t poll(uint32_t nowMicros, uint8_t *packet)
+  {
+    if (_leaderId != _id && nowMicros - _leaderSeen > 3 * _intervalMicros) {
+      // Leader is gone
+      _leaderId = _id;
+      _samples = 0;
+      _next = 0;
+    }
+
+    if (_leaderId != _id || (_sent && nowMicros - _lastSync < _intervalMicros)) {
+      return 0;
+    }
+
+    _sent = true;
+    _lastSync = nowMicros;
+
+    return encode(packet, TYPE_SYNC, nowMicros);
+  }
+
+  /**
+   * Encode a movement command, its start time is converted to the leader clock.
+   */
+  size_t command(const SyncCommand &command, uint8_t *packet)
+  {
+    size_t length = encode(packet, TYPE_COMMAND, command.startMicros + offset());
+
+    packet[length++] = command.goalState;
+    packet[length++] = command.wheelPosition;
+    packet[length++] = command.brightnessMax;
+
+    return length;
+  }
+
+  /**
+   * Handle a received packet. Returns true for a movement command, its start time converted to
+   * the local clock.
+   */
+  bool receive(const uint8_t *packet, size_t size, uint32_t nowMicros, SyncCommand &command)
+  {
+    if (size < HEADER_SIZE || packet[0] != MAGIC_0 || packet[1] != MAGIC_1 || packet[2] != VERSION) {
+      return false;
+    }
+
+    uint32_t sender = read32(packet + 4);
+    uint32_t time = read32(packet + 8);
+
+    if (sender == _id) {
+      return false;
+    }
+
+    switch (packet[3]) {
+    case TYPE_SYNC:
+      if (sender < _leaderId) {
+        // Lower id takes over
+        _leaderId = sender;
+        _samples = 0;
+        _next = 0;
+      }
+      if (sender == _leaderId) {
+        _leaderSeen = nowMicros;
+        addSample(time - nowMicros);
+      }
+      return false;
+
+    case TYPE_COMMAND:
+      if (size < HEADER_SIZE + 3) {
+        return false;
+      }
+
+      command.startMicros = time - offset();
+      command.goalState = packet[HEADER_SIZE];
+      command.wheelPosition = packet[HEADER_SIZE + 1];
+      command.brightnessMax = packet[HEADER_SIZE + 2];
+      return true;
+    }
+
+    return false;
+  }
+
+  bool leader() const { return _leaderId == _id; }
+
+  // The leader clock is known
+  bool synced() const { return leader() || _samples > 0; }
+
+  /**
+   * Leader clock minus local clock in microseconds (wrapping like the clocks)
+   */
+  uint32_t offset() const
+  {
+    if (leader() || !_samples) {
+      return 0;
+    }
+
+    uint32_t offset = _offsets[0];
+    for (uint8_t i = 1; i < _samples; i++) {
+      if ((int32_t)(_offsets[i] - offset) > 0) {
+        offset = _offsets[i];
+      }
+    }
+
+    return offset;
+  }
+
+  /**
+   * Spread of the offset samples in microseconds, an upper bound of the sync error caused by
+   * varying network delays.
+   */
+  uint32_t syncError() const
+  {
+    if (leader() || !_samples) {
+      return 0;
+    }
+
+    uint32_t max = offset();
+    uint32_t spread = 0;
+    for (uint8_t i = 0; i < _samples; i++) {
+      if (max - _offsets[i] > spread) {
+        spread = max - _offsets[i];
+      }
+    }
+
+    return spread;
+  }
+
+private:
+  static constexpr uint8_t MAGIC_0 = 'F';
+  static constexpr uint8_t MAGIC_1 = 'L';
+  static constexpr uint8_t VERSION = 1;
+  static constexpr uint8_t TYPE_SYNC = 1;
+  static constexpr uint8_t TYPE_COMMAND = 2;
+  static constexpr size_t HEADER_SIZE = 12;
+  static constexpr uint8_t SAMPLES = 8;
+
+  static_assert(HEADER_SIZE + 3 == TIME_SYNC_PACKET_SIZE, "Packet size mismatch");
+
+  size_t encode(uint8_t *packet, uint8_t type, uint32_t time) const
+  {
+    packet[0] = MAGIC_0;
+    packet[1] = MAGIC_1;
+    packet[2] = VERSION;
+    packet[3] = type;
+    write32(packet + 4, _id);
+    write32(packet + 8, time);
+
+    return HEADER_SIZE;
+  }
+
+  void addSample(uint32_t offset)
+  {
+    _offsets[_next] = offset;
+    _next = (_next + 1) % SAMPLES;
+    if (_samples < SAMPLES) {
+      _samples++;
+    }
+  }
+
+  static void write32(uint8_t *p, uint32_t value)
+  {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+  }
+
+  static uint32_t read32(const uint8_t *p)
+  {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+  }
+
+  const uint32_t _id;
+  const uint32_t _intervalMicros;
+
+  uint32_t _leaderId;
+  uint32_t _leaderSeen = 0;
+  bool _sent = false;
+  uint32_t _lastSync = 0;
+
+  uint32_t _offsets[SAMPLES];
+  uint8_t _samples = 0;
+  uint8_t _next = 0;
+};
@@ -0,0 +1,4 @@
+#include "color.h"
+
+constexpr WheelTable wheelTable PROGMEM;
+constexpr PerceptualTable perceptualTable PROGMEM;
@@ -0,0 +1,8 @@
+#include "effects.h"
+
+const uint32_t effectPalettes[EFFECT_PALETTES][EFFECT_PALETTE_STOPS] PROGMEM = {
+  {0xff2000, 0xff8000, 0xc00040, 0x400080}, // Sunset
+  {0x0010ff, 0x00a0ff, 0x00ffa0, 0x0040c0}, // Ocean
+  {0x10ff00, 0x80ff20, 0x208000, 0xa0c000}, // Forest
+  {0xff0000, 0xff4000, 0xffc000, 0x800000}, // Lava
+};
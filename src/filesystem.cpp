@@ -0,0 +1,196 @@
+#include "filesystem.h"
+
+#include <ArduinoJson.h>
+
+// OTA settings
+unsigned int otaPort = 8266;
+char otaPassword[CONFIG_STRING_SIZE] = ""; // Set OTA password via WiFi manager!
+
+// MQTT settings
+char mqtt_server[CONFIG_STRING_SIZE] = "<SERVER>";
+unsigned int mqtt_port = 1883;
+char device_id[CONFIG_STRING_SIZE] = "esp8266-nightlamp";
+char mqtt_user[CONFIG_STRING_SIZE] = "<USER>";
+char mqtt_pass[CONFIG_STRING_SIZE] = "<PWD>";
+
+// Keys of /config.json plus some unknown ones
+typedef StaticJsonDocument<JSON_OBJECT_SIZE(12)> ConfigJson;
+
+#if DEBUG == true
+void printConfig()
+{
+  Serial.println("OTA");
+  Serial.print("\tpassword : "); Serial.println(otaPassword);
+  Serial.print("\tport : "); Serial.println(otaPort);
+  Serial.println("MQTT");
+  Serial.print("\tserver : "); Serial.println(mqtt_server);
+  Serial.print("\tport : "); Serial.println(mqtt_port);
+  Serial.print("\tdevice ID : "); Serial.println(device_id);
+  Serial.print("\tuser : "); Serial.println(mqtt_user);
+  Serial.print("\tpass : "); Serial.println(mqtt_pass);
+}
+#endif
+
+bool loadConfigRecord()
+{
+  File file = LittleFS.open("/config.bin", "r");
+  if (!file) {
+    return false;
+  }
+
+  ConfigRecord record;
+  size_t length = file.readBytes((char *)&record, sizeof(record));
+  file.close();
+
+  if (length != sizeof(record) || !validConfigRecord(record)) {
+#if DEBUG == true
+    Serial.println("invalid config record");
+#endif
+    return false;
+  }
+
+  otaPort = record.otaPort;
+  mqtt_port = record.mqttPort;
+  memcpy(otaPassword, record.otaPassword, CONFIG_STRING_SIZE);
+  memcpy(mqtt_server, record.mqttServer, CONFIG_STRING_SIZE);
+  memcpy(device_id, record.deviceId, CONFIG_STRING_SIZE);
+  memcpy(mqtt_user, record.mqttUser, CONFIG_STRING_SIZE);
+  memcpy(mqtt_pass, record.mqttPass, CONFIG_STRING_SIZE);
+
+  return true;
+}
+
+bool storeConfigRecord()
+{
+  ConfigRecord record = {};
+
+  record.otaPort = otaPort;
+  record.mqttPort = mqtt_port;
+  copyConfigString(record.otaPassword, otaPassword, CONFIG_STRING_SIZE);
+  copyConfigString(record.mqttServer, mqtt_server, CONFIG_STRING_SIZE);
+  copyConfigString(record.deviceId, device_id, CONFIG_STRING_SIZE);
+  copyConfigString(record.mqttUser, mqtt_user, CONFIG_STRING_SIZE);
+  copyConfigString(record.mqttPass, mqtt_pass, CONFIG_STRING_SIZE);
+  sealConfigRecord(record);
+
+  File file = LittleFS.open("/config.bin", "w");
+  if (!file) {
+#if DEBUG == true
+    Serial.println("failed to open config record for writing");
+#endif
+    return false;
+  }
+
+  size_t length = file.write((const uint8_t *)&record, sizeof(record));
+  file.close();
+
+  return length == sizeof(record);
+}
+
+static void importConfigString(ConfigJson &json, const char *key, char *destination)
+{
+  if (json.containsKey(key)) {
+    copyConfigString(destination, json[key], CONFIG_STRING_SIZE);
+  }
+}
+
+/**
+ * Read /config.json into a stack buffer and parse it in place, the strings are copied bounded
+ */
+bool importConfigJson()
+{
+  File file = LittleFS.open("/config.json", "r");
+  if (!file) {
+    return false;
+  }
+
+  char buffer[CONFIG_JSON_SIZE];
+  size_t size = file.size();
+  size_t length = size < sizeof(buffer) ? file.readBytes(buffer, size) : 0;
+  file.close();
+
+  ConfigJson json;
+  if (length == 0 || length != size || deserializeJson(json, buffer, length)) {
+#if DEBUG == true
+    Serial.println("failed to load json config");
+#endif
+    return false;
+  }
+
+  // Keys missing in the file keep their current value
+  // OTA
+  importConfigString(json, "otaPassword", otaPassword);
+  otaPort = json["otaPort"] | otaPort;
+  // MQTT
+  importConfigString(json, "mqttServer", mqtt_server);
+  mqtt_port = json["mqttPort"] | mqtt_port;
+  importConfigString(json, "mqttDeviceId", device_id);
+  importConfigString(json, "mqttUser", mqtt_user);
+  importConfigString(json, "mqttPass", mqtt_pass);
+
+  return true;
+}
+
+bool exportConfigJson()
+{
+  // Strings are linked, not copied into the document
+  ConfigJson json;
+  // OTA
+  json["otaPassword"] = (const char *)otaPassword;
+  json["otaPort"] = otaPort;
+  // MQTT
+  json["mqttServer"] = (const char *)mqtt_server;
+  json["mqttPort"] = mqtt_port;
+  json["mqttDeviceId"] = (const char *)device_id;
+  json["mqttUser"] = (const char *)mqtt_user;
+  json["mqttPass"] = (const char *)mqtt_pass;
+
+  char buffer[CONFIG_JSON_SIZE];
+  size_t length = serializeJson(json, buffer, sizeof(buffer));
+
+  File file = LittleFS.open("/config.json", "w");
+  if (!file) {
+#if DEBUG == true
+    Serial.println("failed to open config file for writing");
+#endif
+    return false;
+  }
+
+  size_t written = file.write((const uint8_t *)buffer, length);
+  file.close();
+
+  return written == length;
+}
+
+void prepareFileSystem()
+{
+  // Clean FS, for testing
+  // LittleFS.format();
+
+#if DEBUG == true
+  Serial.println("mounting FS...");
+#endif
+
+  if (!LittleFS.begin())
+  {
+    Serial.println("failed to mount FS");
+    return;
+  }
+
+  if (loadConfigRecord()) {
+#if DEBUG == true
+    Serial.println("loaded config record");
+    printConfig();
+#endif
+    return;
+  }
+
+  // First boot after an update from the JSON config, or the record is invalid
+  if (importConfigJson()) {
+#if DEBUG == true
+    Serial.println("imported json config");
+    printConfig();
+#endif
+    storeConfigRecord();
+  }
+}
@@ -0,0 +1,695 @@
+#include "flower.h"
+
+#include <ArduinoJson.h>
+
+Settings settings;
+
+// Persisted fields of the settings, new ones are appended (see SETTINGS_SNAPSHOT_FIELDS)
+static const JournalField settingsFields[] = {
+  {offsetof(Settings, servoPosition), sizeof(Settings::servoPosition)},
+  {offsetof(Settings, brightness), sizeof(Settings::brightness)},
+  {offsetof(Settings, wheelPosition), sizeof(Settings::wheelPosition)},
+  {offsetof(Settings, flowerGoalState), sizeof(Settings::flowerGoalState)},
+  {offsetof(Settings, brightnessMax), sizeof(Settings::brightnessMax)},
+  {offsetof(Settings, timer), sizeof(Settings::timer)},
+  {offsetof(Settings, effect), sizeof(Settings::effect)},
+};
+
+SettingsJournal<Settings, 7> settingsJournal(settingsFields, SETTINGS_VERSION, SETTINGS_SNAPSHOT_FIELDS);
+
+bool settingsDirty = false;
+unsigned long settingsDirtySince = 0; // First change not yet written
+unsigned long settingsChanged = 0;    // Last change
+unsigned long maxSettingsFlushMicros = 0;
+
+Servo myServo;
+
+bool doColorChange = true;
+
+// Petal animation timing variables
+int frameDuration = 3000;         // Number of milliseconds for complete movement
+int frameElapsed = 0;             // How much of the frame has gone by, will range from 0 to frameDuration
+unsigned long previousMillis = 0; // The last time we ran the position interpolation
+unsigned long currentMillis = 0;  // Current time, we will update this continuosly
+int interval = 0;
+int movementDirection = 0; // 0 = stopped, 1 opening, -1 closing
+
+unsigned long targetTimer = 0;
+
+// Movement waiting for its start time (time sync)
+struct ScheduledMovement {
+  bool pending;
+  bool broadcast; // Triggered locally, to be sent to the other lamps
+  SyncCommand command;
+};
+
+static ScheduledMovement scheduledMovement = {};
+
+// Render/servo updates run at a fixed rate
+FrameScheduler frameScheduler(FRAMES_PER_SECOND);
+
+FrameCommitter<NUM_LEDS, LedOutput> frameCommitter;
+
+EffectEngine<NUM_LEDS> effectEngine;
+
+Crossfade<NUM_LEDS> crossfade;
+int fadeDuration = CROSSFADE_DURATION;
+
+// Wheel position and effect of the crossfade target
+static uint8_t fadeWheelPosition = 0;
+static uint8_t fadeEffect = EFFECT_WHEEL;
+
+PixelStream<NUM_LEDS> pixelStream(PIXEL_STREAM_TIMEOUT * 1000UL);
+// A streamed frame is being received into the back buffer
+static bool streamFrameStarted = false;
+
+// MQTT topics
+const char mqtt_topic_brightness[] = "esp/nightlamp/brightness";
+const char mqtt_topic_timer[] = "esp/nightlamp/timer";
+const char mqtt_topic_color[] = "esp/nightlamp/color";
+const char mqtt_topic_toggle[] = "esp/nightlamp/toggle";
+const char mqtt_topic_command[] = "esp/nightlamp/command";
+const char mqtt_topic_effect[] = "esp/nightlamp/effect";
+const char mqtt_topic_metrics[] = "esp/nightlamp/metrics";
+
+// Retained state topics, in the order of the StateField flags
+const char *const mqtt_state_topics[STATE_FIELD_COUNT] = {
+  "esp/nightlamp/state/on",
+  "esp/nightlamp/state/brightness",
+  "esp/nightlamp/state/color",
+  "esp/nightlamp/state/timer",
+  "esp/nightlamp/state/servo",
+  "esp/nightlamp/state/effect",
+};
+
+/**
+ * Take over the settings the EEPROM library left at the start of the sector, sanitized like they
+ * were when it was still used. Returns false if the sector holds something else.
+ */
+static bool restoreLegacySettings() {
+  union {
+    LegacySettings legacy;
+    uint32_t words[(sizeof(LegacySettings) + 3) / 4];
+    uint8_t bytes[sizeof(words)];
+  } image;
+
+  if (!flashSectorRead(0, image.words, sizeof(image.words))) {
+    return false;
+  }
+
+  // Erased (a new device) or the start of a damaged journal
+  bool erased = true;
+  for (uint32_t word : image.words) {
+    erased = erased && word == 0xFFFFFFFF;
+  }
+  if (erased || (image.bytes[0] == settingsJournal.MAGIC && image.bytes[1] == SETTINGS_VERSION)) {
+    return false;
+  }
+
+  const LegacySettings &legacy = image.legacy;
+  if (!(legacy.brightness >= BRIGHTNESS_START && legacy.brightness <= BRIGHTNESS_END)) {
+    return false;
+  }
+
+  // Keep the servo within its range, the attached servo is moved there right away
+  bool servoInRange = legacy.servoPosition >= SERVO_OPEN && legacy.servoPosition <= SERVO_CLOSED;
+  settings.servoPosition = servoInRange ? legacy.servoPosition : SERVO_CLOSED;
+  settings.brightness = legacy.brightness;
+  settings.wheelPosition = legacy.wheelPosition;
+  // The EEPROM might store non-boolean values (non equal to "0" and "1")
+  settings.flowerGoalState = legacy.flowerGoalState ? 1 : 0;
+  settings.brightnessMax = legacy.brightnessMax > 0 ? legacy.brightnessMax : BRIGHTNESS_END;
+  settings.timer = legacy.timer;
+
+  return true;
+}
+
+/**
+ * Restore the newest valid settings from the settings journal, or take over the ones stored by
+ * the EEPROM library on the first boot after the update.
+ * Keeps the defaults if there are none.
+ */
+bool restoreSettings() {
+  if (settingsJournal.restore(settings)) {
+    return true;
+  }
+
+  if (!restoreLegacySettings()) {
+    return false;
+  }
+
+  // The first snapshot of the journal replaces the EEPROM layout
+  settingsJournal.store(settings);
+  return true;
+}
+
+/**
+ * Mark the settings as changed. They are written behind by persistSettings().
+ */
+void storeSettings() {
+  if (!settingsDirty) {
+    settingsDirty = true;
+    settingsDirtySince = millis();
+  }
+
+  settingsChanged = millis();
+}
+
+/**
+ * Write changed settings into the settings journal once they settled. Call it from loop().
+ */
+void persistSettings() {
+  if (!settingsDirty) {
+    return;
+  }
+
+  unsigned long now = millis();
+  if (now - settingsChanged < SETTINGS_QUIET_TIME && now - settingsDirtySince < SETTINGS_MAX_WRITE_DELAY) {
+    return;
+  }
+
+  flushSettings();
+}
+
+/**
+ * Write changed settings into the settings journal right away e.g. before a reset or OTA update.
+ */
+void flushSettings() {
+  if (!settingsDirty) {
+    return;
+  }
+
+  unsigned long start = micros();
+
+  settingsDirty = false;
+  settingsJournal.store(settings);
+
+  unsigned long duration = micros() - start;
+  if (duration > maxSettingsFlushMicros) {
+    maxSettingsFlushMicros = duration;
+  }
+}
+
+/**
+ * Render the effect with the colours from the wheel, sent with the next frame commit.
+ * A new wheel position or effect is faded in.
+ */
+void setWheel(byte WheelPos, Interpolator::Ratio brightness)
+{
+#if LED_PERCEPTUAL_BRIGHTNESS == true
+  brightness = perceptualRatio(brightness);
+#endif
+
+  // Convert brightness [0,1.0] to [0,255] for the LED strip
+  settings.brightness = Interpolator::lerp(BRIGHTNESS_START, settings.brightnessMax, brightness);
+
+  // A realtime stream owns the pixels
+  if (pixelStream.active()) {
+    return;
+  }
+
+  RgbColor *pixels = frameCommitter.render();
+  EffectFrame frame = {(uint32_t)millis(), WheelPos};
+
+#if CROSSFADE_ENABLED == true
+  effectEngine.render(settings.effect, crossfade.target(), frame, cyclesPerMicrosecond());
+
+  if (WheelPos != fadeWheelPosition || settings.effect != fadeEffect) {
+    fadeWheelPosition = WheelPos;
+    fadeEffect = settings.effect;
+    crossfade.retarget(fadeDuration * FRAMES_PER_SECOND / 1000);
+  }
+
+  // The brightness is applied while blending, the frame is sent with full brightness
+  crossfade.render(pixels, settings.brightness);
+  frameCommitter.present(255);
+#else
+  effectEngine.render(settings.effect, pixels, frame, cyclesPerMicrosecond());
+  frameCommitter.present(settings.brightness);
+#endif
+}
+
+/**
+ * Switch the LED effect, rendered right away
+ */
+void setEffect(uint8_t effect)
+{
+  settings.effect = effect;
+
+  setWheel(settings.wheelPosition, Interpolator::ratio(frameElapsed, frameDuration));
+  storeSettings();
+}
+
+void nextEffect()
+{
+  setEffect((effectEngine.valid(settings.effect) + 1) % EFFECT_COUNT);
+}
+
+/**
+ * Buffer to receive the pixels of a stream chunk into. The first chunk of a frame starts from the
+ * latest presented frame, so a frame sent only in part leaves the other pixels as they are.
+ */
+RgbColor *streamedPixels()
+{
+  if (!streamFrameStarted) {
+    memcpy(frameCommitter.back(), frameCommitter.latest(), sizeof(RgbColor) * NUM_LEDS);
+    streamFrameStarted = true;
+  }
+
+  return frameCommitter.back();
+}
+
+/**
+ * Show a frame completely received from the pixel stream into the back buffer, right away
+ */
+void showStreamedPixels()
+{
+  streamFrameStarted = false;
+  frameCommitter.present(settings.brightnessMax);
+  frameCommitter.commit();
+}
+
+/**
+ * Fall back to the normal rendering once the pixel stream timed out. Call it from loop().
+ */
+void updatePixelStream()
+{
+  if (pixelStream.expire(micros())) {
+    // The normal rendering owns the back buffer again
+    streamFrameStarted = false;
+    setWheel(settings.wheelPosition, Interpolator::ratio(frameElapsed, frameDuration));
+  }
+}
+
+void prepareTargetTimer() {
+#if DEBUG == true
+  Serial.println("--- prepareTargetTimer ---");
+  Serial.print("settings.timer: "); Serial.println(settings.timer);
+  Serial.print("settings.flowerGoalState: "); Serial.println(settings.flowerGoalState);
+#endif
+
+  if (settings.timer > 0 && settings.flowerGoalState) {
+    targetTimer = millis() + settings.timer * 1000;
+  }
+}
+
+/**
+ * Start opening or closing the flower as of the given time
+ */
+static void startMovement(bool on, unsigned long startMillis)
+{
+  settings.flowerGoalState = on;
+  movementDirection = on ? 1 : -1;
+  doColorChange = true;
+  previousMillis = startMillis;
+
+  storeSettings();
+}
+
+/**
+ * Open or close the flower. With time sync the movement is scheduled to start on all lamps at
+ * the same time.
+ */
+void setFlowerGoalState(bool on)
+{
+#if TIME_SYNC_ENABLED == true
+  scheduledMovement.pending = true;
+  scheduledMovement.broadcast = true;
+  scheduledMovement.command = {(uint32_t)(micros() + TIME_SYNC_LEAD * 1000UL), on, settings.wheelPosition, settings.brightnessMax};
+#else
+  startMovement(on, millis());
+#endif
+}
+
+void toggleFlower()
+{
+  setFlowerGoalState(!(scheduledMovement.pending ? scheduledMovement.command.goalState : settings.flowerGoalState));
+}
+
+/**
+ * Schedule a movement received from another lamp. Its color and brightness are taken over now, so
+ * changes made here before the start are kept.
+ */
+void scheduleMovement(const SyncCommand &command)
+{
+  settings.wheelPosition = command.wheelPosition;
+  settings.brightnessMax = command.brightnessMax;
+
+  scheduledMovement.pending = true;
+  scheduledMovement.broadcast = false;
+  scheduledMovement.command = command;
+}
+
+/**
+ * Movement triggered locally since the last call, to be sent to the other lamps
+ */
+bool takeMovementBroadcast(SyncCommand &command)
+{
+  if (!scheduledMovement.broadcast) {
+    return false;
+  }
+
+  scheduledMovement.broadcast = false;
+  command = scheduledMovement.command;
+
+  return true;
+}
+
+/**
+ * Start the scheduled movement once its time has come. Call it from loop().
+ */
+void updateScheduledMovement()
+{
+  const SyncCommand &command = scheduledMovement.command;
+  uint32_t late = micros() - command.startMicros;
+
+  if (!scheduledMovement.pending || (int32_t)late < 0) {
+    return;
+  }
+
+  scheduledMovement.pending = false;
+
+  // Count the movement from the start time, not from the loop which noticed it
+  startMovement(command.goalState, millis() - late / 1000);
+}
+
+/**
+ * Snapshot of the state published to the state topics
+ */
+LampState currentLampState()
+{
+  LampState state;
+  long remaining = targetTimer ? (long)(targetTimer - millis()) : 0;
+
+  state.on = settings.flowerGoalState;
+  state.brightness = settings.brightnessMax;
+  state.color = settings.wheelPosition;
+  state.timer = remaining > 0 ? (remaining + 999) / 1000 : 0;
+  state.servoPosition = myServo.readMicroseconds();
+  state.effect = effectEngine.name(settings.effect);
+
+  return state;
+}
+
+/**
+ * Format the current state as JSON, returns the length like snprintf()
+ */
+int formatLampState(char *buffer, size_t size)
+{
+  LampState state = currentLampState();
+
+  return snprintf(buffer, size,
+                  "{\"state\":\"%s\",\"brightness\":%u,\"color\":%u,\"timer\":%u,\"servo\":%u,\"effect\":\"%s\"}",
+                  state.on ? "ON" : "OFF", state.brightness, state.color, state.timer, state.servoPosition,
+                  state.effect);
+}
+
+/**
+ * Update the flower: open/close it and adjust the LEDs (dim up/down)
+ */
+void updateFlower()
+{
+  unsigned long currentMillis = millis();
+  interval = currentMillis - previousMillis;
+  previousMillis = currentMillis;
+
+  frameElapsed += movementDirection * interval;
+  Interpolator::Ratio frameElapsedRatio = Interpolator::ratio(frameElapsed, frameDuration);
+  Interpolator::Ratio brightness = frameElapsedRatio;
+
+  if (frameElapsed < 0)
+  {
+    movementDirection = 0;
+    frameElapsed = 0;
+
+#if DEBUG == true
+    Serial.println("closed");
+#endif
+
+    brightness = Interpolator::ZERO;
+    settings.brightness = BRIGHTNESS_START;
+    settings.servoPosition = SERVO_OPEN;
+    doColorChange = false;
+
+    // Unset target timer
+    targetTimer = 0;
+
+    storeSettings();
+  }
+  if (frameElapsed > frameDuration)
+  {
+    movementDirection = 0;
+    frameElapsed = frameDuration;
+
+#if DEBUG == true
+    Serial.println("opened");
+#endif
+
+    brightness = Interpolator::ONE;
+    settings.brightness = settings.brightnessMax;
+    settings.servoPosition = SERVO_CLOSED;
+    doColorChange = false;
+
+    prepareTargetTimer();
+
+    storeSettings();
+  }
+
+  if (movementDirection != 0)
+  {
+    // Determine new position/brightness by interpolation between endpoints
+    // int newServoMicros = (SERVO_CLOSED + int(frameElapsedRatio * (SERVO_OPEN - SERVO_CLOSED)));
+    int newServoMicros = Interpolator::lerp(SERVO_OPEN, SERVO_CLOSED, frameElapsedRatio);
+
+    myServo.write(newServoMicros);
+  }
+
+#if CROSSFADE_ENABLED == true
+  // A running crossfade steps once per frame
+  bool fading = crossfade.advance();
+#else
+  bool fading = false;
+#endif
+
+  // Trigger LED color/brightness change only if the color or brightness has been changed.
+  // This should reduce flickering further. Animated effects are rendered every frame while lit.
+  if (doColorChange || fading || (effectEngine.animated(settings.effect) && settings.brightness > BRIGHTNESS_START)) {
+    setWheel(settings.wheelPosition, brightness);
+  }
+}
+
+static void handleBrightness(const byte *payload, unsigned int length)
+{
+  long value;
+
+  if (parseInteger(payload, length, 1, 255, value)) {
+    settings.brightnessMax = value;
+
+    setWheel(settings.wheelPosition, Interpolator::ratio(frameElapsed, frameDuration));
+    storeSettings();
+  }
+}
+
+static void handleTimer(const byte *payload, unsigned int length)
+{
+  long value;
+
+  if (parseInteger(payload, length, 0, UINT16_MAX, value)) {
+    settings.timer = value;
+
+    prepareTargetTimer();
+    storeSettings();
+  }
+}
+
+static void handleColor(const byte *payload, unsigned int length)
+{
+  long value;
+
+  if (parseInteger(payload, length, 0, 255, value)) {
+    settings.wheelPosition = value;
+
+    setWheel(settings.wheelPosition, Interpolator::ratio(frameElapsed, frameDuration));
+    storeSettings();
+  }
+}
+
+// Any payload toggles
+static void handleToggle(const byte * /* payload */, unsigned int /* length */)
+{
+  toggleFlower();
+}
+
+/**
+ * Effect by name or number
+ */
+static void handleEffect(const byte *payload, unsigned int length)
+{
+  uint8_t effect;
+  long value;
+
+  if (effectEngine.find((const char *)payload, length, effect)) {
+    setEffect(effect);
+  } else if (parseInteger(payload, length, 0, EFFECT_COUNT - 1, value)) {
+    setEffect(value);
+  }
+}
+
+static bool isInteger(JsonVariant value, long min, long max)
+{
+  return value.is<long>() && value.as<long>() >= min && value.as<long>() <= max;
+}
+
+/**
+ * Read the goal state of a command: either true/false or "ON"/"OFF"
+ */
+static bool readState(JsonVariant value, bool &on)
+{
+  if (value.is<bool>()) {
+    on = value.as<bool>();
+    return true;
+  }
+
+  const char *state = value.as<const char *>();
+  if (state && (strcmp(state, "ON") == 0 || strcmp(state, "OFF") == 0)) {
+    on = strcmp(state, "ON") == 0;
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * Change the duration of a complete petal movement, keeping the current position.
+ */
+static void setTransition(long duration)
+{
+  frameElapsed = (uint32_t)frameElapsed * duration / frameDuration;
+  frameDuration = duration;
+}
+
+/**
+ * Read an effect of a command: its name or number
+ */
+static bool readEffect(JsonVariant value, uint8_t &effect)
+{
+  if (isInteger(value, 0, EFFECT_COUNT - 1)) {
+    effect = value.as<long>();
+    return true;
+  }
+
+  const char *name = value.as<const char *>();
+
+  return name && effectEngine.find(name, strlen(name), effect);
+}
+
+/**
+ * JSON command with any of brightness, color, timer, state, effect, transition and fade (ms), e.g.
+ * {"state":"ON","brightness":120,"color":40,"effect":"rainbow","transition":1500,"fade":1000}
+ *
+ * A command is validated completely first and then applied at once: a single render and a
+ * single settings change. Returns false if the command has been rejected.
+ */
+bool applyCommand(const char *json, size_t length)
+{
+  // Fixed capacity: one object with all fields and room for the keys and strings copied
+  // from the (read only) payload
+  StaticJsonDocument<JSON_OBJECT_SIZE(7) + 96> doc;
+
+  if (deserializeJson(doc, json, length)) {
+    return false;
+  }
+
+  JsonObject command = doc.as<JsonObject>();
+  if (command.isNull()) {
+    return false;
+  }
+
+  JsonVariant brightness = command["brightness"];
+  JsonVariant color = command["color"];
+  JsonVariant timer = command["timer"];
+  JsonVariant state = command["state"];
+  JsonVariant transition = command["transition"];
+  JsonVariant effect = command["effect"];
+  JsonVariant fade = command["fade"];
+  bool on = settings.flowerGoalState;
+  uint8_t effectId = settings.effect;
+
+  if ((!brightness.isNull() && !isInteger(brightness, 1, 255)) ||
+      (!color.isNull() && !isInteger(color, 0, 255)) ||
+      (!timer.isNull() && !isInteger(timer, 0, UINT16_MAX)) ||
+      (!transition.isNull() && !isInteger(transition, TRANSITION_MIN, TRANSITION_MAX)) ||
+      (!fade.isNull() && !isInteger(fade, 0, CROSSFADE_MAX)) ||
+      (!state.isNull() && !readState(state, on)) ||
+      (!effect.isNull() && !readEffect(effect, effectId))) {
+    return false;
+  }
+
+  if (!transition.isNull()) {
+    setTransition(transition.as<long>());
+  }
+  if (!fade.isNull()) {
+    fadeDuration = fade.as<long>();
+  }
+  if (!brightness.isNull()) {
+    settings.brightnessMax = brightness.as<long>();
+  }
+  if (!color.isNull()) {
+    settings.wheelPosition = color.as<long>();
+  }
+  settings.effect = effectId;
+  if (on != settings.flowerGoalState) {
+    setFlowerGoalState(on);
+  }
+  if (!timer.isNull()) {
+    settings.timer = timer.as<long>();
+    prepareTargetTimer();
+  }
+
+  if (!brightness.isNull() || !color.isNull() || !effect.isNull()) {
+    setWheel(settings.wheelPosition, Interpolator::ratio(frameElapsed, frameDuration));
+  }
+
+  storeSettings();
+
+  return true;
+}
+
+static void handleCommand(const byte *payload, unsigned int length)
+{
+  applyCommand((const char *)payload, length);
+}
+
+// Subscribed command topics, the lengths are computed at compile time
+const MqttTopicHandler mqttTopicHandlers[] = {
+  {mqtt_topic_brightness, sizeof(mqtt_topic_brightness) - 1, handleBrightness},
+  {mqtt_topic_timer, sizeof(mqtt_topic_timer) - 1, handleTimer},
+  {mqtt_topic_color, sizeof(mqtt_topic_color) - 1, handleColor},
+  {mqtt_topic_toggle, sizeof(mqtt_topic_toggle) - 1, handleToggle},
+  {mqtt_topic_command, sizeof(mqtt_topic_command) - 1, handleCommand},
+  {mqtt_topic_effect, sizeof(mqtt_topic_effect) - 1, handleEffect},
+};
+
+const uint8_t mqttTopicHandlerCount = sizeof(mqttTopicHandlers) / sizeof(mqttTopicHandlers[0]);
+
+/**
+ * MQTT callback handler on incoming publish.
+ * Works on the received payload directly, invalid or out of range values are ignored.
+ */
+void mqttCallback(char *topic, byte *payload, unsigned int length)
+{
+#if DEBUG == true
+  Serial.print("\nMessage arrived [");
+  Serial.print(topic);
+  Serial.println("] ");
+
+  Serial.print("length: ");
+  Serial.println(length);
+#endif
+
+  const MqttTopicHandler *handler = findTopicHandler(mqttTopicHandlers, mqttTopicHandlerCount, topic);
+
+  if (handler) {
+    handler->handle(payload, length);
+  }
+}
@@ -1,17 +1,14 @@
-// Overall debugging enabled e.g. to log details on Serial
-#define DEBUG false
-// Should the wifi manager run in blocking mode until wifi connection is established or completely non blocking?
-#define WIFI_MANAGER_NON_BLOCKING true
-// Is MQTT client enabled?
-#define MQTT_ENABLED false
-
-// Define which LED library to use in the code
-#define LED_LIB_FASTLED 0x01
-#define LED_LIB_ADAFRUITNEOPIXEL 0x02
-#define LED_LIB LED_LIB_FASTLED
-
-#include <EEPROM.h>
-#include "LittleFS.h"
+#include "config.h"
+#include "flower.h"
+#include "filesystem.h"
+#include "event_queue.h"
+#include "encoder_acceleration.h"
+#include "button_gestures.h"
+#include "mqtt_client.h"
+#include "mqtt_connection.h"
+#include "loop_profiler.h"
+#include "boot_timeline.h"
+#include "heap_monitor.h"
 
 #include <ESP8266WiFi.h>
 #include <DNSServer.h>
@@ -21,148 +18,170 @@
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
 
-#include <ArduinoJson.h>
-
-#include <PubSubClient.h>
+#include <WebSocketsServer.h>
 
 #include <RotaryEncoder.h>
-#include <Servo.h>
 
-#if LED_LIB == LED_LIB_FASTLED
-  #define FASTLED_ALLOW_INTERRUPTS 0
-
-  #include <FastLED.h>
-#elif LED_LIB == LED_LIB_ADAFRUITNEOPIXEL
-  #include <Adafruit_NeoPixel.h>
-#else
-  #error "No valid LED library selected!"
-#endif
+#include <new>
 
 #define PIN_IN1 D5
 #define PIN_IN2 D6
 #define PIN_SERVO D7
 #define PIN_BUTTON D4
-#define PIN_LED D3
+// PIN_LED and the LED strip type: see led_output.h
 // Pin D8 (GPIO 15) has an internal pull-down resistor!
 // See: https://escapequotes.net/esp8266-wemos-d1-mini-pins-and-diagram/
 #define PIN_START_WIFI_PORTAL D8
 
-Servo myServo;
-
+// Static storage, nothing on the heap. Constructed by setupRotaryEncoder(): the constructor sets
+// the pin modes, which must not run during static initialization before the core is up.
+alignas(RotaryEncoder) static uint8_t encoderStorage[sizeof(RotaryEncoder)];
 RotaryEncoder *encoder = nullptr;
 
-int rotaryPos = 0;
 int servoPos = 0;
 
 // Button debounce delay in milliseconds
 #define DEBOUNCE_DELAY 50
-#define ROTARY_DEBOUNCE_DELAY 1000
+#define COLOR_CHANGE_SETTLE_DELAY 1000
 
-int lastButtonState = LOW;
-int lastDebounceTime = 0;
+// Input events pushed by the encoder and button ISRs and drained by loop() in batches
+#define INPUT_QUEUE_SIZE 32
+#define INPUT_BATCH_SIZE 8
 
-bool rotaryStore = false;
-int rotaryStoreDebounceTime = 0;
+EventQueue<InputEvent, INPUT_QUEUE_SIZE> inputQueue;
 
-// Do some color or brightness change
-bool doColorChange = true;
+// Input state of the interrupt context
+long isrRotaryPos = 0;           // Encoder position of the last queued rotation event
+volatile bool isrButtonPressed = false;
+volatile uint32_t isrButtonEdge = 0; // Time of the last queued button event
 
-// Servo open/closed values for min/max rotation
-// TODO: check this values
-// #define SERVO_OPEN 530 // min position = 0°
-#define SERVO_OPEN 2080
-#define SERVO_CLOSED 2530 // max position = 180°
+#if ENCODER_ACCELERATION == true
+EncoderAcceleration encoderAcceleration(ENCODER_SLOW_MICROS, ENCODER_FAST_MICROS, ENCODER_MAX_STEPS);
+#endif
 
-// Petal animation timing variables
-int frameDuration = 3000;         // Number of milliseconds for complete movement
-int frameElapsed = 0;             // How much of the frame has gone by, will range from 0 to frameDuration
-unsigned long previousMillis = 0; // The last time we ran the position interpolation
-unsigned long currentMillis = 0;  // Current time, we will update this continuosly
-int interval = 0;
-int movementDirection = 0; // 0 = stopped, 1 opening, -1 closing
+ButtonGestures buttonGestures(BUTTON_DOUBLE_CLICK_MICROS, BUTTON_LONG_PRESS_MICROS, BUTTON_REPEAT_MICROS);
 
-unsigned long targetTimer = 0;
+// Direction of the next hold-to-dim, alternates with every hold
+int8_t dimDirection = -1;
 
-// LED animation status variables
-#define BRIGHTNESS_START 0
-#define BRIGHTNESS_END 255
+// Stop redrawing the LEDs after color or brightness changes settled
+bool colorChangeSettle = false;
+unsigned long colorChangeTime = 0;
 
-#define NUM_LEDS 32
+#if DEBUG == true
+// Frame pacing statistics report interval in milliseconds
+#define FRAME_STATS_INTERVAL 10000
 
-#if LED_LIB == LED_LIB_FASTLED
-  #define CHIPSET NEOPIXEL
-  #define COLOR_ORDER RGB // Not required for NeoPixel
+unsigned long lastFrameStatsReport = 0;
+#endif
 
-  // #define CHIPSET WS2812
-  // #define COLOR_ORDER GRB
+// Longest loop() iteration in microseconds
+unsigned long maxLoopMicros = 0;
 
-  CRGB leds[NUM_LEDS];
-#elif LED_LIB == LED_LIB_ADAFRUITNEOPIXEL
-  // Parameter 1 = number of pixels in strip
-  // Parameter 2 = Arduino pin number (most are valid)
-  // Parameter 3 = pixel type flags, add together as needed:
-  //   NEO_KHZ800  800 KHz bitstream (most NeoPixel products w/WS2812 LEDs)
-  //   NEO_KHZ400  400 KHz (classic 'v1' (not v2) FLORA pixels, WS2811 drivers)
-  //   NEO_GRB     Pixels are wired for GRB bitstream (most NeoPixel products)
-  //   NEO_RGB     Pixels are wired for RGB bitstream (v1 FLORA pixels, not v2)
-  //   NEO_RGBW    Pixels are wired for RGBW bitstream (NeoPixel RGBW products)
-  Adafruit_NeoPixel strip = Adafruit_NeoPixel(NUM_LEDS, PIN_LED, NEO_GRB + NEO_KHZ800);
-#endif
+// Network work which may block (pixel stream batches, HTTP requests) is only started with at least
+// NETWORK_SLACK_MICROS left until the next frame, otherwise it is put off until after the frame
+#define NETWORK_SLACK_MICROS 2000
 
-#define FRAMES_PER_SECOND 60
+unsigned long networkDeferrals = 0;
 
 // Define hostname and OTA settings
 #define HOSTNAME "ESP-NightLight"
 
-// OTA settings
-unsigned int otaPort = 8266;
-char otaPassword[32] = ""; // Set OTA password via WiFi manager!
-
-// Prepare a struct to store some settings into the EEPROM
-struct {
-  int servoPosition = SERVO_CLOSED;
-  float_t brightness = BRIGHTNESS_START;
-  byte wheelPosition = 0;
-  bool flowerGoalState = false;
-  uint8_t brightnessMax = 50;
-  uint16_t timer = 0;
-} settings;
-
-#define SETTINGS_ADDRESS 0
-
-// MQTT settings
-char mqtt_server[32] = "<SERVER>";
-unsigned int mqtt_port = 1883;
-char device_id[32] = "esp8266-nightlamp";
-char mqtt_user[32] = "<USER>";
-char mqtt_pass[32] = "<PWD>";
-#if MQTT_ENABLED == true
-// MQTT topics
-const char *mqtt_topic_brightness = "esp/nightlamp/brightness";
-const char *mqtt_topic_timer = "esp/nightlamp/timer";
-const char *mqtt_topic_color = "esp/nightlamp/color";
-const char *mqtt_topic_toggle = "esp/nightlamp/toggle";
-#endif
-
-char message_buff[100];
-long lastReconnectAttempt = 0;
-
 // Flag for saving data
 bool shouldSaveConfig = false;
 // Flag for starting on demand wifi config portal
 bool shouldStartConfigPortal = false;
+// OTA and mDNS started
+bool networkStarted = false;
+// Config portal started because the stored credentials did not connect
+bool wifiPortalFallback = false;
 
 #if WIFI_MANAGER_NON_BLOCKING == true
 WiFiManager wifiManager;
 #endif
-WiFiClient espClient;
+#if LOOP_PROFILER_ENABLED == true
+enum LoopStage : uint8_t {
+  STAGE_WIFI,    // WiFi manager, mDNS
+  STAGE_MQTT,    // Connection, commands, state and metrics publishing
+  STAGE_NETWORK, // Pixel stream, time sync, local API
+  STAGE_INPUT,   // Input events, timer, button gestures
+  STAGE_FRAME,   // Flower animation frame
+  STAGE_OTHER,   // Debug stats, settings, heap monitor
+  STAGE_COUNT,
+};
+
+const char *const loopStageNames[STAGE_COUNT + 1] = {"wifi", "mqtt", "network", "input", "frame", "other", "loop"};
+LoopProfiler<STAGE_COUNT> loopProfiler(loopStageNames);
+
+#define PROFILE_LAP(stage) loopProfiler.lap(stage, cycleCount())
+#else
+#define PROFILE_LAP(stage)
+#endif
+
+// Boot phases in the order they finish. Local control is live after the first frame, the network
+// comes up in the background.
+enum BootPhase : uint8_t {
+  BOOT_SETTINGS,    // Settings restored
+  BOOT_LED,         // LED strip
+  BOOT_SERVO,       // Servo at the restored position
+  BOOT_INPUT,       // Rotary encoder and button
+  BOOT_FIRST_FRAME, // Restored color shown
+  BOOT_CONFIG,      // Config file read
+  BOOT_WIFI,        // WiFi connecting
+  BOOT_NETWORK,     // WiFi connected, OTA and mDNS started
+  BOOT_PHASE_COUNT,
+};
+
+const char *const bootPhaseNames[BOOT_PHASE_COUNT] = {"settings", "led", "servo", "input", "first_frame",
+                                                      "config", "wifi", "network"};
+BootTimeline<BOOT_PHASE_COUNT> bootTimeline(bootPhaseNames);
+
 #if MQTT_ENABLED == true
-PubSubClient mqttClient(espClient);
+typedef MqttClient<TcpTransport, MQTT_PACKET_SIZE> BrokerClient;
+
+BrokerClient mqttClient(mqtt_server, mqtt_port, device_id, mqtt_user, mqtt_pass, MQTT_KEEPALIVE);
+MqttConnection<BrokerClient> mqttConnection(mqttClient, mqttTopicHandlers, mqttTopicHandlerCount, MQTT_BACKOFF_MIN,
+                                            MQTT_BACKOFF_MAX, MQTT_CONNECT_TIMEOUT);
+StatePublisher<BrokerClient> statePublisher(mqttClient, mqtt_state_topics, STATE_PUBLISH_WINDOW,
+                                            STATE_TIMER_RESOLUTION);
+unsigned long statePublishedConnects = 0;
+#endif
+
+#if TIME_SYNC_ENABLED == true
+WiFiUDP syncUdp;
+IPAddress syncGroup(TIME_SYNC_GROUP);
+// Constructed by setupTimeSync(): the chip id is read from the flash chip, not during static
+// initialization.
+alignas(TimeSync) static uint8_t timeSyncStorage[sizeof(TimeSync)];
+TimeSync *timeSync = nullptr;
+bool syncStarted = false;
+#endif
+
+#if HTTP_API_ENABLED == true
+ESP8266WebServer webServer(HTTP_API_PORT);
+WebSocketsServer webSocket(WEBSOCKET_PORT);
+bool webApiStarted = false;
+LampState webSocketState = {};
+unsigned long webSocketPushed = 0;
+#endif
+
+#if PIXEL_STREAM_ENABLED == true
+WiFiUDP pixelUdp;
+
+// Packets handled per loop at most, a 60 fps stream sends about one per frame
+#define PIXEL_STREAM_BATCH_SIZE 4
+#endif
+
+#if HEAP_MONITOR_ENABLED == true
+HeapMonitor heapMonitor(HEAP_ALERT_FREE, HEAP_ALERT_LARGEST_BLOCK, HEAP_ALERT_FRAGMENTATION);
+unsigned long heapSampled = 0;
+unsigned long heapPublished = 0;
+bool heapAlertChanged = false; // Not published yet
 #endif
 
 
-char otaPort_buffer[5];
-char mqtt_port_buffer[5];
+char otaPort_buffer[6];
+char mqtt_port_buffer[6];
 
 const char *htmlTypePassword = "type=\"password\"";
 
@@ -191,32 +210,24 @@ void saveConfigCallback()
 }
 
 /**
- * Save config into file system.
+ * Save config into file system: the binary record read at boot and the JSON export.
  */
 void saveConfig()
 {
   // Read updated parameters
   // OTA
-  strcpy(otaPassword, custom_ota_password.getValue());
-  strcpy(otaPort_buffer, custom_ota_port.getValue());
+  copyConfigString(otaPassword, custom_ota_password.getValue(), CONFIG_STRING_SIZE);
+  copyConfigString(otaPort_buffer, custom_ota_port.getValue(), sizeof(otaPort_buffer));
   otaPort = atoi(otaPort_buffer);
   // MQTT
-  strcpy(mqtt_server, custom_mqtt_server.getValue());
-  strcpy(mqtt_port_buffer, custom_mqtt_port.getValue());
+  copyConfigString(mqtt_server, custom_mqtt_server.getValue(), CONFIG_STRING_SIZE);
+  copyConfigString(mqtt_port_buffer, custom_mqtt_port.getValue(), sizeof(mqtt_port_buffer));
   mqtt_port = atoi(mqtt_port_buffer);
-  strcpy(device_id, custom_mqtt_device_id.getValue());
-  strcpy(mqtt_user, custom_mqtt_user.getValue());
-  strcpy(mqtt_pass, custom_mqtt_pass.getValue());
+  copyConfigString(device_id, custom_mqtt_device_id.getValue(), CONFIG_STRING_SIZE);
+  copyConfigString(mqtt_user, custom_mqtt_user.getValue(), CONFIG_STRING_SIZE);
+  copyConfigString(mqtt_pass, custom_mqtt_pass.getValue(), CONFIG_STRING_SIZE);
 #if DEBUG == true
-  Serial.println("OTA");
-  Serial.println("\tpassword : " + String(otaPassword));
-  Serial.println("\tport : " + String(otaPort_buffer));
-  Serial.println("MQTT");
-  Serial.println("\tserver : " + String(mqtt_server));
-  Serial.println("\tport : " + String(mqtt_port_buffer));
-  Serial.println("\tdevice ID : " + String(device_id));
-  Serial.println("\tuser : " + String(mqtt_user));
-  Serial.println("\tpass : " + String(mqtt_pass));
+  printConfig();
 #endif
 
   // Save the custom parameters to FS
@@ -226,141 +237,13 @@ void saveConfig()
     Serial.println("saving config");
 #endif
 
-#if ARDUINOJSON_VERSION_MAJOR >= 6
-    DynamicJsonDocument json(1024);
-#else
-    DynamicJsonBuffer jsonBuffer;
-    JsonObject &json = jsonBuffer.createObject();
-#endif
-    // OTA
-    json["otaPassword"] = otaPassword;
-    json["otaPort"] = atoi(otaPort_buffer);
-    // MQTT
-    json["mqttServer"] = mqtt_server;
-    json["mqttPort"] = mqtt_port;
-    json["mqttDeviceId"] = device_id;
-    json["mqttUser"] = mqtt_user;
-    json["mqttPass"] = mqtt_pass;
-
-    File configFile = LittleFS.open("/config.json", "w");
-    if (!configFile)
+    if (!storeConfigRecord() || !exportConfigJson())
     {
 #if DEBUG == true
-      Serial.println("failed to open config file for writing");
-#endif
-    }
-
-#if ARDUINOJSON_VERSION_MAJOR >= 6
-#if DEBUG == true
-    serializeJson(json, Serial);
-#endif
-    serializeJson(json, configFile);
-#else
-#if DEBUG == true
-    json.printTo(Serial);
-#endif
-    json.printTo(configFile);
-#endif
-    configFile.close();
-    //end save
-  }
-}
-
-void prepareFileSystem()
-{
-  // Clean FS, for testing
-  // LittleFS.format();
-
-  // Read configuration from FS json
-#if DEBUG == true
-  Serial.println("mounting FS...");
-#endif
-
-  if (LittleFS.begin())
-  {
-#if DEBUG == true
-    Serial.println("mounted file system");
-#endif
-
-    if (LittleFS.exists("/config.json"))
-    {
-      // File exists, reading and loading
-#if DEBUG == true
-      Serial.println("reading config file");
-#endif
-
-      File configFile = LittleFS.open("/config.json", "r");
-      if (configFile)
-      {
-#if DEBUG == true
-        Serial.println("opened config file");
+      Serial.println("failed to save config");
 #endif
-
-        size_t size = configFile.size();
-        // Allocate a buffer to store contents of the file.
-        std::unique_ptr<char[]> buf(new char[size]);
-
-        configFile.readBytes(buf.get(), size);
-
-#if ARDUINOJSON_VERSION_MAJOR >= 6
-        DynamicJsonDocument json(1024);
-        auto deserializeError = deserializeJson(json, buf.get());
-#if DEBUG == true
-        serializeJson(json, Serial);
-#endif
-        if (!deserializeError)
-        {
-#else
-        DynamicJsonBuffer jsonBuffer;
-        JsonObject &json = jsonBuffer.parseObject(buf.get());
-#if DEBUG == true
-        json.printTo(Serial);
-#endif
-        if (json.success())
-        {
-#endif
-#if DEBUG == true
-          Serial.println("\nparsed json");
-#endif
-
-          // OTA
-          strcpy(otaPassword, json["otaPassword"]);
-          otaPort = json["otaPort"];
-          // MQTT
-          strcpy(mqtt_server, json["mqttServer"]);
-          mqtt_port = json["mqttPort"];
-          strcpy(device_id, json["mqttDeviceId"]);
-          strcpy(mqtt_user, json["mqttUser"]);
-          strcpy(mqtt_pass, json["mqttPass"]);
-
-#if DEBUG == true
-          Serial.println("OTA");
-          Serial.println("\tpassword : " + String(otaPassword));
-          Serial.println("\tport : " + String(otaPort));
-          Serial.println("MQTT");
-          Serial.println("\tserver : " + String(mqtt_server));
-          Serial.println("\tport : " + String(mqtt_port));
-          Serial.println("\tdevice ID : " + String(device_id));
-          Serial.println("\tuser : " + String(mqtt_user));
-          Serial.println("\tpass : " + String(mqtt_pass));
-#endif
-        }
-        else
-        {
-#if DEBUG == true
-          Serial.println("failed to load json config");
-#endif
-        }
-
-        configFile.close();
-      }
     }
   }
-  else
-  {
-    Serial.println("failed to mount FS");
-  }
-  //end read
 }
 
 /**
@@ -370,312 +253,208 @@ IRAM_ATTR void checkPosition()
 {
   // just call tick() to check the state.
   encoder->tick();
-}
 
-/**
- * Store current settings into the EEPROM
- */
-void storeSettings() {
-  EEPROM.put(SETTINGS_ADDRESS, settings);
-  EEPROM.commit();
+  long delta = encoder->getPosition() - isrRotaryPos;
+  if (delta == 0) {
+    return;
+  }
+
+  delta = constrain(delta, -127, 127);
+
+  // If the queue is full the delta is kept and sent along with the next rotation
+  if (inputQueue.push(InputEvent{micros(), INPUT_EVENT_ROTATION, (int8_t)delta})) {
+    isrRotaryPos += delta;
+  }
 }
 
 /**
- * Input a value 0 to 255 to get a color value.
- * The colours are a transiting
- * 
- * on r - g - b - back to r.
+ * Queue a debounced button event if the button state changed.
+ * Bounces within DEBOUNCE_DELAY after the last event are ignored.
  */
-#if LED_LIB == LED_LIB_FASTLED
-CRGB Wheel(byte WheelPos)
+IRAM_ATTR void queueButtonEvent(uint32_t now)
 {
-  WheelPos = 255 - WheelPos;
+  bool pressed = digitalRead(PIN_BUTTON) == LOW;
 
-  if (WheelPos < 85)
-  {
-    return CRGB((255 - WheelPos * 3), 0, (WheelPos * 3));
+  if (pressed == isrButtonPressed || now - isrButtonEdge < DEBOUNCE_DELAY * 1000UL) {
+    return;
   }
-  else if (WheelPos < 170)
-  {
-    WheelPos -= 85;
-    return CRGB(0, (WheelPos * 3), (255 - WheelPos * 3));
-  }
-  else
-  {
-    WheelPos -= 170;
-    return CRGB((WheelPos * 3), (255 - WheelPos * 3), 0);
-  }
-}
-#elif LED_LIB == LED_LIB_ADAFRUITNEOPIXEL
-uint32_t Wheel(byte WheelPos)
-{
-  WheelPos = 255 - WheelPos;
 
-  if (WheelPos < 85)
-  {
-    return strip.Color((255 - WheelPos * 3), 0, (WheelPos * 3));
-  }
-  else if (WheelPos < 170)
-  {
-    WheelPos -= 85;
-    return strip.Color(0, (WheelPos * 3), (255 - WheelPos * 3));
-  }
-  else
-  {
-    WheelPos -= 170;
-    return strip.Color((WheelPos * 3), (255 - WheelPos * 3), 0);
+  if (inputQueue.push(InputEvent{now, pressed ? INPUT_EVENT_BUTTON_DOWN : INPUT_EVENT_BUTTON_UP, 0})) {
+    isrButtonPressed = pressed;
+    isrButtonEdge = now;
   }
 }
-#endif
 
 /**
- * Apply colours from the wheel to the pixels
+ * The interrupt service routine will be called on any change of the push button.
  */
-void setWheel(byte WheelPos, float brightness)
+IRAM_ATTR void checkButton()
 {
-  // Convert brightness [0,1.0] to [0,255] for the LED strip
-  settings.brightness = BRIGHTNESS_START + (settings.brightnessMax - BRIGHTNESS_START) * brightness;
-
-#if LED_LIB == LED_LIB_FASTLED
-  FastLED.setBrightness(settings.brightness);
-
-  CRGB color = Wheel(WheelPos);
-  CRGB color2 = Wheel(128 - WheelPos);
+  queueButtonEvent(micros());
+}
 
-  for (uint16_t i = 0; i < NUM_LEDS / 2; i++)
-  {
-    leds[i] = color;
-  }
-  for (uint16_t i = NUM_LEDS / 2; i < NUM_LEDS; i++)
-  {
-    leds[i] = color2;
-  }
-  // for (uint16_t i = 0; i < NUM_LEDS; i++)
-  // {
-  //   leds[i] = color;
-  // }
+uint32_t cycleCount()
+{
+  return ESP.getCycleCount();
+}
 
-  FastLED.show();
-  delayMicroseconds(100);
-#elif LED_LIB == LED_LIB_ADAFRUITNEOPIXEL
-  strip.setBrightness(settings.brightness);
+uint32_t cyclesPerMicrosecond()
+{
+  return ESP.getCpuFreqMHz();
+}
 
-  uint32_t color = Wheel(WheelPos);
+// Start of the flash sector reserved for the EEPROM emulation, now used by the settings journal
+extern "C" uint32_t _EEPROM_start;
 
-  for (uint16_t i = 0; i < NUM_LEDS; i++)
-  {
-    strip.setPixelColor(i, color);
-  }
+/**
+ * Flash address of the settings sector
+ */
+uint32_t settingsSectorAddress()
+{
+  return ((uint32_t)&_EEPROM_start - 0x40200000);
+}
 
-  strip.show();
-#endif
+bool flashSectorErase()
+{
+  return ESP.flashEraseSector(settingsSectorAddress() / FLASH_SECTOR_SIZE);
 }
 
-void prepareTargetTimer() {
-#if DEBUG == true
-  Serial.println("--- prepareTargetTimer ---");
-  Serial.print("settings.timer: "); Serial.println(settings.timer);
-  Serial.print("settings.flowerGoalState: "); Serial.println(settings.flowerGoalState);
-#endif
+bool flashSectorWrite(uint32_t offset, const uint32_t *data, size_t size)
+{
+  return ESP.flashWrite(settingsSectorAddress() + offset, data, size);
+}
 
-  if (settings.timer > 0 && settings.flowerGoalState) {
-    targetTimer = millis() + settings.timer * 1000;
-  }
+bool flashSectorRead(uint32_t offset, uint32_t *data, size_t size)
+{
+  return ESP.flashRead(settingsSectorAddress() + offset, data, size);
 }
 
 /**
- * Update the flower: open/close it and adjust the LEDs (dim up/down)
+ * Apply the recognized push button gestures:
+ * click toggles the flower, double click toggles the sleep timer, triple click switches to the
+ * next LED effect, holding dims.
  */
-void updateFlower()
+void handleButtonGestures(uint8_t gestures)
 {
-  unsigned long currentMillis = millis();
-  interval = currentMillis - previousMillis;
-  previousMillis = currentMillis;
-
-  frameElapsed += movementDirection * interval;
-  float frameElapsedRatio = float(frameElapsed) / float(frameDuration);
-  volatile float brightness = frameElapsedRatio;
-
-  if (brightness <= 0) {
-    brightness = 0;
-  }
-
-  if (frameElapsed < 0)
+  if (gestures & BUTTON_CLICK)
   {
-    movementDirection = 0;
-    frameElapsed = 0;
-
 #if DEBUG == true
-    Serial.println("closed");
+    Serial.println("Push button clicked");
 #endif
+    // Ignored while the flower is still opening or closing
+    if (movementDirection == 0)
+    {
+      toggleFlower();
+    }
 
-    brightness = 0.0;
-    settings.brightness = BRIGHTNESS_START;
-    settings.servoPosition = SERVO_OPEN;
-    doColorChange = false;
+#if DEBUG == true
+    Serial.print("movement direction:");
+    Serial.println(movementDirection);
+#endif
+  }
 
-    // Unset target timer
+  if (gestures & BUTTON_DOUBLE_CLICK)
+  {
+    settings.timer = settings.timer > 0 ? 0 : BUTTON_TIMER;
     targetTimer = 0;
+    prepareTargetTimer();
 
+#if DEBUG == true
+    Serial.print("Push button double clicked, timer: ");
+    Serial.println(settings.timer);
+#endif
     storeSettings();
   }
-  if (frameElapsed > frameDuration)
+
+  if (gestures & BUTTON_TRIPLE_CLICK)
   {
-    movementDirection = 0;
-    frameElapsed = frameDuration;
+    nextEffect();
 
 #if DEBUG == true
-    Serial.println("opened");
+    Serial.print("Push button triple clicked, effect: ");
+    Serial.println(effectEngine.name(settings.effect));
 #endif
-
-    brightness = 1.0;
-    settings.brightness = settings.brightnessMax;
-    settings.servoPosition = SERVO_CLOSED;
-    doColorChange = false;
-
-    prepareTargetTimer();
-
-    storeSettings();
   }
 
-  if (movementDirection != 0)
+  if (gestures & BUTTON_LONG_PRESS)
   {
-    // Determine new position/brightness by interpolation between endpoints
-    // int newServoMicros = (SERVO_CLOSED + int(frameElapsedRatio * (SERVO_OPEN - SERVO_CLOSED)));
-    int newServoMicros = (SERVO_OPEN + int(frameElapsedRatio * (SERVO_CLOSED - SERVO_OPEN)));
-
-    myServo.write(newServoMicros);
-  }
+    // Dim up from the lowest and down from the highest brightness, otherwise alternate
+    if (settings.brightnessMax <= 1) {
+      dimDirection = 1;
+    } else if (settings.brightnessMax >= BRIGHTNESS_END) {
+      dimDirection = -1;
+    } else {
+      dimDirection = -dimDirection;
+    }
 
-  // Trigger LED color/brightness change only if the color or brightness has been changed.
-  // This should reduce flickering further.
-  if (doColorChange) {
-    setWheel(settings.wheelPosition, brightness);
+#if DEBUG == true
+    Serial.print("Push button held, dim direction: ");
+    Serial.println(dimDirection);
+#endif
   }
 }
 
-#if MQTT_ENABLED == true
 /**
- * MQTT callback handler on incoming publish
+ * Adjust the brightness by one step per frame while the push button is held
  */
-void mqttCallback(char *topic, byte *payload, unsigned int length)
+void dimFrame()
 {
-#if DEBUG == true
-  Serial.print("\nMessage arrived [");
-  Serial.print(topic);
-  Serial.println("] ");
+  int brightnessMax = constrain(settings.brightnessMax + dimDirection * BUTTON_DIM_STEP, 1, BRIGHTNESS_END);
 
-  Serial.print("length: ");
-  Serial.println(length);
-#endif
-
-  unsigned int i;
-  for (i = 0; i < length; i++)
-  {
-    message_buff[i] = payload[i];
+  if (brightnessMax == settings.brightnessMax) {
+    return;
   }
-  message_buff[i] = '\0';
 
-  String msgString = String(message_buff);
-#if DEBUG == true
-  Serial.println("payload: \"" + msgString + "\"");
-#endif
-
-  if (strcmp(topic, mqtt_topic_brightness) == 0)
-  { 
-    uint8_t convertedNumber = msgString.toInt();
-
-    if (convertedNumber > 0) {
-      settings.brightnessMax = convertedNumber;
-
-      setWheel(settings.wheelPosition, settings.brightness);
-      storeSettings();
-    }
-  }
-  else if (strcmp(topic, mqtt_topic_timer) == 0)
-  { 
-    settings.timer = msgString.toInt();
-
-    prepareTargetTimer();
-    storeSettings();
-  }
-  else if (strcmp(topic, mqtt_topic_color) == 0)
-  { 
-    settings.wheelPosition = msgString.toInt();
-
-    setWheel(settings.wheelPosition, settings.brightness);
-    storeSettings();
-  }
-  else if (strcmp(topic, mqtt_topic_toggle) == 0)
-  { 
-    settings.flowerGoalState = !settings.flowerGoalState;
+  settings.brightnessMax = brightnessMax;
 
-    if (settings.flowerGoalState)
-    {
-      movementDirection = 1;
-      doColorChange = true;
-    }
-    else
-    {
-      movementDirection = -1;
-      doColorChange = true;
-    }
+  colorChangeSettle = true;
+  colorChangeTime = millis();
 
-    storeSettings();
-  }
+  doColorChange = true;
+  storeSettings();
 }
-#endif
 
-#if MQTT_ENABLED == true
 /**
- * MQTT reconnect code (non blocking)
+ * Apply a single input event of the rotary encoder or push button
  */
-bool reconnect()
+void handleInputEvent(const InputEvent &event)
 {
-  if (mqttClient.connect(device_id, mqtt_user, mqtt_pass))
+  switch (event.type)
   {
-    mqttClient.subscribe(mqtt_topic_brightness);
-    mqttClient.subscribe(mqtt_topic_timer);
-    mqttClient.subscribe(mqtt_topic_color);
-    mqttClient.subscribe(mqtt_topic_toggle);
-  }
-  
-  return mqttClient.connected();
-}
+  case INPUT_EVENT_ROTATION:
+#if DEBUG == true
+    Serial.println("--- rotary encoder ---");
+    Serial.print("delta:");
+    Serial.println(event.value);
 #endif
-
-/*** SETUP ***/
-
-void setupLed() {
-#if LED_LIB == LED_LIB_FASTLED
-#if (CHIPSET == NEOPIXEL)
-  FastLED.addLeds<CHIPSET, PIN_LED>(leds, NUM_LEDS);
+    // Only the final wheel position is rendered with the next frame
+#if ENCODER_ACCELERATION == true
+    settings.wheelPosition += encoderAcceleration.steps(event.value, event.micros);
 #else
-  FastLED.addLeds<CHIPSET, PIN_LED, COLOR_ORDER>(leds, NUM_LEDS);
+    settings.wheelPosition += event.value;
 #endif
-  //.setCorrection(TypicalLEDStrip);
 
-  // FastLED.setMaxRefreshRate(60);
+    colorChangeSettle = true;
+    colorChangeTime = millis();
 
-  FastLED.setBrightness(settings.brightness);
+    doColorChange = true;
+    break;
 
-  // CRGB color = Wheel(settings.wheelPosition);
-  CRGB color = CRGB::Black;
+  case INPUT_EVENT_BUTTON_DOWN:
+    handleButtonGestures(buttonGestures.down(event.micros));
+    break;
 
-  // Init LEDs with black
-  for (uint16_t i = 0; i < NUM_LEDS; i++)
-  {
-    leds[i] = color;
+  case INPUT_EVENT_BUTTON_UP:
+    handleButtonGestures(buttonGestures.up(event.micros));
+    break;
   }
+}
 
-  FastLED.show();
-  // delayMicroseconds(100);
-#elif LED_LIB == LED_LIB_ADAFRUITNEOPIXEL
-  strip.begin();
-  strip.clear();
-  strip.setBrightness(settings.brightness);
-  strip.show();
-#endif
+/*** SETUP ***/
+
+void setupLed() {
+  // Starts black, the first frame shows the restored color
+  frameCommitter.begin(settings.brightness);
 }
 
 void setupWifi() {
@@ -732,6 +511,15 @@ void setupWifi() {
   // Set WiFi DNS hostname
   WiFi.setHostname(HOSTNAME);
 
+#if WIFI_MANAGER_NON_BLOCKING == true
+  // Stored credentials connect in the background, see startNetwork()
+  if (!shouldStartConfigPortal && wifiManager.getWiFiIsSaved()) {
+    WiFi.mode(WIFI_STA);
+    WiFi.begin();
+    return;
+  }
+#endif
+
   // Fetches ssid and pass from eeprom and tries to connect. If it does not connect it starts an access point with the specified name and goes into a blocking loop awaiting configuration.
   if ((shouldStartConfigPortal && !wifiManager.startConfigPortal(HOSTNAME)) || !wifiManager.autoConnect(HOSTNAME))
   {
@@ -741,6 +529,7 @@ void setupWifi() {
 #endif
     delay(3000);
     // Reset and try again, or maybe put it to deep sleep
+    flushSettings();
     ESP.reset();
     delay(5000);
 #endif
@@ -768,9 +557,15 @@ void setupOta() {
   // No authentication by default
   ArduinoOTA.setPassword(otaPassword);
 
-#if DEBUG == true
+  // Do not lose settings written behind when the update reboots the device
   ArduinoOTA.onStart([]()
-                     { Serial.println("Start"); });
+                     {
+                       flushSettings();
+#if DEBUG == true
+                       Serial.println("Start");
+#endif
+                     });
+#if DEBUG == true
   ArduinoOTA.onEnd([]()
                    { Serial.println("\nEnd"); });
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total)
@@ -793,16 +588,359 @@ void setupOta() {
   ArduinoOTA.begin();
 }
 
+#if DEBUG == true
+void printBootTimeline() {
+  Serial.println("--- boot ---");
+  for (uint8_t phase = 0; phase < BOOT_PHASE_COUNT; phase++) {
+    if (bootTimeline.reached(phase)) {
+      Serial.printf("%s: %lu us (+%lu us)\n", bootTimeline.name(phase), (unsigned long)bootTimeline.at(phase),
+                    (unsigned long)bootTimeline.duration(phase));
+    }
+  }
+}
+#endif
+
+/**
+ * Start the services needing the WiFi connection once it is up. Call it from loop().
+ */
+void startNetwork() {
+  if (networkStarted) {
+    ArduinoOTA.handle();
+    return;
+  }
+
+#if WIFI_MANAGER_NON_BLOCKING == true
+  // Stored credentials did not connect: offer the config portal instead, once
+  if (!wifiPortalFallback && WiFi.status() != WL_CONNECTED && millis() > WIFI_CONNECT_TIMEOUT) {
+    wifiPortalFallback = true;
+    shouldStartConfigPortal = !wifiManager.getConfigPortalActive();
+  }
+#endif
+
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+
+  setupOta();
+  networkStarted = true;
+  bootTimeline.mark(BOOT_NETWORK, micros());
+
+#if DEBUG == true
+  Serial.print("WiFi connected, IP address: ");
+  Serial.println(WiFi.localIP());
+  printBootTimeline();
+#endif
+}
+
 #if MQTT_ENABLED == true
 void setupMqtt() {
-  mqttClient.setServer(mqtt_server, mqtt_port);
   mqttClient.setCallback(mqttCallback);
 }
 #endif
 
+#if PIXEL_STREAM_ENABLED == true
+void setupPixelStream() {
+  pixelUdp.begin(PIXEL_STREAM_PORT);
+}
+
+/**
+ * Receive pending pixel stream packets. The pixel data is read straight into the back buffer.
+ * One packet per loop at least, more only while there is slack until the next frame.
+ */
+void receivePixelStream() {
+  for (uint8_t i = 0; i < PIXEL_STREAM_BATCH_SIZE; i++) {
+    if (i > 0 && frameScheduler.slackMicros(micros()) < NETWORK_SLACK_MICROS) {
+      networkDeferrals++;
+      break;
+    }
+
+    int size = pixelUdp.parsePacket();
+    if (size <= 0) {
+      break;
+    }
+
+    uint8_t header[DDP_HEADER_SIZE];
+    PixelStreamChunk chunk;
+
+    // Anything not read is dropped by the next parsePacket()
+    if (pixelUdp.read(header, sizeof(header)) != sizeof(header) ||
+        !pixelStream.receive(header, size, micros(), chunk)) {
+      continue;
+    }
+
+    pixelUdp.read((uint8_t *)streamedPixels() + chunk.offset, chunk.length);
+
+    if (chunk.push) {
+      showStreamedPixels();
+    }
+  }
+
+  updatePixelStream();
+}
+#endif
+
+#if MQTT_ENABLED == true
+/**
+ * Publish the boot phases retained to <metrics topic>/boot, after every (re)connect
+ */
+void publishBootTimeline() {
+  char topic[48];
+  char payload[192];
+  int length = bootTimeline.format(payload, sizeof(payload));
+  if (length < 0 || (size_t)length >= sizeof(payload)) {
+    return;
+  }
+
+  snprintf(topic, sizeof(topic), "%s/boot", mqtt_topic_metrics);
+  mqttClient.publish(topic, (const uint8_t *)payload, length, true);
+}
+#endif
+
+#if HEAP_MONITOR_ENABLED == true
+/**
+ * Sample the heap every HEAP_SAMPLE_INTERVAL
+ */
+void updateHeapMonitor() {
+  if (millis() - heapSampled < HEAP_SAMPLE_INTERVAL) {
+    return;
+  }
+
+  heapSampled = millis();
+  if (!heapMonitor.sample(ESP.getFreeHeap(), ESP.getMaxFreeBlockSize())) {
+    return;
+  }
+
+  heapAlertChanged = true;
+#if DEBUG == true
+  Serial.printf("heap alert %s: free %lu, largest block %lu, fragmentation %u%%\n",
+                heapMonitor.alert() ? "raised" : "cleared", (unsigned long)heapMonitor.freeHeap(),
+                (unsigned long)heapMonitor.largestBlock(), heapMonitor.fragmentation());
+#endif
+}
+#endif
+
+#if MQTT_ENABLED == true && HEAP_MONITOR_ENABLED == true
+/**
+ * Publish the heap to <metrics topic>/heap every METRICS_INTERVAL and right away when the alert
+ * has been raised or cleared
+ */
+void publishHeap() {
+  if (!heapAlertChanged && millis() - heapPublished < METRICS_INTERVAL) {
+    return;
+  }
+
+  char topic[48];
+  char payload[160];
+  int length = heapMonitor.format(payload, sizeof(payload));
+
+  snprintf(topic, sizeof(topic), "%s/heap", mqtt_topic_metrics);
+  if (mqttClient.publish(topic, (const uint8_t *)payload, length, false)) {
+    heapPublished = millis();
+    heapAlertChanged = false;
+  }
+}
+#endif
+
+#if MQTT_ENABLED == true && LOOP_PROFILER_ENABLED == true
+uint8_t metricsStage = STAGE_COUNT + 1; // Next stage to publish, none if beyond the whole loop
+unsigned long metricsPublished = 0;
+
+/**
+ * Publish the loop stage timings to <metrics topic>/<stage> every METRICS_INTERVAL, one stage per loop
+ */
+void publishMetrics() {
+  if (metricsStage > STAGE_COUNT) {
+    if (millis() - metricsPublished < METRICS_INTERVAL) {
+      return;
+    }
+
+    metricsPublished = millis();
+    metricsStage = 0;
+  }
+
+  char topic[48];
+  char payload[80];
+  int length = loopProfiler.formatStage(metricsStage, payload, sizeof(payload), cyclesPerMicrosecond());
+
+  snprintf(topic, sizeof(topic), "%s/%s", mqtt_topic_metrics, loopProfiler.name(metricsStage));
+  mqttClient.publish(topic, (const uint8_t *)payload, length, false);
+
+  metricsStage++;
+}
+#endif
+
+#if HTTP_API_ENABLED == true
+/**
+ * GET /api/state
+ */
+void handleApiState() {
+  char state[LAMP_STATE_JSON_SIZE];
+  int length = formatLampState(state, sizeof(state));
+
+  webServer.send(200, "application/json", state, length);
+}
+
+/**
+ * POST /api/command with the same JSON command as the MQTT command topic, answers with the new state
+ */
+void handleApiCommand() {
+  const String &body = webServer.arg("plain");
+
+  if (!applyCommand(body.c_str(), body.length())) {
+    const char *error = "{\"error\":\"invalid command\"}";
+    webServer.send(400, "application/json", error, strlen(error));
+    return;
+  }
+
+  handleApiState();
+}
+
+/**
+ * GET /metrics, the boot phases, the heap, the frame render/commit times, the effect budgets and
+ * the loop stage histograms in the Prometheus text format, sent line by line
+ */
+void handleMetrics() {
+  webServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  webServer.send(200, "text/plain; version=0.0.4", emptyString);
+
+  bootTimeline.writeMetrics([](const char *line, int length) { webServer.sendContent(line, length); });
+#if HEAP_MONITOR_ENABLED == true
+  heapMonitor.writeMetrics([](const char *line, int length) { webServer.sendContent(line, length); });
+#endif
+  frameCommitter.writeMetrics([](const char *line, int length) { webServer.sendContent(line, length); },
+                              cyclesPerMicrosecond());
+  effectEngine.writeMetrics([](const char *line, int length) { webServer.sendContent(line, length); },
+                            cyclesPerMicrosecond());
+#if LOOP_PROFILER_ENABLED == true
+  loopProfiler.writeMetrics([](const char *line, int length) { webServer.sendContent(line, length); },
+                            cyclesPerMicrosecond());
+#endif
+
+  webServer.sendContent(emptyString);
+}
+
+/**
+ * WebSocket clients get the state on connect and send JSON commands e.g. while dragging a slider
+ */
+void webSocketEvent(uint8_t client, WStype_t type, uint8_t *payload, size_t length) {
+  char state[LAMP_STATE_JSON_SIZE];
+
+  switch (type) {
+  case WStype_CONNECTED:
+    webSocket.sendTXT(client, state, formatLampState(state, sizeof(state)));
+    break;
+
+  case WStype_TEXT:
+    applyCommand((const char *)payload, length);
+    break;
+
+  default:
+    break;
+  }
+}
+
+void setupWebApi() {
+  webServer.on("/api/state", HTTP_GET, handleApiState);
+  webServer.on("/api/command", HTTP_POST, handleApiCommand);
+  webServer.on("/metrics", HTTP_GET, handleMetrics);
+  webSocket.onEvent(webSocketEvent);
+}
+
+/**
+ * Serve the local API. Handles at most one HTTP request per loop, state changes are pushed to the
+ * WebSocket clients at most every WEBSOCKET_PUSH_INTERVAL milliseconds.
+ */
+void updateWebApi() {
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+
+  // Start listening once the (non blocking) WiFi connection is up
+  if (!webApiStarted) {
+    webServer.begin();
+    webSocket.begin();
+    webApiStarted = true;
+    return;
+  }
+
+  // A request is handled completely (blocking), keep it from delaying a frame. Put off once at
+  // most, so a loop which is always late does not starve the API.
+  static bool deferred = false;
+  if (!deferred && frameScheduler.slackMicros(micros()) < NETWORK_SLACK_MICROS) {
+    deferred = true;
+    networkDeferrals++;
+    return;
+  }
+  deferred = false;
+
+  webServer.handleClient();
+  webSocket.loop();
+
+  if (millis() - webSocketPushed < WEBSOCKET_PUSH_INTERVAL || !webSocket.connectedClients()) {
+    return;
+  }
+
+  LampState state = currentLampState();
+  if (state != webSocketState) {
+    char json[LAMP_STATE_JSON_SIZE];
+
+    webSocket.broadcastTXT(json, formatLampState(json, sizeof(json)));
+    webSocketState = state;
+    webSocketPushed = millis();
+  }
+}
+#endif
+
+#if TIME_SYNC_ENABLED == true
+void sendTimeSyncPacket(const uint8_t *packet, size_t length) {
+  syncUdp.beginPacketMulticast(syncGroup, TIME_SYNC_PORT, WiFi.localIP());
+  syncUdp.write(packet, length);
+  syncUdp.endPacket();
+}
+
+void setupTimeSync() {
+  timeSync = new (timeSyncStorage) TimeSync(ESP.getChipId(), TIME_SYNC_INTERVAL * 1000UL);
+}
+
+/**
+ * Exchange clock and movement packets with the other lamps
+ */
+void updateTimeSync() {
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+
+  // Joining the group needs the IP address of the (non blocking) WiFi connection
+  if (!syncStarted) {
+    syncStarted = syncUdp.beginMulticast(WiFi.localIP(), syncGroup, TIME_SYNC_PORT);
+    return;
+  }
+
+  uint8_t packet[TIME_SYNC_PACKET_SIZE];
+  SyncCommand command;
+
+  size_t length = timeSync->poll(micros(), packet);
+  if (length) {
+    sendTimeSyncPacket(packet, length);
+  }
+
+  if (takeMovementBroadcast(command)) {
+    sendTimeSyncPacket(packet, timeSync->command(command, packet));
+  }
+
+  int size = syncUdp.parsePacket();
+  if (size > 0 && size <= TIME_SYNC_PACKET_SIZE) {
+    syncUdp.read(packet, size);
+
+    if (timeSync->receive(packet, size, micros(), command)) {
+      scheduleMovement(command);
+    }
+  }
+}
+#endif
+
 void setupRotaryEncoder() {
-  // Setup the rotary encoder functionality
-  encoder = new RotaryEncoder(
+  encoder = new (encoderStorage) RotaryEncoder(
     PIN_IN1,
     PIN_IN2,
     // use FOUR3 mode when PIN_IN1, PIN_IN2 signals are always HIGH in latch position.
@@ -819,6 +957,7 @@ void setupRotaryEncoder() {
 
   // Setting up rotary encoder push button
   pinMode(PIN_BUTTON, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(PIN_BUTTON), checkButton, CHANGE);
 }
 
 void setupServo() {
@@ -832,9 +971,12 @@ void setup()
   Serial.begin(115200);
 #endif
 
-  /*** EEPROM ***/
-  EEPROM.begin(sizeof(settings));
-  EEPROM.get(0, settings);
+  /*** Settings ***/
+  if (!restoreSettings()) {
+#if DEBUG == true
+    Serial.println("no valid settings stored, using defaults");
+#endif
+  }
 
   if (settings.flowerGoalState) {
     frameElapsed = frameDuration;
@@ -842,11 +984,8 @@ void setup()
     frameElapsed = 0;
   }
 
-  // NOTICE: Weird hack! The EEPROM might store non-boolean values (non equal to "0" and "1")
-  settings.flowerGoalState = (settings.flowerGoalState ? 1 : 0);
-  settings.brightnessMax = (settings.brightnessMax < 0 || settings.brightnessMax > 255 ? BRIGHTNESS_END : settings.brightnessMax);
-
   prepareTargetTimer();
+  bootTimeline.mark(BOOT_SETTINGS, micros());
 
 #if DEBUG == true
   Serial.println("--- settings ---");
@@ -858,36 +997,82 @@ void setup()
   Serial.print("timer: "); Serial.println(settings.timer);
 #endif
 
+  // Local control first: the lamp reacts to the encoder and shows its restored state before the
+  // network is up
+
+  /*** LED strip ***/
+  setupLed();
+  bootTimeline.mark(BOOT_LED, micros());
+
+  /*** Servo ***/
+  setupServo();
+  bootTimeline.mark(BOOT_SERVO, micros());
+
+  /*** Rotary encoder ***/
+  setupRotaryEncoder();
+  bootTimeline.mark(BOOT_INPUT, micros());
+
+  /*** First frame ***/
+  setWheel(settings.wheelPosition, Interpolator::ratio(frameElapsed, frameDuration));
+  frameCommitter.commit();
+  previousMillis = millis();
+  bootTimeline.mark(BOOT_FIRST_FRAME, micros());
+
   pinMode(PIN_START_WIFI_PORTAL, INPUT);
 
   /*** Read Wifi and additional config ***/
   prepareFileSystem();
-
-  /*** LED strip ***/
-  setupLed();
+  bootTimeline.mark(BOOT_CONFIG, micros());
 
   /*** WiFi manager ***/
   setupWifi();
+  bootTimeline.mark(BOOT_WIFI, micros());
+
+  // The services below only prepare here and start listening from loop() once WiFi is connected
 
   /*** Prepare MQTT ***/
 #if MQTT_ENABLED == true
   setupMqtt();
 #endif
-  
-  /*** OTA ***/
-  setupOta();
 
-  /*** Rotary encoder ***/
-  setupRotaryEncoder();
-  
-  /*** Servo ***/
-  setupServo();
+  /*** Local API ***/
+#if HTTP_API_ENABLED == true
+  setupWebApi();
+#endif
+
+  /*** Pixel stream ***/
+#if PIXEL_STREAM_ENABLED == true
+  setupPixelStream();
+#endif
+
+  /*** Time sync ***/
+#if TIME_SYNC_ENABLED == true
+  setupTimeSync();
+#endif
+
+#if LOOP_PROFILER_ENABLED == true
+  // Cost of an empty PROFILE_LAP on this CPU, reported in /metrics
+  loopProfiler.measureLap([]() { return cycleCount(); });
+#endif
+
+#if DEBUG == true
+  printBootTimeline();
+#if LOOP_PROFILER_ENABLED == true
+  Serial.printf("profiler lap: %lu cycles\n", (unsigned long)loopProfiler.lapCycles());
+#endif
+#endif
 }
 
 /*** LOOP ***/
 
 void loop()
 {
+  unsigned long loopStart = micros();
+
+#if LOOP_PROFILER_ENABLED == true
+  loopProfiler.begin(cycleCount());
+#endif
+
 #if WIFI_MANAGER_NON_BLOCKING == true
   // Trigger wifi manager processing for non-blocking mode
   wifiManager.process();
@@ -900,9 +1085,9 @@ void loop()
   if (shouldStartConfigPortal && !wifiManager.startConfigPortal(HOSTNAME)) {
 #if DEBUG == true
     Serial.println("Config portal started");
+#endif
 
     shouldStartConfigPortal = false;
-#endif
   }
 
   if (shouldSaveConfig)
@@ -914,97 +1099,76 @@ void loop()
     Serial.println("restarting system ...");
 #endif
     // Reset and try again, or maybe put it to deep sleep
+    flushSettings();
     ESP.reset();
     delay(5000);
 #endif
   }
 #endif
 
+  startNetwork();
 #ifdef ESP8266
   MDNS.update();
 #endif
+  PROFILE_LAP(STAGE_WIFI);
 
 #if MQTT_ENABLED == true
-  if (!mqttClient.connected()) {
-    long now = millis();
+  if (WiFi.status() == WL_CONNECTED) {
+    // At most one connect step or subscription per loop
+    mqttConnection.poll(millis(), RANDOM_REG32);
+  } else {
+    // The session did not survive, connect again as soon as WiFi is back
+    mqttConnection.reset(millis());
+  }
 
-    if (now - lastReconnectAttempt > 5000) {
-      lastReconnectAttempt = now;
+  if (mqttConnection.connected()) {
+    mqttClient.loop(millis());
 
-      // Attempt to reconnect
-      if (reconnect()) {
-        lastReconnectAttempt = 0;
-      }
+    // Refresh all retained state topics after (re)connecting
+    if (mqttConnection.connects() != statePublishedConnects) {
+      statePublishedConnects = mqttConnection.connects();
+      statePublisher.invalidate();
+      publishBootTimeline();
     }
-  } else {
-    // Client connected
-    mqttClient.loop();
+
+    statePublisher.poll(currentLampState(), millis());
+#if HEAP_MONITOR_ENABLED == true
+    publishHeap();
+#endif
+#if LOOP_PROFILER_ENABLED == true
+    publishMetrics();
+#endif
   }
 #endif
+  PROFILE_LAP(STAGE_MQTT);
 
-  int newPos = encoder->getPosition();
-  if (rotaryPos != newPos)
-  {
-    int direction = (int) encoder->getDirection();
-
-#if DEBUG == true
-    Serial.println("--- rotary encoder ---");
-    Serial.print("pos:");
-    Serial.print(newPos);
-    Serial.print(" dir:");
-    Serial.println(direction);
+#if PIXEL_STREAM_ENABLED == true
+  receivePixelStream();
 #endif
-    rotaryPos = newPos;
-    settings.wheelPosition += direction;
-
-    rotaryStore = true;
-    rotaryStoreDebounceTime = millis();
-
-    doColorChange = true;
-  }
 
-  // Read button state and debounce
-  int buttonState = digitalRead(PIN_BUTTON);
+#if TIME_SYNC_ENABLED == true
+  updateTimeSync();
+#endif
 
-  if (buttonState != lastButtonState)
-  {
-    lastDebounceTime = millis();
-  }
+#if HTTP_API_ENABLED == true
+  updateWebApi();
+#endif
+  PROFILE_LAP(STAGE_NETWORK);
 
-  if ((millis() - lastDebounceTime) > DEBOUNCE_DELAY)
-  {
-    if (buttonState != lastButtonState)
-    {
-      lastButtonState = buttonState;
-    }
+  updateScheduledMovement();
 
-    if (buttonState == LOW)
-    {
-      if (movementDirection == 0)
-      {
-        settings.flowerGoalState = !settings.flowerGoalState;
-      }
-
-      if (settings.flowerGoalState)
-      {
-        movementDirection = 1;
-        doColorChange = true;
-      }
-      else
-      {
-        movementDirection = -1;
-        doColorChange = true;
-      }
+  // An edge ignored while debouncing might have been the last one: catch up with the button level
+  noInterrupts();
+  queueButtonEvent(micros());
+  interrupts();
 
-#if DEBUG == true
-      Serial.print("movement direction:");
-      Serial.println(movementDirection);
-#endif
+  // Process the input events queued by the ISRs
+  InputEvent inputEvents[INPUT_BATCH_SIZE];
+  uint8_t inputEventCount;
+  while ((inputEventCount = inputQueue.drain(inputEvents, INPUT_BATCH_SIZE)) > 0) {
+    for (uint8_t i = 0; i < inputEventCount; i++) {
+      handleInputEvent(inputEvents[i]);
     }
-
-#if DEBUG == true
-    Serial.println("Push button pushed");
-#endif
   }
 
   // Check if timer is enabled at all (> 0)
@@ -1018,27 +1182,114 @@ void loop()
       Serial.print("settings.timer * 1000: "); Serial.println((int)(settings.timer * 1000));
       Serial.print("millis() + settings.timer * 1000: "); Serial.println((int)(millis() + settings.timer * 1000));
 #endif
-      settings.flowerGoalState = 0;
-      movementDirection = -1;
-      doColorChange = true;
+      setFlowerGoalState(false);
 
       // Unset target timer
       targetTimer = 0;
     }
   }
 
-  // Update flower color and brightness
-  updateFlower();
+  // Button gestures depending on time (click, long press, hold repeat)
+  handleButtonGestures(buttonGestures.tick(micros()));
+  PROFILE_LAP(STAGE_INPUT);
 
-  // Store updated rotary settings
-  if (rotaryStore && (millis() - rotaryStoreDebounceTime) > ROTARY_DEBOUNCE_DELAY) {
-    rotaryStore = false;
-    doColorChange = false;
+  // Update flower color and brightness at a fixed frame rate
+  if (frameScheduler.poll(micros())) {
+    if (buttonGestures.holding()) {
+      dimFrame();
+    }
+
+    updateFlower();
+
+    // Send the latest frame rendered since the last commit
+    frameCommitter.commit();
+  }
+  PROFILE_LAP(STAGE_FRAME);
 
 #if DEBUG == true
-    Serial.println("store wheel position");
+  if (millis() - lastFrameStatsReport > FRAME_STATS_INTERVAL) {
+    lastFrameStatsReport = millis();
+
+    Serial.println("--- frame stats ---");
+    Serial.print("frames: "); Serial.println(frameScheduler.frames());
+    Serial.print("late: "); Serial.println(frameScheduler.late());
+    Serial.print("dropped: "); Serial.println(frameScheduler.dropped());
+    Serial.printf("jitter p50/p90/p99: %u/%u/%u us\n", frameScheduler.jitterPercentile(50),
+                  frameScheduler.jitterPercentile(90), frameScheduler.jitterPercentile(99));
+    Serial.printf("frames presented/shown/skipped: %lu/%lu/%lu\n", frameCommitter.presented(), frameCommitter.shown(),
+                  frameCommitter.skipped());
+    {
+      char summary[80];
+      frameCommitter.renderCycles().format(summary, sizeof(summary), cyclesPerMicrosecond());
+      Serial.printf("frame render: %s\n", summary);
+      frameCommitter.commitCycles().format(summary, sizeof(summary), cyclesPerMicrosecond());
+      Serial.printf("frame commit: %s\n", summary);
+    }
+    Serial.printf("effect %s: max %lu us of %u us, %lu overruns\n", effectEngine.name(settings.effect),
+                  (unsigned long)(effectEngine.maxCycles(settings.effect) / cyclesPerMicrosecond()),
+                  effectEngine.budgetMicros(settings.effect), effectEngine.overruns(settings.effect));
+    Serial.print("max loop: "); Serial.print(maxLoopMicros); Serial.println(" us");
+    Serial.print("network deferrals: "); Serial.println(networkDeferrals);
+    Serial.print("input queue overflows: "); Serial.println(inputQueue.overflows());
+    Serial.print("max settings flush: "); Serial.print(maxSettingsFlushMicros); Serial.println(" us");
+#if MQTT_ENABLED == true
+    Serial.printf("mqtt connects/attempts: %lu/%lu\n", mqttConnection.connects(), mqttConnection.attempts());
+    Serial.printf("mqtt state published: %lu messages, %lu bytes\n", statePublisher.messages(), statePublisher.bytes());
+#endif
+#if TIME_SYNC_ENABLED == true
+    Serial.printf("time sync: %s, offset %lu us, error %lu us\n", timeSync->leader() ? "leader" : "follower",
+                  (unsigned long)timeSync->offset(), (unsigned long)timeSync->syncError());
+#endif
+#if PIXEL_STREAM_ENABLED == true
+    Serial.printf("pixel stream frames/packets/lost/rejected/duplicates: %lu/%lu/%lu/%lu/%lu\n", pixelStream.frames(),
+                  pixelStream.packets(), pixelStream.lost(), pixelStream.rejected(), pixelStream.duplicates());
+#endif
+#if HEAP_MONITOR_ENABLED == true
+    Serial.printf("heap free/largest block/fragmentation: %lu/%lu/%u%%, worst %lu/%lu/%u%%\n",
+                  (unsigned long)heapMonitor.freeHeap(), (unsigned long)heapMonitor.largestBlock(),
+                  heapMonitor.fragmentation(), (unsigned long)heapMonitor.minFree(),
+                  (unsigned long)heapMonitor.minLargestBlock(), heapMonitor.maxFragmentation());
+#endif
+#if LOOP_PROFILER_ENABLED == true
+    for (uint8_t stage = 0; stage <= STAGE_COUNT; stage++) {
+      char summary[80];
+      loopProfiler.formatStage(stage, summary, sizeof(summary), cyclesPerMicrosecond());
+      Serial.printf("stage %s: %s\n", loopProfiler.name(stage), summary);
+    }
+#endif
+  }
+#endif
+
+  // Store settled color and brightness changes
+  if (colorChangeSettle && (millis() - colorChangeTime) > COLOR_CHANGE_SETTLE_DELAY) {
+    colorChangeSettle = false;
+
+    // Keep redrawing while the flower is still opening or closing
+    if (movementDirection == 0) {
+      doColorChange = false;
+    }
+
+#if DEBUG == true
+    Serial.println("store color and brightness");
 #endif
 
     storeSettings();
   }
+
+  // Write settings behind once they settled
+  persistSettings();
+
+#if HEAP_MONITOR_ENABLED == true
+  updateHeapMonitor();
+#endif
+  PROFILE_LAP(STAGE_OTHER);
+
+#if LOOP_PROFILER_ENABLED == true
+  loopProfiler.end(cycleCount());
+#endif
+
+  unsigned long loopDuration = micros() - loopStart;
+  if (loopDuration > maxLoopMicros) {
+    maxLoopMicros = loopDuration;
+  }
 }
@@ -0,0 +1,550 @@
+/**
+ * Host benchmarks for the animation core.
+ *
+ * Build and run with: pio run -e native && .pio/build/native/program
+ * The behaviour is covered by the unit tests in test/ (pio test -e native), which are built
+ * without this file.
+ */
+
+#ifndef PIO_UNIT_TESTING
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "flower.h"
+#include "filesystem.h"
+#include "pixel_stream.h"
+#include "loop_profiler.h"
+
+#include <ArduinoJson.h>
+
+/*** Allocation counting ***/
+
+static unsigned long allocations = 0;
+static size_t heapUsed = 0;
+static size_t heapPeak = 0;
+
+// Every block starts with its size, to track the heap in use. Not inlined into operator new/delete,
+// GCC would take the free() of the block for a mismatched deallocation.
+static constexpr size_t HEAP_HEADER = alignof(std::max_align_t);
+
+__attribute__((noinline)) static void *heapAllocate(size_t size)
+{
+  allocations++;
+  char *p = (char *)malloc(HEAP_HEADER + size);
+  if (!p) {
+    return nullptr;
+  }
+
+  *(size_t *)p = size;
+  heapUsed += size;
+  heapPeak = std::max(heapPeak, heapUsed);
+
+  return p + HEAP_HEADER;
+}
+
+__attribute__((noinline)) static void heapFree(void *p)
+{
+  if (p) {
+    char *block = (char *)p - HEAP_HEADER;
+    heapUsed -= *(size_t *)block;
+    free(block);
+  }
+}
+
+void *operator new(size_t size)
+{
+  void *p = heapAllocate(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { heapFree(p); }
+void operator delete[](void *p) noexcept { heapFree(p); }
+void operator delete(void *p, size_t) noexcept { heapFree(p); }
+void operator delete[](void *p, size_t) noexcept { heapFree(p); }
+
+// ArduinoJson allocator with the heap tracked like operator new
+struct TrackingAllocator {
+  void *allocate(size_t size) { return heapAllocate(size); }
+  void deallocate(void *p) { heapFree(p); }
+  void *reallocate(void *p, size_t size)
+  {
+    void *q = heapAllocate(size);
+    if (q && p) {
+      memcpy(q, p, std::min(size, *(size_t *)((char *)p - HEAP_HEADER)));
+    }
+    heapFree(p);
+    return q;
+  }
+};
+
+/*** Benchmark runner ***/
+
+// Keeps the compiler from optimizing away results
+static volatile uint32_t sink = 0;
+
+/**
+ * Run fn(i) iterations times after a warm up and print the time and allocations per call.
+ * Returns the nanoseconds per call.
+ */
+template <typename Fn>
+double bench(const char *name, unsigned long iterations, Fn fn)
+{
+  // Warm up
+  for (unsigned long i = 0; i < iterations / 10; i++) {
+    fn(i);
+  }
+
+  unsigned long allocationsBefore = allocations;
+  auto start = std::chrono::steady_clock::now();
+
+  for (unsigned long i = 0; i < iterations; i++) {
+    fn(i);
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  printf("%-28s %12.1f ns/op %10.2f allocs/op\n", name, ns / iterations,
+         double(allocations - allocationsBefore) / iterations);
+
+  return ns / iterations;
+}
+
+/*** Benchmarks ***/
+
+static void benchWheel()
+{
+  bench("Wheel", 1000000, [](unsigned long i) {
+    RgbColor c = Wheel(i);
+    sink += c.r + c.g + c.b;
+  });
+}
+
+static void benchSetWheel()
+{
+  bench("setWheel", 200000, [](unsigned long i) {
+    setWheel(i, Interpolator::ratio(i % 3000, 3000));
+    frameCommitter.commit();
+  });
+
+  bench("setWheel (unchanged frame)", 200000, [](unsigned long) {
+    setWheel(42, Interpolator::ONE);
+    frameCommitter.commit();
+  });
+}
+
+/**
+ * Output policy copying the frame into a GRB wire buffer with the brightness applied per pixel,
+ * what the Adafruit NeoPixel library does
+ */
+template <uint16_t N>
+class WireBufferOutput {
+public:
+  void begin(RgbColor *frame, uint8_t brightness) { show(frame, brightness); }
+
+  void show(RgbColor *frame, uint8_t brightness)
+  {
+    _frame = frame;
+    uint16_t scale = brightness + 1;
+
+    for (uint16_t i = 0; i < N; i++) {
+      _wire[i * 3] = (_frame[i].g * scale) >> 8;
+      _wire[i * 3 + 1] = (_frame[i].r * scale) >> 8;
+      _wire[i * 3 + 2] = (_frame[i].b * scale) >> 8;
+    }
+    sink += _wire[0];
+  }
+
+private:
+  const RgbColor *_frame = nullptr;
+  uint8_t _wire[N * 3];
+};
+
+/**
+ * The same rendering pushed through both kinds of output policy
+ */
+template <typename Output>
+static void benchLedOutput(const char *name)
+{
+  static FrameCommitter<NUM_LEDS, Output> committer;
+  committer.begin(50);
+
+  bench(name, 200000, [](unsigned long i) {
+    RgbColor color = Wheel(i);
+    RgbColor *pixels = committer.render();
+    for (uint16_t p = 0; p < NUM_LEDS; p++) {
+      pixels[p] = color;
+    }
+    committer.present(50);
+    committer.commit();
+  });
+}
+
+/**
+ * Render time of every effect for NUM_LEDS pixels, against its budget and a whole frame
+ */
+static void benchEffects()
+{
+  static EffectEngine<NUM_LEDS> engine;
+  static RgbColor pixels[NUM_LEDS];
+
+  for (uint8_t effect = 0; effect < EFFECT_COUNT; effect++) {
+    char name[40];
+    snprintf(name, sizeof(name), "effect %s", engine.name(effect));
+
+    double ns = bench(name, 200000, [effect](unsigned long i) {
+      engine.render(effect, pixels, EffectFrame{(uint32_t)(i * 7), (uint8_t)(i >> 8)}, cyclesPerMicrosecond());
+      sink += pixels[i % NUM_LEDS].r;
+    });
+
+    printf("%-28s %.2f%% of the budget, %.4f%% of a frame\n", "", ns * 100 / (engine.budgetMicros(effect) * 1000.0),
+           ns * FRAMES_PER_SECOND / 1e7);
+  }
+}
+
+static void benchUpdateFlower()
+{
+  bench("updateFlower (moving)", 200000, [](unsigned long) {
+    // Keep the flower opening and closing all the time
+    if (movementDirection == 0) {
+      settings.flowerGoalState = !settings.flowerGoalState;
+      movementDirection = settings.flowerGoalState ? 1 : -1;
+    }
+    doColorChange = true;
+
+    hal::advanceMillis(1000 / FRAMES_PER_SECOND);
+    updateFlower();
+  });
+
+  bench("updateFlower (idle)", 1000000, [](unsigned long) {
+    movementDirection = 0;
+    doColorChange = false;
+
+    hal::advanceMillis(1000 / FRAMES_PER_SECOND);
+    updateFlower();
+  });
+}
+
+/**
+ * One animation frame worth of interpolation math (ratio, servo position and brightness).
+ */
+template <typename Engine>
+static void benchInterpolator(const char *name)
+{
+  bench(name, 1000000, [](unsigned long i) {
+    typename Engine::Ratio r = Engine::ratio(i % 3001, 3000);
+    sink += Engine::lerp(SERVO_OPEN, SERVO_CLOSED, r);
+    sink += Engine::lerp(BRIGHTNESS_START, i & 0xff, r);
+  });
+}
+
+/**
+ * Frame pacing of a simulated loop(): most iterations take 0.2 - 2 ms, every 200th iteration
+ * stalls for 40 ms like a blocking network call.
+ */
+static void simulateFramePacing()
+{
+  FrameScheduler scheduler(FRAMES_PER_SECOND);
+  uint32_t seed = 1;
+  uint32_t now = 0;
+
+  for (unsigned long i = 0; i < 100000; i++) {
+    seed = seed * 1103515245 + 12345;
+    now += 200 + (seed >> 16) % 1800;
+
+    if (i % 200 == 199) {
+      now += 40000;
+    }
+
+    scheduler.poll(now);
+  }
+
+  printf("%-28s %lu frames in %.1f s, late %lu, dropped %lu, jitter p50/p90/p99 %u/%u/%u us\n", "frame pacing",
+         scheduler.frames(), now / 1e6, scheduler.late(), scheduler.dropped(), scheduler.jitterPercentile(50),
+         scheduler.jitterPercentile(90), scheduler.jitterPercentile(99));
+}
+
+static void benchMqttCallback()
+{
+  char topic[64];
+  strcpy(topic, mqtt_topic_color);
+
+  bench("mqttCallback (color)", 200000, [&topic](unsigned long i) {
+    char payload[4];
+    unsigned int length = snprintf(payload, sizeof(payload), "%lu", i & 0xff);
+    mqttCallback(topic, (byte *)payload, length);
+  });
+}
+
+/**
+ * Message throughput over all command topics plus an unknown one.
+ */
+static void benchMqttThroughput()
+{
+  static const char *topics[] = {mqtt_topic_brightness, mqtt_topic_timer, mqtt_topic_color, "esp/nightlamp/unknown"};
+  const unsigned long messages = 400000;
+  char topic[64];
+  char payload[8];
+
+  unsigned long allocationsBefore = allocations;
+  auto start = std::chrono::steady_clock::now();
+
+  for (unsigned long i = 0; i < messages; i++) {
+    strcpy(topic, topics[i & 3]);
+    unsigned int length = snprintf(payload, sizeof(payload), "%lu", 1 + (i & 0xfe));
+    mqttCallback(topic, (byte *)payload, length);
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("mqtt throughput: %.0f messages/s, %lu allocations\n", messages / seconds, allocations - allocationsBefore);
+}
+
+/**
+ * Latency from sending a frame over UDP on the loopback interface to the LED output, each packet
+ * received like on the device: the header first, then the pixel data straight into the pixel buffer.
+ */
+static void benchPixelStream()
+{
+  int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+  int sender = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address = {};
+  socklen_t addressLength = sizeof(address);
+
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (receiver < 0 || sender < 0 || bind(receiver, (sockaddr *)&address, sizeof(address)) != 0 ||
+      getsockname(receiver, (sockaddr *)&address, &addressLength) != 0 ||
+      connect(sender, (sockaddr *)&address, sizeof(address)) != 0) {
+    printf("%-28s no loopback socket\n", "pixel stream latency");
+    return;
+  }
+
+  std::vector<double> latencies;
+
+  for (unsigned frame = 0; frame < 2000; frame++) {
+    uint8_t packet[DDP_HEADER_SIZE + NUM_LEDS * sizeof(RgbColor)] = {
+      0x41, (uint8_t)(frame % 15 + 1), 0x01, 0x01, 0, 0, 0, 0, 0, NUM_LEDS * sizeof(RgbColor)};
+    memset(packet + DDP_HEADER_SIZE, frame, sizeof(packet) - DDP_HEADER_SIZE);
+
+    auto start = std::chrono::steady_clock::now();
+    send(sender, packet, sizeof(packet), 0);
+
+    pollfd pending = {receiver, POLLIN, 0};
+    if (poll(&pending, 1, 100) != 1) {
+      continue;
+    }
+
+    uint8_t header[DDP_HEADER_SIZE];
+    PixelStreamChunk chunk;
+    // The size of the whole datagram, like parsePacket() on the device
+    ssize_t size = recv(receiver, header, sizeof(header), MSG_PEEK | MSG_TRUNC);
+
+    if (size >= (ssize_t)sizeof(header) && pixelStream.receive(header, size, micros(), chunk)) {
+      iovec parts[] = {{header, sizeof(header)}, {(uint8_t *)streamedPixels() + chunk.offset, chunk.length}};
+      msghdr message = {};
+      message.msg_iov = parts;
+      message.msg_iovlen = 2;
+      recvmsg(receiver, &message, 0);
+
+      if (chunk.push) {
+        showStreamedPixels();
+      }
+    } else {
+      recv(receiver, packet, sizeof(packet), 0);
+    }
+
+    latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  close(sender);
+  close(receiver);
+
+  // Back to the normal rendering
+  hal::advanceMillis(PIXEL_STREAM_TIMEOUT + 1);
+  updatePixelStream();
+  frameCommitter.commit();
+
+  std::sort(latencies.begin(), latencies.end());
+  double p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+  double p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+
+  printf("%-28s p50/p99 %.0f/%.0f us of %lu frames\n", "pixel stream latency", p50, p99,
+         (unsigned long)latencies.size());
+}
+
+/**
+ * Local API: from a received command (HTTP body or WebSocket message) to the pixel update, and
+ * formatting the state answer
+ */
+static void benchApi()
+{
+  unsigned long presented = frameCommitter.presented();
+
+  bench("api command -> pixels", 100000, [](unsigned long i) {
+    char json[32];
+    int length = snprintf(json, sizeof(json), "{\"color\":%lu}", i & 0xff);
+    applyCommand(json, length);
+  });
+
+  printf("%-28s %lu of 110000 commands\n", "api pixel updates", frameCommitter.presented() - presented);
+
+  bench("api state", 200000, [](unsigned long) {
+    char state[LAMP_STATE_JSON_SIZE];
+    sink += formatLampState(state, sizeof(state));
+  });
+}
+
+/**
+ * The cost of a profiler lap and the loop stages of the animation core
+ */
+static void benchLoopProfiler()
+{
+  static const char *const names[] = {"frame", "color", "settings", "loop"};
+  LoopProfiler<3> profiler(names);
+
+  bench("profiler lap", 1000000, [&profiler](unsigned long i) {
+    profiler.lap(i % 3, cycleCount());
+  });
+
+  LoopProfiler<3> loop(names);
+  for (unsigned i = 0; i < 20000; i++) {
+    loop.begin(cycleCount());
+
+    hal::advanceMillis(1);
+    updateFlower();
+    loop.lap(0, cycleCount());
+
+    setWheel(i, Interpolator::ONE);
+    loop.lap(1, cycleCount());
+
+    persistSettings();
+    loop.lap(2, cycleCount());
+
+    loop.end(cycleCount());
+  }
+
+  for (uint8_t stage = 0; stage <= 3; stage++) {
+    char summary[80];
+    loop.formatStage(stage, summary, sizeof(summary), cyclesPerMicrosecond());
+    printf("%-28s %s\n", loop.name(stage), summary);
+  }
+
+  char summary[80];
+  frameCommitter.renderCycles().format(summary, sizeof(summary), cyclesPerMicrosecond());
+  printf("%-28s %s\n", "frame render", summary);
+  frameCommitter.commitCycles().format(summary, sizeof(summary), cyclesPerMicrosecond());
+  printf("%-28s %s\n", "frame commit", summary);
+}
+
+/**
+ * Boot time loading of the configuration as it was done before the binary record: the whole file
+ * in a heap buffer, parsed into a 1024 byte heap document.
+ */
+static bool loadConfigJsonHeap()
+{
+  File configFile = LittleFS.open("/config.json", "r");
+  if (!configFile) {
+    return false;
+  }
+
+  size_t size = configFile.size();
+  std::unique_ptr<char[]> buf(new char[size]);
+  configFile.readBytes(buf.get(), size);
+  configFile.close();
+
+  BasicJsonDocument<TrackingAllocator> json(1024);
+  if (deserializeJson(json, buf.get())) {
+    return false;
+  }
+
+  strcpy(otaPassword, json["otaPassword"]);
+  otaPort = json["otaPort"];
+  strcpy(mqtt_server, json["mqttServer"]);
+  mqtt_port = json["mqttPort"];
+  strcpy(device_id, json["mqttDeviceId"]);
+  strcpy(mqtt_user, json["mqttUser"]);
+  strcpy(mqtt_pass, json["mqttPass"]);
+
+  return true;
+}
+
+template <typename Fn>
+static void benchConfigLoad(const char *name, Fn load)
+{
+  heapPeak = heapUsed;
+  size_t heapBefore = heapUsed;
+
+  bench(name, 50000, [&load](unsigned long) {
+    sink += load();
+  });
+
+  printf("%-28s %12lu bytes peak heap\n", "", (unsigned long)(heapPeak - heapBefore));
+}
+
+/**
+ * Load time and peak heap of the configuration formats
+ */
+static void benchConfigFormats()
+{
+  const char *config = "{\"otaPassword\":\"secret\",\"otaPort\":8266,\"mqttServer\":\"broker.local\","
+                       "\"mqttPort\":1883,\"mqttDeviceId\":\"esp8266-nightlamp\",\"mqttUser\":\"lamp\","
+                       "\"mqttPass\":\"pass\"}";
+
+  File configFile = LittleFS.open("/config.json", "w");
+  configFile.write((const uint8_t *)config, strlen(config));
+  configFile.close();
+  LittleFS.remove("/config.bin");
+
+  benchConfigLoad("config json (heap)", loadConfigJsonHeap);
+  benchConfigLoad("config json import (stack)", importConfigJson);
+
+  storeConfigRecord();
+  benchConfigLoad("config record", loadConfigRecord);
+  printf("%-28s %12u bytes (json %u bytes)\n", "", (unsigned)sizeof(ConfigRecord), (unsigned)strlen(config));
+
+  LittleFS.remove("/config.bin");
+}
+
+int main()
+{
+  printf("%-28s %18s %20s\n", "benchmark", "time", "allocations");
+
+  benchWheel();
+  benchSetWheel();
+  benchLedOutput<HostLedOutput<NUM_LEDS>>("commit (send from frame)");
+  benchLedOutput<WireBufferOutput<NUM_LEDS>>("commit (wire buffer copy)");
+  benchUpdateFlower();
+  benchInterpolator<FloatInterpolator>("interpolation (float)");
+  benchInterpolator<FixedInterpolator>("interpolation (Q16)");
+  benchMqttCallback();
+  benchApi();
+  benchMqttThroughput();
+  benchEffects();
+  benchLoopProfiler();
+  benchConfigFormats();
+
+  printf("\nservo writes: %lu, flash erases: %lu\n", myServo.writes, hal::flashErases);
+  printf("frames presented: %lu, shown: %lu, skipped: %lu\n\n", frameCommitter.presented(), frameCommitter.shown(),
+         frameCommitter.skipped());
+
+  simulateFramePacing();
+  benchPixelStream();
+
+  return 0;
+}
+#endif
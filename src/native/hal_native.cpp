@@ -0,0 +1,135 @@
+#include "hal.h"
+#include "config.h"
+
+#include <chrono>
+
+/*** Time ***/
+
+static unsigned long hostMicros = 0;
+
+unsigned long millis() { return hostMicros / 1000; }
+unsigned long micros() { return hostMicros; }
+void delay(unsigned long ms) { hostMicros += ms * 1000; }
+void delayMicroseconds(unsigned int us) { hostMicros += us; }
+
+namespace hal {
+void advanceMillis(unsigned long ms) { hostMicros += ms * 1000; }
+void advanceMicros(unsigned long us) { hostMicros += us; }
+}
+
+// Unlike the simulated clock, the cycle counter runs in real time: one "cycle" per nanosecond
+uint32_t cycleCount()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t cyclesPerMicrosecond() { return 1000; }
+
+/*** Serial ***/
+
+HostSerial Serial;
+
+/*** Servo ***/
+
+uint8_t Servo::attach(int, int, int, int value)
+{
+  _value = value;
+  return 0;
+}
+
+void Servo::write(int value)
+{
+  _value = value;
+  writes++;
+}
+
+/*** Flash ***/
+
+static uint8_t flashSector[FLASH_SECTOR_SIZE];
+// Starts erased like the sector of a new device
+static const bool flashSectorErased = memset(flashSector, 0xFF, sizeof(flashSector));
+
+namespace hal {
+unsigned long flashErases = 0;
+unsigned long flashWrites = 0;
+}
+
+bool flashSectorErase()
+{
+  memset(flashSector, 0xFF, sizeof(flashSector));
+  hal::flashErases++;
+
+  return true;
+}
+
+bool flashSectorWrite(uint32_t offset, const uint32_t *data, size_t size)
+{
+  if (offset % 4 || size % 4 || offset + size > sizeof(flashSector)) {
+    return false;
+  }
+
+  // Programming can only clear bits
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < size; i++) {
+    flashSector[offset + i] &= bytes[i];
+  }
+  hal::flashWrites++;
+
+  return true;
+}
+
+bool flashSectorRead(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (offset % 4 || size % 4 || offset + size > sizeof(flashSector)) {
+    return false;
+  }
+
+  memcpy(data, flashSector + offset, size);
+
+  return true;
+}
+
+/*** LittleFS ***/
+
+FS LittleFS;
+
+size_t File::readBytes(char *buffer, size_t length)
+{
+  if (!_content || _position >= _content->size()) {
+    return 0;
+  }
+
+  size_t count = std::min(length, _content->size() - _position);
+  memcpy(buffer, _content->data() + _position, count);
+  _position += count;
+
+  return count;
+}
+
+size_t File::write(const uint8_t *buffer, size_t length)
+{
+  if (!_content || !_write) {
+    return 0;
+  }
+
+  _content->append((const char *)buffer, length);
+
+  return length;
+}
+
+File FS::open(const char *path, const char *mode)
+{
+  bool write = mode[0] == 'w' || mode[0] == 'a';
+
+  if (!write && !exists(path)) {
+    return File();
+  }
+
+  std::string &content = _files[path];
+  if (mode[0] == 'w') {
+    content.clear();
+  }
+
+  return File(&content, write);
+}
+
@@ -0,0 +1,28 @@
+#pragma once
+
+/**
+ * Shared part of the native unit tests: heap allocation counting.
+ *
+ * Include from exactly one file per test program, it replaces the global operator new/delete.
+ */
+
+#include <new>
+#include <stdlib.h>
+
+static unsigned long allocations = 0;
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
@@ -0,0 +1,347 @@
+/**
+ * Animation core: interpolation, frame pacing, the render and commit pipeline, effects and crossfades.
+ *
+ * Run with: pio test -e native
+ */
+
+#include <algorithm>
+
+#include <unity.h>
+
+#include "flower.h"
+
+#include "../native_test.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/**
+ * The fixed point engine against the float engine for every frame of a 3 s movement and every
+ * maximum brightness: at most one brightness step apart, the same endpoints and monotonic.
+ */
+static void test_fixed_interpolation_matches_float(void)
+{
+  const int32_t duration = 3000;
+
+  for (int32_t brightnessMax = 1; brightnessMax <= 255; brightnessMax++) {
+    int32_t lastFixed = -1;
+
+    for (int32_t elapsed = 0; elapsed <= duration; elapsed++) {
+      int32_t f = FloatInterpolator::lerp(BRIGHTNESS_START, brightnessMax, FloatInterpolator::ratio(elapsed, duration));
+      int32_t q = FixedInterpolator::lerp(BRIGHTNESS_START, brightnessMax, FixedInterpolator::ratio(elapsed, duration));
+
+      TEST_ASSERT_LESS_OR_EQUAL(1, abs(f - q));
+      TEST_ASSERT_GREATER_OR_EQUAL(lastFixed, q);
+      lastFixed = q;
+
+      if (elapsed == 0 || elapsed == duration) {
+        TEST_ASSERT_EQUAL(f, q);
+      }
+    }
+  }
+
+  for (int32_t elapsed = 0; elapsed <= duration; elapsed += 100) {
+    int32_t f = FloatInterpolator::lerp(SERVO_OPEN, SERVO_CLOSED, FloatInterpolator::ratio(elapsed, duration));
+    int32_t q = FixedInterpolator::lerp(SERVO_OPEN, SERVO_CLOSED, FixedInterpolator::ratio(elapsed, duration));
+
+    TEST_ASSERT_LESS_OR_EQUAL(1, abs(f - q));
+  }
+}
+
+/**
+ * The slack loop() has for network work: the time until the next frame, none while a frame is due
+ */
+static void test_frame_scheduler_slack(void)
+{
+  FrameScheduler scheduler(60);
+
+  TEST_ASSERT_TRUE(scheduler.poll(1000000));
+  TEST_ASSERT_EQUAL(16666, scheduler.slackMicros(1000000));
+  TEST_ASSERT_EQUAL(6666, scheduler.slackMicros(1010000));
+  TEST_ASSERT_FALSE(scheduler.poll(1010000));
+
+  // Due and late frames leave no slack until they ran
+  TEST_ASSERT_EQUAL(0, scheduler.slackMicros(1016666));
+  TEST_ASSERT_EQUAL(0, scheduler.slackMicros(1050000));
+  TEST_ASSERT_TRUE(scheduler.poll(1050000));
+  TEST_ASSERT_EQUAL(1, scheduler.late());
+  TEST_ASSERT_LESS_OR_EQUAL(scheduler.periodMicros(), scheduler.slackMicros(1050000));
+  TEST_ASSERT_GREATER_THAN(0, scheduler.slackMicros(1050000));
+}
+
+static void fill(RgbColor *pixels, RgbColor color, uint16_t count)
+{
+  for (uint16_t p = 0; p < count; p++) {
+    pixels[p] = color;
+  }
+}
+
+static bool all(const RgbColor *pixels, RgbColor color)
+{
+  for (uint16_t p = 0; p < NUM_LEDS; p++) {
+    if (pixels[p].r != color.r || pixels[p].g != color.g || pixels[p].b != color.b) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Several renders within a frame are sent once, the sent frame is never written while the next
+ * one is drawn, unchanged frames are skipped.
+ */
+static void test_frame_pipeline(void)
+{
+  static FrameCommitter<NUM_LEDS, HostLedOutput<NUM_LEDS>> committer;
+  committer.begin(50);
+
+  // Two renders within one frame
+  fill(committer.render(), RgbColor{255, 0, 0}, NUM_LEDS);
+  committer.present(50);
+  fill(committer.render(), RgbColor{0, 0, 255}, NUM_LEDS);
+  committer.present(50);
+  unsigned long shows = committer.output().shows();
+  TEST_ASSERT_TRUE(committer.commit());
+  TEST_ASSERT_EQUAL(shows + 1, committer.output().shows());
+  TEST_ASSERT_FALSE(committer.pending());
+
+  // Half drawn and presented but not yet committed frames leave the sent one alone
+  fill(committer.render(), RgbColor{0, 255, 0}, NUM_LEDS / 2);
+  TEST_ASSERT_TRUE(all(committer.output().frame(), RgbColor{0, 0, 255}));
+  fill(committer.back() + NUM_LEDS / 2, RgbColor{0, 255, 0}, NUM_LEDS - NUM_LEDS / 2);
+  committer.present(50);
+  fill(committer.render(), RgbColor{0, 0, 0}, NUM_LEDS / 2);
+  TEST_ASSERT_TRUE(all(committer.output().frame(), RgbColor{0, 0, 255}));
+  TEST_ASSERT_TRUE(committer.commit());
+  TEST_ASSERT_TRUE(all(committer.output().frame(), RgbColor{0, 255, 0}));
+
+  // Unchanged frames are not sent again, nothing pending sends nothing
+  fill(committer.back(), RgbColor{0, 255, 0}, NUM_LEDS);
+  committer.present(50);
+  TEST_ASSERT_FALSE(committer.commit());
+  TEST_ASSERT_EQUAL(1, committer.skipped());
+  TEST_ASSERT_FALSE(committer.commit());
+
+  for (unsigned long i = 0; i < 2000; i++) {
+    RgbColor *pixels = committer.render();
+    for (uint16_t p = 0; p < NUM_LEDS; p++) {
+      pixels[p] = Wheel((i + p * 8) & 0xff);
+    }
+    committer.present(50);
+    committer.commit();
+  }
+
+  unsigned long lines = 0, allocationsBefore = allocations;
+  committer.writeMetrics([&lines](const char *, int) { lines++; }, cyclesPerMicrosecond());
+
+  TEST_ASSERT_EQUAL(allocationsBefore, allocations);
+  TEST_ASSERT_GREATER_THAN(0, lines);
+  TEST_ASSERT_EQUAL(2004, committer.renderCycles().count());
+  TEST_ASSERT_EQUAL(committer.output().shows() - 1, committer.shown());
+}
+
+/**
+ * Budgets fit a quarter of a frame, rendering stays within them, and only animated effects change
+ * over time
+ */
+static void test_effects(void)
+{
+  static EffectEngine<NUM_LEDS> engine;
+  static RgbColor first[NUM_LEDS];
+  static RgbColor pixels[NUM_LEDS];
+
+  for (uint8_t effect = 0; effect < EFFECT_COUNT; effect++) {
+    TEST_ASSERT_LESS_OR_EQUAL(1000000 / FRAMES_PER_SECOND, engine.budgetMicros(effect) * 4);
+
+    for (unsigned long i = 0; i < 1000; i++) {
+      engine.render(effect, pixels, EffectFrame{(uint32_t)(i * 7), (uint8_t)(i >> 2)}, cyclesPerMicrosecond());
+    }
+    // Some slack for a preempted host process
+    TEST_ASSERT_LESS_OR_EQUAL(10, engine.overruns(effect));
+
+    engine.render(effect, first, EffectFrame{0, 42}, cyclesPerMicrosecond());
+    engine.render(effect, pixels, EffectFrame{1000, 42}, cyclesPerMicrosecond());
+    TEST_ASSERT_EQUAL(engine.animated(effect), memcmp(first, pixels, sizeof(pixels)) != 0);
+
+    uint8_t found = EFFECT_COUNT;
+    const char *name = engine.name(effect);
+    TEST_ASSERT_TRUE(engine.find(name, strlen(name), found));
+    TEST_ASSERT_EQUAL(effect, found);
+  }
+
+  TEST_ASSERT_EQUAL(EFFECT_WHEEL, engine.valid(EFFECT_COUNT));
+}
+
+static Crossfade<NUM_LEDS> fade;
+static RgbColor fadePixels[NUM_LEDS];
+static RgbColor fadePrevious[NUM_LEDS];
+
+// Largest change of a channel between two frames
+static int largestStep()
+{
+  int largest = 0;
+  for (uint16_t i = 0; i < NUM_LEDS * 3; i++) {
+    largest = std::max(largest, abs(((uint8_t *)fadePixels)[i] - ((uint8_t *)fadePrevious)[i]));
+  }
+  memcpy(fadePrevious, fadePixels, sizeof(fadePixels));
+  return largest;
+}
+
+/**
+ * Red to blue in 30 frames, retargeted to green halfway: evenly stepped and without a jump
+ */
+static void test_crossfade_retarget(void)
+{
+  fill(fade.target(), RgbColor{255, 0, 0}, NUM_LEDS);
+  fade.retarget(30);
+  fade.render(fadePixels);
+  largestStep();
+
+  fill(fade.target(), RgbColor{0, 0, 255}, NUM_LEDS);
+  fade.retarget(30);
+  unsigned frames = 0;
+  while (fade.advance()) {
+    frames++;
+    if (frames == 15) {
+      fill(fade.target(), RgbColor{0, 255, 0}, NUM_LEDS);
+      fade.retarget(30);
+      fade.render(fadePixels);
+      TEST_ASSERT_EQUAL(0, largestStep());
+    }
+    fade.render(fadePixels);
+    TEST_ASSERT_LESS_OR_EQUAL(9, largestStep());
+  }
+
+  TEST_ASSERT_EQUAL(45, frames);
+  TEST_ASSERT_TRUE(all(fadePixels, RgbColor{0, 255, 0}));
+}
+
+/**
+ * 10 levels in 10 s: every level for the same time, where a per-frame 8 bit step of 10 / 600
+ * would round to nothing (or to one level per frame)
+ */
+static void test_crossfade_slow(void)
+{
+  fill(fade.target(), RgbColor{0, 0, 0}, NUM_LEDS);
+  fade.retarget(0);
+  fade.render(fadePixels);
+  fill(fade.target(), RgbColor{10, 0, 0}, NUM_LEDS);
+  fade.retarget(600);
+
+  unsigned changes = 0, shortest = 600, longest = 0, since = 0;
+  uint8_t level = 0;
+  while (fade.advance()) {
+    fade.render(fadePixels);
+    since++;
+    if (fadePixels[0].r != level) {
+      if (changes) {
+        shortest = std::min(shortest, since);
+        longest = std::max(longest, since);
+      }
+      changes++;
+      since = 0;
+      level = fadePixels[0].r;
+    }
+  }
+
+  TEST_ASSERT_EQUAL(10, changes);
+  TEST_ASSERT_EQUAL(10, level);
+  TEST_ASSERT_LESS_OR_EQUAL(1, longest - shortest);
+}
+
+/**
+ * Black to white in 10 s at brightness 20: the 22 output levels left step up one at a time and
+ * each is shown for the same time. Scaling the rounded 8 bit channels would band.
+ */
+static void test_crossfade_low_brightness(void)
+{
+  const uint8_t brightness = 20;
+  fill(fade.target(), RgbColor{0, 0, 0}, NUM_LEDS);
+  fade.retarget(0);
+  fade.render(fadePixels, brightness);
+  fill(fade.target(), RgbColor{255, 255, 255}, NUM_LEDS);
+  fade.retarget(600);
+
+  unsigned changes = 0, shortest = 600, longest = 0, since = 0;
+  uint8_t level = fadePixels[0].g;
+  while (fade.advance()) {
+    fade.render(fadePixels, brightness);
+    since++;
+    if (fadePixels[0].g != level) {
+      TEST_ASSERT_EQUAL(level + 1, fadePixels[0].g);
+      if (changes) {
+        shortest = std::min(shortest, since);
+        longest = std::max(longest, since);
+      }
+      changes++;
+      since = 0;
+      level = fadePixels[0].g;
+    }
+  }
+
+  TEST_ASSERT_EQUAL(21, changes);
+  TEST_ASSERT_EQUAL((255 * (brightness + 1) + 0x80) >> 8, level);
+  TEST_ASSERT_LESS_OR_EQUAL(1, longest - shortest);
+}
+
+/**
+ * Within the frame loop a color change fades over the configured duration, one transfer per frame
+ */
+static void test_crossfade_frame_loop(void)
+{
+  movementDirection = 0;
+  doColorChange = false;
+  settings.effect = EFFECT_WHEEL;
+
+  // The first frame, shown right away like by setup()
+  setWheel(settings.wheelPosition, Interpolator::ONE);
+  for (unsigned i = 0; i < 60; i++) {
+    hal::advanceMillis(1000 / FRAMES_PER_SECOND);
+    updateFlower();
+    frameCommitter.commit();
+  }
+
+  char topic[64];
+  char payload[8];
+  strcpy(topic, mqtt_topic_color);
+  mqttCallback(topic, (byte *)payload, sprintf(payload, "%d", (settings.wheelPosition + 100) % 256));
+
+  unsigned long shows = frameCommitter.output().shows();
+  unsigned ticks = 0;
+  do {
+    hal::advanceMillis(1000 / FRAMES_PER_SECOND);
+    updateFlower();
+    frameCommitter.commit();
+    ticks++;
+  } while (crossfade.fading() && ticks < 1000);
+
+  TEST_ASSERT_EQUAL(fadeDuration * FRAMES_PER_SECOND / 1000, ticks);
+  TEST_ASSERT_LESS_OR_EQUAL(ticks, frameCommitter.output().shows() - shows);
+
+  // The wheel effect: both halves of the flower at their target colors, the brightness applied
+  // in the crossfade
+  auto scaled = [](RgbColor color) {
+    uint32_t scale = (uint8_t)settings.brightness + 1;
+    return RgbColor{(uint8_t)((color.r * scale + 0x80) >> 8), (uint8_t)((color.g * scale + 0x80) >> 8),
+                    (uint8_t)((color.b * scale + 0x80) >> 8)};
+  };
+  RgbColor first = scaled(Wheel(settings.wheelPosition));
+  RgbColor second = scaled(Wheel(128 - settings.wheelPosition));
+  TEST_ASSERT_EQUAL(255, frameCommitter.output().brightness());
+  TEST_ASSERT_EQUAL_MEMORY(&first, &frameCommitter.output().frame()[0], sizeof(RgbColor));
+  TEST_ASSERT_EQUAL_MEMORY(&second, &frameCommitter.output().frame()[NUM_LEDS - 1], sizeof(RgbColor));
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_fixed_interpolation_matches_float);
+  RUN_TEST(test_frame_scheduler_slack);
+  RUN_TEST(test_frame_pipeline);
+  RUN_TEST(test_effects);
+  RUN_TEST(test_crossfade_retarget);
+  RUN_TEST(test_crossfade_slow);
+  RUN_TEST(test_crossfade_low_brightness);
+  RUN_TEST(test_crossfade_frame_loop);
+  return UNITY_END();
+}
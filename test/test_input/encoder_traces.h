@@ -0,0 +1,35 @@
+#pragma once
+
+/**
+ * Encoder input events as queued by the ISR: detents of the event and the time since the previous
+ * event in microseconds.
+ *
+ * Synthetic, no capture of the real encoder yet: modelled on a hand turning the knob, with jittered
+ * intervals (±35 %), events of two detents (the ISR queued both before loop() drained them) and
+ * bursts of a detent shortly after the previous one. To be replaced by a capture from the device
+ * (the queued events with their times) once there is one.
+ */
+
+#include <stdint.h>
+
+struct EncoderTraceEvent {
+  int8_t detents;
+  uint32_t intervalMicros;
+};
+
+// Slowly adjusting the color first, then after a pause a flick speeding up to 5 ms per detent
+// and slowing down again
+static const uint8_t ENCODER_TRACE_FLICK_BEGIN = 6;
+// Turning back slowly after a pause
+static const uint8_t ENCODER_TRACE_BACK_BEGIN = 39;
+
+static const EncoderTraceEvent encoderTrace[] = {
+  {1, 145621}, {1, 126593}, {1, 181602}, {1, 117967}, {1, 168947}, {1, 150225}, {1, 600000},
+  {1, 37175}, {1, 22969}, {1, 29510}, {1, 19520}, {1, 17775}, {1, 20739}, {1, 13907}, {1, 17277},
+  {1, 11915}, {1, 829}, {2, 16760}, {1, 554}, {2, 16634}, {1, 5581}, {2, 7730}, {1, 7073}, {1, 7588},
+  {1, 9864}, {1, 9807}, {1, 12275}, {1, 8743}, {1, 15795}, {1, 644}, {1, 10112}, {1, 18501},
+  {1, 21639}, {1, 21064}, {1, 27650}, {1, 20715}, {1, 29345}, {1, 29717}, {1, 31677}, {-1, 450000},
+  {-1, 147372}, {-1, 170398}, {-1, 176680},
+};
+
+static const uint8_t ENCODER_TRACE_LENGTH = sizeof(encoderTrace) / sizeof(encoderTrace[0]);
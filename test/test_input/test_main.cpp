@@ -0,0 +1,173 @@
+/**
+ * Input: push button gestures and the encoder acceleration, replayed from timing traces.
+ *
+ * Run with: pio test -e native
+ */
+
+#include <stdlib.h>
+
+#include <unity.h>
+
+#include "config.h"
+#include "button_gestures.h"
+#include "encoder_acceleration.h"
+
+#include "encoder_traces.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/**
+ * Steps for a number of detents turned evenly
+ */
+static int turn(uint8_t detents, uint32_t intervalMicros)
+{
+  EncoderAcceleration acceleration(ENCODER_SLOW_MICROS, ENCODER_FAST_MICROS, ENCODER_MAX_STEPS);
+  uint32_t now = 1000000;
+  int steps = 0;
+
+  for (uint8_t i = 0; i < detents; i++) {
+    now += intervalMicros;
+    steps += acceleration.steps(1, now);
+  }
+
+  return steps;
+}
+
+/**
+ * Slow turns move one step per detent, faster ones more, never more than ENCODER_MAX_STEPS
+ */
+static void test_encoder_acceleration(void)
+{
+  int slow = turn(10, 150000);
+  int medium = turn(20, 30000);
+  int fast = turn(24, 6000);
+  int veryFast = turn(48, 2000);
+
+  TEST_ASSERT_EQUAL(10, slow);
+  TEST_ASSERT_GREATER_THAN(20, medium);
+  TEST_ASSERT_GREATER_THAN(medium * 24 / 20, fast);
+  TEST_ASSERT_GREATER_THAN(fast * 2, veryFast);
+  TEST_ASSERT_LESS_OR_EQUAL(48 * ENCODER_MAX_STEPS, veryFast);
+}
+
+/**
+ * Turning back after a fast spin starts over slow
+ */
+static void test_encoder_direction_change(void)
+{
+  EncoderAcceleration acceleration(ENCODER_SLOW_MICROS, ENCODER_FAST_MICROS, ENCODER_MAX_STEPS);
+  uint32_t now = 1000000;
+
+  for (uint8_t i = 0; i < 24; i++) {
+    now += 4000;
+    acceleration.steps(1, now);
+  }
+
+  now += 4000;
+  TEST_ASSERT_EQUAL(-1, acceleration.steps(-1, now));
+}
+
+/**
+ * The jittered and bursty trace: the steps follow the speed of the turn without jumping on single
+ * short intervals, pauses and turning back start over slow
+ */
+static void test_encoder_trace(void)
+{
+  EncoderAcceleration acceleration(ENCODER_SLOW_MICROS, ENCODER_FAST_MICROS, ENCODER_MAX_STEPS);
+  uint32_t now = 1000000;
+  int flickSteps = 0, flickDetents = 0;
+  int lastFactor = 1;
+
+  for (uint8_t i = 0; i < ENCODER_TRACE_LENGTH; i++) {
+    const EncoderTraceEvent &event = encoderTrace[i];
+    int detents = event.detents > 0 ? event.detents : -event.detents;
+
+    now += event.intervalMicros;
+    int steps = acceleration.steps(event.detents, now);
+    int factor = (steps > 0 ? steps : -steps) / detents;
+
+    TEST_ASSERT_EQUAL(event.detents > 0, steps > 0);
+    TEST_ASSERT_EQUAL(factor * detents, steps > 0 ? steps : -steps);
+    TEST_ASSERT_GREATER_OR_EQUAL(1, factor);
+    TEST_ASSERT_LESS_OR_EQUAL(ENCODER_MAX_STEPS, factor);
+    // Smoothed, a burst raises the speed gradually
+    TEST_ASSERT_LESS_OR_EQUAL(3, abs(factor - lastFactor));
+    lastFactor = factor;
+
+    if (i <= ENCODER_TRACE_FLICK_BEGIN || i >= ENCODER_TRACE_BACK_BEGIN) {
+      TEST_ASSERT_EQUAL(1, factor);
+    }
+    if (i >= ENCODER_TRACE_FLICK_BEGIN && i < ENCODER_TRACE_BACK_BEGIN) {
+      flickSteps += steps;
+      flickDetents += detents;
+    }
+  }
+
+  TEST_ASSERT_GREATER_THAN(2 * flickDetents, flickSteps);
+}
+
+/**
+ * Replay a push button trace (alternating down/up times in ms) through the gesture engine while
+ * ticking it every millisecond, and count each recognized gesture
+ */
+static void replay(const uint16_t *edges, uint8_t count, unsigned *counts)
+{
+  ButtonGestures gestures(BUTTON_DOUBLE_CLICK_MICROS, BUTTON_LONG_PRESS_MICROS, BUTTON_REPEAT_MICROS);
+  uint8_t edge = 0;
+
+  for (uint8_t i = 0; i < 7; i++) {
+    counts[i] = 0;
+  }
+
+  for (uint32_t ms = 0; ms < 3000; ms++) {
+    uint8_t recognized = 0;
+
+    if (edge < count && edges[edge] == ms) {
+      recognized |= edge % 2 == 0 ? gestures.down(ms * 1000) : gestures.up(ms * 1000);
+      edge++;
+    }
+    recognized |= gestures.tick(ms * 1000);
+
+    for (uint8_t i = 0; i < 7; i++) {
+      counts[i] += (recognized >> i) & 1;
+    }
+  }
+}
+
+// Gesture counts in the order of the bits: press, release, click, double click, long press, repeat, triple click
+static void test_button_gestures(void)
+{
+  struct Trace {
+    uint16_t edges[6];
+    uint8_t count;
+    unsigned expected[7];
+  };
+
+  static const Trace traces[] = {
+    {{100, 180}, 2, {1, 1, 1, 0, 0, 0, 0}},                     // click
+    {{100, 170, 320, 390}, 4, {2, 2, 0, 1, 0, 0, 0}},           // double click
+    {{100, 170, 320, 390, 540, 610}, 6, {3, 3, 0, 0, 0, 0, 1}}, // triple click
+    {{100, 170, 600, 680}, 4, {2, 2, 2, 0, 0, 0, 0}},           // two slow clicks
+    {{100, 2100}, 2, {1, 1, 0, 0, 1, 13, 0}},                   // hold 2 s
+  };
+
+  for (const Trace &trace : traces) {
+    unsigned counts[7];
+    replay(trace.edges, trace.count, counts);
+
+    for (uint8_t i = 0; i < 7; i++) {
+      TEST_ASSERT_EQUAL(trace.expected[i], counts[i]);
+    }
+  }
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_encoder_acceleration);
+  RUN_TEST(test_encoder_direction_change);
+  RUN_TEST(test_encoder_trace);
+  RUN_TEST(test_button_gestures);
+  return UNITY_END();
+}
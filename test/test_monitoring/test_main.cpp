@@ -0,0 +1,161 @@
+/**
+ * Monitoring: the loop profiler, the boot timeline and the heap monitor.
+ *
+ * Run with: pio test -e native
+ */
+
+#include <unity.h>
+
+#include "flower.h"
+#include "loop_profiler.h"
+#include "boot_timeline.h"
+#include "heap_monitor.h"
+
+#include "../native_test.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/**
+ * Percentiles of a known distribution, rounded up to the bucket bounds
+ */
+static void test_histogram_percentiles(void)
+{
+  LogHistogram histogram;
+  for (unsigned i = 0; i < 1000; i++) {
+    histogram.record(i < 900 ? 100 : 5000);
+  }
+
+  TEST_ASSERT_EQUAL(1000, histogram.count());
+  TEST_ASSERT_EQUAL(127, histogram.percentile(50));
+  TEST_ASSERT_EQUAL(5000, histogram.percentile(99));
+  TEST_ASSERT_EQUAL(5000, histogram.max());
+}
+
+/**
+ * The loop stages of the animation core, written to /metrics without allocations
+ */
+static void test_loop_profiler(void)
+{
+  static const char *const names[] = {"frame", "color", "settings", "loop"};
+  LoopProfiler<3> loop(names);
+
+  // The cost of an empty lap is measured without leaving anything in the histograms
+  uint32_t lapCycles = loop.measureLap(cycleCount);
+  TEST_ASSERT_GREATER_THAN(0, lapCycles);
+  TEST_ASSERT_EQUAL(lapCycles, loop.lapCycles());
+  TEST_ASSERT_EQUAL(0, loop.histogram(0).count());
+
+  for (unsigned i = 0; i < 2000; i++) {
+    loop.begin(cycleCount());
+
+    hal::advanceMillis(1);
+    updateFlower();
+    loop.lap(0, cycleCount());
+
+    setWheel(i, Interpolator::ONE);
+    loop.lap(1, cycleCount());
+
+    persistSettings();
+    loop.lap(2, cycleCount());
+
+    loop.end(cycleCount());
+  }
+
+  unsigned long lines = 0, allocationsBefore = allocations;
+  loop.writeMetrics([&lines](const char *, int) { lines++; }, cyclesPerMicrosecond());
+
+  TEST_ASSERT_EQUAL(allocationsBefore, allocations);
+  TEST_ASSERT_GREATER_THAN(0, lines);
+  for (uint8_t stage = 0; stage <= 3; stage++) {
+    TEST_ASSERT_EQUAL(2000, loop.histogram(stage).count());
+  }
+}
+
+/**
+ * The local part of the boot like setup() does it: restore the settings and show the first frame
+ */
+static void test_boot_timeline(void)
+{
+  static const char *const names[] = {"settings", "first_frame", "network"};
+  BootTimeline<3> timeline(names);
+  uint32_t start = cycleCount();
+
+  restoreSettings();
+  timeline.mark(0, (cycleCount() - start) / cyclesPerMicrosecond());
+
+  setWheel(settings.wheelPosition, Interpolator::ratio(frameElapsed, frameDuration));
+  timeline.mark(1, (cycleCount() - start) / cyclesPerMicrosecond());
+
+  // Later marks of a phase are ignored
+  uint32_t firstFrame = timeline.at(1);
+  timeline.mark(1, firstFrame + 1000);
+
+  TEST_ASSERT_TRUE(timeline.reached(0));
+  TEST_ASSERT_EQUAL(firstFrame, timeline.at(1));
+  TEST_ASSERT_FALSE(timeline.reached(2));
+  TEST_ASSERT_EQUAL(timeline.at(1) - timeline.at(0), timeline.duration(1));
+
+  char json[64];
+  unsigned long lines = 0, allocationsBefore = allocations;
+  timeline.format(json, sizeof(json));
+  timeline.writeMetrics([&lines](const char *, int) { lines++; });
+
+  TEST_ASSERT_EQUAL(allocationsBefore, allocations);
+  TEST_ASSERT_EQUAL(3, lines);
+}
+
+/**
+ * A slowly fragmenting heap with short allocation peaks in between: one alert for the
+ * fragmentation, none for the peaks
+ */
+static void test_heap_monitor(void)
+{
+  HeapMonitor monitor(8192, 4096, 50);
+  unsigned long changes = 0, raisedAt = 0, allocationsBefore = allocations;
+
+  for (unsigned long i = 0; i < 10000; i++) {
+    uint32_t free = 40000;
+    // The largest block shrinks from 30000 to 10000 bytes, then a restart of the leaking service frees it again
+    uint32_t largest = i < 8000 ? 30000 - i * 20000 / 8000 : 30000;
+
+    // A HTTP request every 500 samples takes the heap below the thresholds for two samples
+    if (i % 500 < 2) {
+      free = 6000;
+      largest = 3000;
+    }
+
+    if (monitor.sample(free, largest)) {
+      changes++;
+      if (monitor.alert()) {
+        raisedAt = i;
+      }
+    }
+  }
+
+  char json[160];
+  unsigned long lines = 0;
+  monitor.format(json, sizeof(json));
+  monitor.writeMetrics([&lines](const char *, int) { lines++; });
+
+  // Fragmentation passes 50 % (largest block 20000 of 40000) after 4000 samples, reported after 3 more
+  TEST_ASSERT_EQUAL(2, changes);
+  TEST_ASSERT_EQUAL(1, monitor.alerts());
+  TEST_ASSERT_GREATER_THAN(4000, raisedAt);
+  TEST_ASSERT_LESS_THAN(4010, raisedAt);
+  TEST_ASSERT_FALSE(monitor.alert());
+  TEST_ASSERT_EQUAL(6000, monitor.minFree());
+  TEST_ASSERT_EQUAL(75, monitor.maxFragmentation());
+  TEST_ASSERT_EQUAL(allocationsBefore, allocations);
+  TEST_ASSERT_EQUAL(6, lines);
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_histogram_percentiles);
+  RUN_TEST(test_loop_profiler);
+  RUN_TEST(test_boot_timeline);
+  RUN_TEST(test_heap_monitor);
+  return UNITY_END();
+}
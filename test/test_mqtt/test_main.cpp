@@ -0,0 +1,461 @@
+/**
+ * MQTT: command parsing and dispatch, the JSON command, the connection to a loopback broker and
+ * state publishing.
+ *
+ * Run with: pio test -e native
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include <unity.h>
+
+#include "flower.h"
+#include "mqtt_client.h"
+#include "mqtt_connection.h"
+#include "state_publisher.h"
+
+#include "../native_test.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/**
+ * Random and malformed payloads for the parser and the command handlers: parsed values match
+ * strtol(), the settings stay in range and nothing is allocated.
+ */
+static void test_fuzz_commands(void)
+{
+  static const char *topics[] = {mqtt_topic_brightness, mqtt_topic_timer, mqtt_topic_color, mqtt_topic_toggle,
+                                 "esp/nightlamp", "esp/nightlamp/brightnes", "esp/nightlamp/brightnesss", ""};
+  static const char alphabet[] = "0123456789 +-\t\nx.";
+  uint32_t seed = 12345;
+  auto random = [&seed]() {
+    seed = seed * 1664525 + 1013904223;
+    return seed >> 8;
+  };
+
+  byte payload[512];
+  char terminated[sizeof(payload) + 1];
+  char topic[64];
+  unsigned long accepted = 0;
+  unsigned long allocationsBefore = allocations;
+
+  for (unsigned long i = 0; i < 200000; i++) {
+    unsigned int length = random() % 16;
+    if (random() % 64 == 0) {
+      length = random() % sizeof(payload);
+    }
+
+    // Mostly number like payloads, some raw bytes
+    bool raw = random() % 8 == 0;
+    for (unsigned int j = 0; j < length; j++) {
+      payload[j] = raw ? random() : alphabet[random() % (sizeof(alphabet) - 1)];
+    }
+
+    long value = -1;
+    if (parseInteger(payload, length, 0, UINT16_MAX, value)) {
+      accepted++;
+
+      memcpy(terminated, payload, length);
+      terminated[length] = '\0';
+      TEST_ASSERT_EQUAL(strtol(terminated, nullptr, 10), value);
+      TEST_ASSERT_TRUE(value >= 0 && value <= UINT16_MAX);
+    }
+
+    strcpy(topic, topics[random() % 8]);
+    mqttCallback(topic, payload, length);
+
+    TEST_ASSERT_GREATER_THAN(0, settings.brightnessMax);
+  }
+
+  TEST_ASSERT_GREATER_THAN(0, accepted);
+  TEST_ASSERT_EQUAL(allocationsBefore, allocations);
+}
+
+/**
+ * Brightness, color and timer in one JSON command are applied completely with a single render,
+ * invalid commands are rejected as a whole
+ */
+static void test_json_command(void)
+{
+  char topic[64];
+  char payload[96];
+
+  unsigned long allocationsBefore = allocations;
+  unsigned long presented = frameCommitter.presented();
+  strcpy(topic, mqtt_topic_command);
+  mqttCallback(topic, (byte *)payload, sprintf(payload, "{\"brightness\":80,\"color\":200,\"timer\":900}"));
+
+  TEST_ASSERT_EQUAL(1, frameCommitter.presented() - presented);
+  TEST_ASSERT_EQUAL(allocationsBefore, allocations);
+  TEST_ASSERT_EQUAL(80, settings.brightnessMax);
+  TEST_ASSERT_EQUAL(200, settings.wheelPosition);
+  TEST_ASSERT_EQUAL(900, settings.timer);
+
+  strcpy(topic, mqtt_topic_command);
+  mqttCallback(topic, (byte *)payload, sprintf(payload, "{\"brightness\":10,\"color\":300}"));
+
+  TEST_ASSERT_EQUAL(80, settings.brightnessMax);
+  TEST_ASSERT_EQUAL(200, settings.wheelPosition);
+}
+
+/**
+ * MQTT broker on a loopback TCP listener which can be killed and restarted on the same port. It
+ * answers CONNECT, SUBSCRIBE and PINGREQ and can send a command. Not answering, it accepts the TCP
+ * connection (the kernel does) but never the session.
+ */
+struct LoopbackBroker {
+  uint16_t port = 0;
+  bool answering = true;
+  unsigned long subscriptions = 0;
+  unsigned long sessions = 0;
+
+  bool start()
+  {
+    sockaddr_in address = {};
+    socklen_t addressLength = sizeof(address);
+    int reuse = 1;
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    _listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(_listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    bool listening = _listener >= 0 && bind(_listener, (sockaddr *)&address, sizeof(address)) == 0 &&
+                     listen(_listener, 4) == 0 && getsockname(_listener, (sockaddr *)&address, &addressLength) == 0;
+    port = ntohs(address.sin_port);
+    return listening;
+  }
+
+  void kill()
+  {
+    closeSession();
+    close(_listener);
+    _listener = -1;
+  }
+
+  /**
+   * Accept the client and answer the packets received so far
+   */
+  void service()
+  {
+    if (_listener < 0 || !answering) {
+      return;
+    }
+
+    if (_session < 0) {
+      _session = accept4(_listener, nullptr, nullptr, SOCK_NONBLOCK);
+      _received = 0;
+      if (_session < 0) {
+        return;
+      }
+      // A command must not wait for the delayed ACK of a SUBACK
+      int noDelay = 1;
+      setsockopt(_session, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+
+    ssize_t count = recv(_session, _buffer + _received, sizeof(_buffer) - _received, MSG_DONTWAIT);
+    if (count == 0 || (count < 0 && errno != EAGAIN)) {
+      // Closed or reset, e.g. a connection the client gave up while the broker did not answer
+      closeSession();
+      return;
+    }
+    _received += count > 0 ? count : 0;
+
+    // The packets of the client are short, a single byte of remaining length
+    while (_received >= 2 && _received >= 2u + _buffer[1]) {
+      size_t size = 2 + _buffer[1];
+      switch (_buffer[0] & 0xf0) {
+      case 0x10: { // CONNECT
+        const uint8_t connack[] = {0x20, 2, 0, 0};
+        send(_session, connack, sizeof(connack), MSG_NOSIGNAL);
+        sessions++;
+        break;
+      }
+      case 0x80: { // SUBSCRIBE
+        const uint8_t suback[] = {0x90, 3, _buffer[2], _buffer[3], 0};
+        send(_session, suback, sizeof(suback), MSG_NOSIGNAL);
+        subscriptions++;
+        break;
+      }
+      case 0xc0: { // PINGREQ
+        const uint8_t pingresp[] = {0xd0, 0};
+        send(_session, pingresp, sizeof(pingresp), MSG_NOSIGNAL);
+        break;
+      }
+      }
+      memmove(_buffer, _buffer + size, _received - size);
+      _received -= size;
+    }
+  }
+
+  void publish(const char *topic, const char *payload)
+  {
+    uint8_t packet[128];
+    size_t topicLength = strlen(topic), payloadLength = strlen(payload);
+    packet[0] = 0x30;
+    packet[1] = 2 + topicLength + payloadLength;
+    packet[2] = 0;
+    packet[3] = topicLength;
+    memcpy(packet + 4, topic, topicLength);
+    memcpy(packet + 4 + topicLength, payload, payloadLength);
+    send(_session, packet, 2 + packet[1], MSG_NOSIGNAL);
+  }
+
+  void closeSession()
+  {
+    if (_session >= 0) {
+      close(_session);
+    }
+    _session = -1;
+  }
+
+  ~LoopbackBroker()
+  {
+    closeSession();
+    if (_listener >= 0) {
+      close(_listener);
+    }
+  }
+
+private:
+  int _listener = -1;
+  int _session = -1;
+  uint8_t _buffer[256];
+  size_t _received = 0;
+};
+
+typedef MqttClient<HostTcpTransport, MQTT_PACKET_SIZE> LoopbackClient;
+
+/**
+ * The client and the connection state machine against a loopback broker
+ */
+struct BrokerSession {
+  unsigned int port;
+  LoopbackClient client;
+  MqttConnection<LoopbackClient> connection;
+  uint32_t seed = 1;
+  unsigned long maxStallMicros = 0;
+
+  BrokerSession(uint16_t brokerPort)
+      : port(brokerPort), client("127.0.0.1", port, "nightlamp", "", "", MQTT_KEEPALIVE),
+        connection(client, mqttTopicHandlers, mqttTopicHandlerCount, MQTT_BACKOFF_MIN, MQTT_BACKOFF_MAX,
+                   MQTT_CONNECT_TIMEOUT)
+  {
+    client.setCallback(mqttCallback);
+  }
+
+  /**
+   * One loop iteration like on the device, timing the real stall. The simulated clock moves on by 5 ms.
+   */
+  void loop(LoopbackBroker &broker)
+  {
+    auto start = std::chrono::steady_clock::now();
+    seed = seed * 1664525 + 1013904223;
+    connection.poll(millis(), seed >> 8);
+    if (connection.connected()) {
+      client.loop(millis());
+    }
+    unsigned long stall =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    maxStallMicros = stall > maxStallMicros ? stall : maxStallMicros;
+
+    broker.service();
+    hal::advanceMillis(5);
+  }
+};
+
+/**
+ * A broker that is killed for 5 minutes and then restarted: backed off attempts during the
+ * outage, no loop() that waits on the network and a quick reconnect.
+ */
+static void test_broker_outage(void)
+{
+  LoopbackBroker broker;
+  TEST_ASSERT_TRUE(broker.start());
+  BrokerSession session(broker.port);
+
+  const unsigned long killAt = 60000, restartAt = 360000, end = 480000;
+  unsigned long outageAttempts = 0;
+  unsigned long reconnectedAt = 0;
+
+  for (unsigned long t = 0; t < end; t += 5) {
+    if (t == killAt) {
+      broker.kill();
+    }
+    if (t == restartAt) {
+      TEST_ASSERT_TRUE(broker.start());
+    }
+
+    unsigned long attempts = session.connection.attempts();
+    session.loop(broker);
+
+    if (t >= killAt && t < restartAt) {
+      outageAttempts += session.connection.attempts() - attempts;
+      TEST_ASSERT_FALSE(session.connection.connected() && t > killAt + 1000);
+    }
+    if (t >= restartAt && !reconnectedAt && session.connection.connected()) {
+      reconnectedAt = t;
+    }
+  }
+
+  TEST_ASSERT_TRUE(session.connection.connected());
+  TEST_ASSERT_EQUAL(2, session.connection.connects());
+  // A fixed 5 s retry would have made 60 attempts
+  TEST_ASSERT_LESS_THAN(60, outageAttempts);
+  TEST_ASSERT_LESS_THAN(50000, session.maxStallMicros);
+  TEST_ASSERT_LESS_OR_EQUAL(MQTT_BACKOFF_MAX + 100, reconnectedAt - restartAt);
+  TEST_ASSERT_EQUAL(session.connection.connects() * mqttTopicHandlerCount, broker.subscriptions);
+}
+
+/**
+ * A broker that takes the TCP connection but never answers the CONNACK: each attempt is given up
+ * after the connect timeout without stalling loop(), then a command arrives once it answers
+ */
+static void test_broker_not_answering(void)
+{
+  LoopbackBroker broker;
+  TEST_ASSERT_TRUE(broker.start());
+  broker.answering = false;
+  BrokerSession session(broker.port);
+
+  for (unsigned long t = 0; t < 120000; t += 5) {
+    session.loop(broker);
+    TEST_ASSERT_FALSE(session.connection.connected());
+  }
+  TEST_ASSERT_GREATER_THAN(1, session.connection.attempts());
+  TEST_ASSERT_LESS_THAN(50000, session.maxStallMicros);
+
+  broker.answering = true;
+  for (unsigned long t = 0; t < MQTT_BACKOFF_MAX + MQTT_CONNECT_TIMEOUT && !session.connection.connected(); t += 5) {
+    session.loop(broker);
+  }
+  TEST_ASSERT_TRUE(session.connection.connected());
+
+  broker.publish(mqtt_topic_brightness, "77");
+  for (int i = 0; i < 100 && settings.brightnessMax != 77; i++) {
+    usleep(100);
+    session.loop(broker);
+  }
+  TEST_ASSERT_EQUAL(77, settings.brightnessMax);
+}
+
+/**
+ * WiFi drops while connected: reset() gives the session up, the next poll() connects again
+ * right away
+ */
+static void test_network_reset(void)
+{
+  LoopbackBroker broker;
+  TEST_ASSERT_TRUE(broker.start());
+  BrokerSession session(broker.port);
+
+  for (int i = 0; i < 1000 && !session.connection.connected(); i++) {
+    session.loop(broker);
+  }
+  TEST_ASSERT_TRUE(session.connection.connected());
+
+  session.connection.reset(millis());
+  TEST_ASSERT_FALSE(session.connection.connected());
+  TEST_ASSERT_FALSE(session.client.connected());
+
+  for (int i = 0; i < 1000 && !session.connection.connected(); i++) {
+    session.loop(broker);
+  }
+  TEST_ASSERT_TRUE(session.connection.connected());
+  TEST_ASSERT_EQUAL(2, session.connection.connects());
+  TEST_ASSERT_EQUAL(2, broker.sessions);
+}
+
+/**
+ * Counts what would be published to the broker
+ */
+struct PublishRecorder {
+  bool publish(const char *, const uint8_t *, unsigned int, bool) { return true; }
+};
+
+static StatePublisher<PublishRecorder> *statePublisher;
+
+/**
+ * Let the flower run for the given time, polling the state publisher every 5 ms.
+ */
+static void runPublishing(unsigned long ms, unsigned long colorStepMillis = 0)
+{
+  for (unsigned long t = 0; t < ms; t += 5) {
+    if (colorStepMillis && t % colorStepMillis == 0) {
+      settings.wheelPosition += 3;
+      doColorChange = true;
+    }
+
+    hal::advanceMillis(5);
+    updateFlower();
+    statePublisher->poll(currentLampState(), millis());
+  }
+}
+
+/**
+ * At most one message per state field and window for each user interaction, without allocations
+ */
+static void test_state_publishing(void)
+{
+  PublishRecorder recorder;
+  StatePublisher<PublishRecorder> publisher(recorder, mqtt_state_topics, STATE_PUBLISH_WINDOW, STATE_TIMER_RESOLUTION);
+  statePublisher = &publisher;
+
+  struct Interaction {
+    const char *topic;
+    const char *payload;
+    unsigned long millis;
+    unsigned long colorStepMillis;
+  };
+  static const Interaction interactions[] = {
+    {nullptr, nullptr, 5000, 0},             // connect
+    {mqtt_topic_toggle, "", 5000, 0},        // toggle (3 s movement)
+    {nullptr, nullptr, 1500, 25},            // encoder spin 1.5 s
+    {mqtt_topic_brightness, "120", 3000, 0}, // brightness
+    {mqtt_topic_timer, "600", 600000, 0},    // sleep timer 10 min
+  };
+
+  unsigned long allocationsBefore = allocations;
+
+  for (const Interaction &interaction : interactions) {
+    unsigned long messages = publisher.messages();
+
+    if (interaction.topic) {
+      char topic[64];
+      strcpy(topic, interaction.topic);
+      mqttCallback(topic, (byte *)interaction.payload, strlen(interaction.payload));
+    }
+
+    // Let the last window run out
+    runPublishing(interaction.millis, interaction.colorStepMillis);
+    if (interaction.colorStepMillis) {
+      runPublishing(2 * STATE_PUBLISH_WINDOW);
+    }
+
+    messages = publisher.messages() - messages;
+    TEST_ASSERT_GREATER_THAN(0, messages);
+    TEST_ASSERT_LESS_OR_EQUAL(STATE_FIELD_COUNT * (interaction.millis / STATE_PUBLISH_WINDOW + 2), messages);
+  }
+
+  TEST_ASSERT_EQUAL(allocationsBefore, allocations);
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_fuzz_commands);
+  RUN_TEST(test_json_command);
+  RUN_TEST(test_broker_outage);
+  RUN_TEST(test_broker_not_answering);
+  RUN_TEST(test_network_reset);
+  RUN_TEST(test_state_publishing);
+  return UNITY_END();
+}
@@ -0,0 +1,249 @@
+/**
+ * Realtime pixel streaming: DDP packets over UDP on the loopback interface.
+ *
+ * Run with: pio test -e native
+ */
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <unity.h>
+
+#include "flower.h"
+#include "pixel_stream.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static int receiver = -1;
+static int sender = -1;
+
+/**
+ * A connected pair of UDP sockets on the loopback interface
+ */
+static bool openLoopback()
+{
+  sockaddr_in address = {};
+  socklen_t addressLength = sizeof(address);
+
+  receiver = socket(AF_INET, SOCK_DGRAM, 0);
+  sender = socket(AF_INET, SOCK_DGRAM, 0);
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  return receiver >= 0 && sender >= 0 && bind(receiver, (sockaddr *)&address, sizeof(address)) == 0 &&
+         getsockname(receiver, (sockaddr *)&address, &addressLength) == 0 &&
+         connect(sender, (sockaddr *)&address, sizeof(address)) == 0;
+}
+
+/**
+ * Receive a packet like on the device: the header first, then the pixel data straight into the
+ * pixel buffer. Returns false if nothing arrived.
+ */
+static bool receivePacket()
+{
+  pollfd pending = {receiver, POLLIN, 0};
+  if (poll(&pending, 1, 100) != 1) {
+    return false;
+  }
+
+  uint8_t header[DDP_HEADER_SIZE];
+  PixelStreamChunk chunk;
+  // The size of the whole datagram, like parsePacket() on the device
+  ssize_t size = recv(receiver, header, sizeof(header), MSG_PEEK | MSG_TRUNC);
+
+  if (size >= (ssize_t)sizeof(header) && pixelStream.receive(header, size, micros(), chunk)) {
+    iovec parts[] = {{header, sizeof(header)}, {(uint8_t *)streamedPixels() + chunk.offset, chunk.length}};
+    msghdr message = {};
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    recvmsg(receiver, &message, 0);
+
+    if (chunk.push) {
+      showStreamedPixels();
+    }
+  } else {
+    recv(receiver, header, sizeof(header), 0);
+  }
+
+  return true;
+}
+
+/**
+ * Send a DDP packet with RGB data to the display, the given number of data bytes filled with value
+ */
+static void sendPacket(uint8_t flags, uint8_t sequence, uint32_t offset, uint16_t length, size_t data, uint8_t value)
+{
+  uint8_t packet[DDP_HEADER_SIZE + 2 * NUM_LEDS * sizeof(RgbColor)] = {
+    flags, sequence, 0x01, 0x01, (uint8_t)(offset >> 24), (uint8_t)(offset >> 16), (uint8_t)(offset >> 8),
+    (uint8_t)offset, (uint8_t)(length >> 8), (uint8_t)length};
+
+  memset(packet + DDP_HEADER_SIZE, value, data);
+  send(sender, packet, DDP_HEADER_SIZE + data, 0);
+}
+
+/**
+ * Whole frames streamed like a light sync tool would, some of them lost on the way: every other
+ * frame is shown, the gaps are counted and the normal rendering takes over after the timeout.
+ */
+static void test_stream_loopback(void)
+{
+  const unsigned frames = 600;
+  unsigned long lost = 0;
+  unsigned long showsBefore = frameCommitter.output().shows();
+  unsigned long lostBefore = pixelStream.lost();
+
+  for (unsigned frame = 0; frame < frames; frame++) {
+    uint8_t packet[DDP_HEADER_SIZE + NUM_LEDS * sizeof(RgbColor)] = {
+      0x41, (uint8_t)(frame % 15 + 1), 0x01, 0x01, 0, 0, 0, 0, 0, NUM_LEDS * sizeof(RgbColor)};
+    for (unsigned i = DDP_HEADER_SIZE; i < sizeof(packet); i += 3) {
+      packet[i] = frame;
+      packet[i + 1] = frame >> 8;
+      packet[i + 2] = i;
+    }
+
+    // Lost on the way
+    if (frame % 50 == 25) {
+      lost++;
+      continue;
+    }
+
+    send(sender, packet, sizeof(packet), 0);
+    TEST_ASSERT_TRUE(receivePacket());
+    TEST_ASSERT_EQUAL_MEMORY(packet + DDP_HEADER_SIZE, frameCommitter.output().frame(), NUM_LEDS * sizeof(RgbColor));
+  }
+
+  TEST_ASSERT_EQUAL(frames - lost, frameCommitter.output().shows() - showsBefore);
+  TEST_ASSERT_EQUAL(lost, pixelStream.lost() - lostBefore);
+  TEST_ASSERT_TRUE(pixelStream.active());
+
+  // Without packets the normal rendering takes over again
+  unsigned long shows = frameCommitter.output().shows();
+  hal::advanceMillis(PIXEL_STREAM_TIMEOUT + 1);
+  updatePixelStream();
+  frameCommitter.commit();
+  TEST_ASSERT_FALSE(pixelStream.active());
+  TEST_ASSERT_EQUAL(shows + 1, frameCommitter.output().shows());
+}
+
+/**
+ * A frame in two packets at different offsets, only shown with the push flag of the second one
+ */
+static void test_stream_partial_offsets(void)
+{
+  const uint32_t half = NUM_LEDS / 2 * sizeof(RgbColor);
+  const uint32_t size = NUM_LEDS * sizeof(RgbColor);
+  unsigned long shows = frameCommitter.output().shows();
+
+  sendPacket(0x40, 1, 0, half, half, 0x11);
+  TEST_ASSERT_TRUE(receivePacket());
+  TEST_ASSERT_EQUAL(shows, frameCommitter.output().shows());
+
+  sendPacket(0x41, 2, half, size - half, size - half, 0x22);
+  TEST_ASSERT_TRUE(receivePacket());
+  TEST_ASSERT_EQUAL(shows + 1, frameCommitter.output().shows());
+
+  const uint8_t *shown = (const uint8_t *)frameCommitter.output().frame();
+  TEST_ASSERT_EQUAL(0x11, shown[0]);
+  TEST_ASSERT_EQUAL(0x11, shown[half - 1]);
+  TEST_ASSERT_EQUAL(0x22, shown[half]);
+  TEST_ASSERT_EQUAL(0x22, shown[size - 1]);
+
+  // After the full frame a frame updating only the first half: the second half stays as shown,
+  // not what the back buffer held from an older frame
+  sendPacket(0x41, 3, 0, half, half, 0x33);
+  TEST_ASSERT_TRUE(receivePacket());
+  TEST_ASSERT_EQUAL(shows + 2, frameCommitter.output().shows());
+
+  shown = (const uint8_t *)frameCommitter.output().frame();
+  TEST_ASSERT_EQUAL(0x33, shown[0]);
+  TEST_ASSERT_EQUAL(0x33, shown[half - 1]);
+  TEST_ASSERT_EQUAL(0x22, shown[half]);
+  TEST_ASSERT_EQUAL(0x22, shown[size - 1]);
+}
+
+/**
+ * Packets writing outside the pixel buffer, longer than the datagram, short or malformed are
+ * rejected before any pixel data is read
+ */
+static void test_stream_rejects_malformed(void)
+{
+  const uint32_t size = NUM_LEDS * sizeof(RgbColor);
+  unsigned long rejected = pixelStream.rejected();
+  unsigned long packets = pixelStream.packets();
+  unsigned long shows = frameCommitter.output().shows();
+
+  // offset + length wraps around in 32 bit and used to pass the bounds check
+  sendPacket(0x41, 3, 0xfffffff0, 0x20, 0x20, 0xee);
+  // Beyond the end of the buffer: past the last byte and one byte too long
+  sendPacket(0x41, 4, 0x10000, 3, 3, 0xee);
+  sendPacket(0x41, 5, size - 2, 3, 3, 0xee);
+  // More data announced than sent
+  sendPacket(0x41, 6, 0, size, size - 1, 0xee);
+  // Shorter than the header, dropped before receive()
+  send(sender, "\x41\x07\x01", 3, 0);
+  // Version 2, a query and a time code
+  sendPacket(0x81, 8, 0, 3, 3, 0xee);
+  sendPacket(0x43, 9, 0, 3, 3, 0xee);
+  sendPacket(0x51, 10, 0, 3, 3, 0xee);
+
+  for (uint8_t i = 0; i < 8; i++) {
+    TEST_ASSERT_TRUE(receivePacket());
+  }
+
+  TEST_ASSERT_EQUAL(rejected + 7, pixelStream.rejected());
+  TEST_ASSERT_EQUAL(packets, pixelStream.packets());
+  TEST_ASSERT_EQUAL(shows, frameCommitter.output().shows());
+
+  // The last pixel exactly is fine
+  sendPacket(0x41, 11, size - 3, 3, 3, 0x33);
+  TEST_ASSERT_TRUE(receivePacket());
+  TEST_ASSERT_EQUAL(packets + 1, pixelStream.packets());
+  TEST_ASSERT_EQUAL(0x33, ((const uint8_t *)frameCommitter.output().frame())[size - 1]);
+}
+
+/**
+ * The same sequence number twice is a duplicate, not 14 lost packets
+ */
+static void test_stream_duplicates(void)
+{
+  unsigned long lost = pixelStream.lost();
+  unsigned long duplicates = pixelStream.duplicates();
+  unsigned long shows = frameCommitter.output().shows();
+
+  sendPacket(0x41, 12, 0, 3, 3, 0x44);
+  sendPacket(0x41, 12, 0, 3, 3, 0x55);
+  sendPacket(0x41, 13, 0, 3, 3, 0x66);
+  for (uint8_t i = 0; i < 3; i++) {
+    TEST_ASSERT_TRUE(receivePacket());
+  }
+
+  TEST_ASSERT_EQUAL(lost, pixelStream.lost());
+  TEST_ASSERT_EQUAL(duplicates + 1, pixelStream.duplicates());
+  TEST_ASSERT_EQUAL(shows + 2, frameCommitter.output().shows());
+  TEST_ASSERT_EQUAL(0x66, frameCommitter.output().frame()[0].r);
+}
+
+int main(int, char **)
+{
+  if (!openLoopback()) {
+    printf("no loopback socket\n");
+    return 1;
+  }
+
+  UNITY_BEGIN();
+  RUN_TEST(test_stream_loopback);
+  RUN_TEST(test_stream_partial_offsets);
+  RUN_TEST(test_stream_rejects_malformed);
+  RUN_TEST(test_stream_duplicates);
+  int failures = UNITY_END();
+
+  close(sender);
+  close(receiver);
+
+  return failures;
+}
@@ -0,0 +1,288 @@
+/**
+ * Persistence: the settings journal, the binary config record and the JSON config import.
+ *
+ * Run with: pio test -e native
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <unity.h>
+
+#include "flower.h"
+#include "filesystem.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/**
+ * Let the simulated time pass in steps of 100 ms while loop() keeps writing settings behind.
+ */
+static void idle(unsigned long ms)
+{
+  for (unsigned long t = 0; t < ms; t += 100) {
+    hal::advanceMillis(100);
+    persistSettings();
+  }
+}
+
+/**
+ * A year of evenings, each opening the flower, turning the color a few times, setting brightness
+ * and timer via MQTT and closing it again. Every single storeSettings() used to erase the flash
+ * sector once.
+ */
+static void test_settings_journal_endurance(void)
+{
+  unsigned long erasesBefore = hal::flashErases;
+  unsigned long stores = 0;
+
+  for (int day = 0; day < 365; day++) {
+    settings.flowerGoalState = true;
+    settings.servoPosition = SERVO_CLOSED;
+    settings.brightness = settings.brightnessMax;
+    storeSettings();
+    stores++;
+    idle(5000);
+
+    // Spinning the encoder
+    for (int change = 0; change < 5; change++) {
+      settings.wheelPosition += 17;
+      storeSettings();
+      stores++;
+      idle(300);
+    }
+    idle(5000);
+
+    // MQTT burst
+    settings.brightnessMax = 20 + day % 30;
+    storeSettings();
+    settings.timer = 600 + day % 4 * 300;
+    storeSettings();
+    stores += 2;
+    idle(5000);
+
+    settings.flowerGoalState = false;
+    settings.servoPosition = SERVO_OPEN;
+    settings.brightness = BRIGHTNESS_START;
+    storeSettings();
+    stores++;
+    idle(5000);
+  }
+
+  TEST_ASSERT_FALSE(settingsDirty);
+  TEST_ASSERT_LESS_THAN(stores / 100, hal::flashErases - erasesBefore);
+
+  // A reboot has to restore the very same settings
+  Settings restored;
+  TEST_ASSERT_TRUE(settingsJournal.restore(restored));
+  TEST_ASSERT_EQUAL(settings.servoPosition, restored.servoPosition);
+  TEST_ASSERT_EQUAL(settings.brightness, restored.brightness);
+  TEST_ASSERT_EQUAL(settings.wheelPosition, restored.wheelPosition);
+  TEST_ASSERT_EQUAL(settings.flowerGoalState, restored.flowerGoalState);
+  TEST_ASSERT_EQUAL(settings.brightnessMax, restored.brightnessMax);
+  TEST_ASSERT_EQUAL(settings.timer, restored.timer);
+
+  // A power loss between the erase of a compaction and its snapshot loses the settings: the sector
+  // is left erased and the lamp boots with the defaults
+  unsigned long erases = hal::flashErases;
+  while (hal::flashErases == erases) {
+    settings.wheelPosition += 17;
+    storeSettings();
+    flushSettings();
+  }
+  flashSectorErase();
+
+  settings = Settings();
+  TEST_ASSERT_FALSE(restoreSettings());
+  TEST_ASSERT_EQUAL(SERVO_CLOSED, settings.servoPosition);
+  TEST_ASSERT_EQUAL(50, settings.brightnessMax);
+
+  // The next change is written as a full snapshot again
+  settings.wheelPosition = 42;
+  storeSettings();
+  flushSettings();
+  TEST_ASSERT_TRUE(settingsJournal.restore(restored));
+  TEST_ASSERT_EQUAL(42, restored.wheelPosition);
+  TEST_ASSERT_EQUAL(50, restored.brightnessMax);
+}
+
+/**
+ * Snapshots written before the effect was journaled restore everything else, the effect keeps its
+ * default until it is appended
+ */
+static void test_settings_without_effect(void)
+{
+  static const JournalField fields[] = {
+    {offsetof(Settings, servoPosition), sizeof(Settings::servoPosition)},
+    {offsetof(Settings, brightness), sizeof(Settings::brightness)},
+    {offsetof(Settings, wheelPosition), sizeof(Settings::wheelPosition)},
+    {offsetof(Settings, flowerGoalState), sizeof(Settings::flowerGoalState)},
+    {offsetof(Settings, brightnessMax), sizeof(Settings::brightnessMax)},
+    {offsetof(Settings, timer), sizeof(Settings::timer)},
+  };
+  SettingsJournal<Settings, 6> before(fields, SETTINGS_VERSION);
+
+  Settings stored;
+  stored.wheelPosition = 123;
+  stored.flowerGoalState = true;
+  stored.brightnessMax = 77;
+  stored.timer = 900;
+  stored.effect = EFFECT_CANDLE;
+  TEST_ASSERT_TRUE(before.store(stored));
+
+  Settings restored;
+  TEST_ASSERT_TRUE(settingsJournal.restore(restored));
+  TEST_ASSERT_EQUAL(123, restored.wheelPosition);
+  TEST_ASSERT_TRUE(restored.flowerGoalState);
+  TEST_ASSERT_EQUAL(77, restored.brightnessMax);
+  TEST_ASSERT_EQUAL(900, restored.timer);
+  TEST_ASSERT_EQUAL(EFFECT_WHEEL, restored.effect);
+
+  restored.effect = EFFECT_CANDLE;
+  TEST_ASSERT_TRUE(settingsJournal.store(restored));
+
+  Settings again;
+  TEST_ASSERT_TRUE(settingsJournal.restore(again));
+  TEST_ASSERT_EQUAL(123, again.wheelPosition);
+  TEST_ASSERT_EQUAL(EFFECT_CANDLE, again.effect);
+}
+
+/**
+ * The first boot after the update takes over the settings stored by the EEPROM library and writes
+ * them as the first snapshot of the journal
+ */
+static void test_settings_legacy_migration(void)
+{
+  union {
+    LegacySettings legacy;
+    uint32_t words[(sizeof(LegacySettings) + 3) / 4];
+  } image;
+  memset(&image, 0, sizeof(image));
+  image.legacy.servoPosition = SERVO_OPEN + 100;
+  image.legacy.brightness = 40;
+  image.legacy.wheelPosition = 99;
+  image.legacy.flowerGoalState = 0x02; // Not a boolean
+  image.legacy.brightnessMax = 120;
+  image.legacy.timer = 1800;
+
+  flashSectorErase();
+  TEST_ASSERT_TRUE(flashSectorWrite(0, image.words, sizeof(image.words)));
+  unsigned long erases = hal::flashErases;
+
+  settings = Settings();
+  TEST_ASSERT_TRUE(restoreSettings());
+  TEST_ASSERT_EQUAL(SERVO_OPEN + 100, settings.servoPosition);
+  TEST_ASSERT_EQUAL(40, settings.brightness);
+  TEST_ASSERT_EQUAL(99, settings.wheelPosition);
+  TEST_ASSERT_EQUAL(1, (uint8_t)settings.flowerGoalState);
+  TEST_ASSERT_EQUAL(120, settings.brightnessMax);
+  TEST_ASSERT_EQUAL(1800, settings.timer);
+  TEST_ASSERT_EQUAL(EFFECT_WHEEL, settings.effect);
+
+  // Migrated once: the next boot finds the journal
+  TEST_ASSERT_EQUAL(1, hal::flashErases - erases);
+  Settings restored;
+  TEST_ASSERT_TRUE(settingsJournal.restore(restored));
+  TEST_ASSERT_EQUAL(99, restored.wheelPosition);
+  TEST_ASSERT_EQUAL(120, restored.brightnessMax);
+  TEST_ASSERT_TRUE(restoreSettings());
+  TEST_ASSERT_EQUAL(1, hal::flashErases - erases);
+
+  // A new device keeps the defaults
+  flashSectorErase();
+  settings = Settings();
+  TEST_ASSERT_FALSE(restoreSettings());
+  TEST_ASSERT_EQUAL(SERVO_CLOSED, settings.servoPosition);
+  TEST_ASSERT_FALSE(settings.flowerGoalState);
+}
+
+/**
+ * Values longer than the fields are cut off, the record survives a round trip through the file
+ */
+static void test_config_record_round_trip(void)
+{
+  copyConfigString(mqtt_server, "a-very-long-broker-name.example.org", CONFIG_STRING_SIZE);
+  otaPort = 8267;
+  mqtt_port = 8883;
+  storeConfigRecord();
+  otaPort = 0;
+  mqtt_port = 0;
+  mqtt_server[0] = '\0';
+
+  TEST_ASSERT_TRUE(loadConfigRecord());
+  TEST_ASSERT_EQUAL(8267, otaPort);
+  TEST_ASSERT_EQUAL(8883, mqtt_port);
+  TEST_ASSERT_EQUAL(CONFIG_STRING_SIZE - 1, strlen(mqtt_server));
+  TEST_ASSERT_EQUAL(0, strncmp(mqtt_server, "a-very-long-broker-name.example.org", CONFIG_STRING_SIZE - 1));
+}
+
+/**
+ * Corrupted, truncated and outdated records are rejected
+ */
+static void test_config_record_rejected(void)
+{
+  storeConfigRecord();
+
+  File file = LittleFS.open("/config.bin", "r");
+  ConfigRecord record;
+  file.readBytes((char *)&record, sizeof(record));
+  file.close();
+
+  ConfigRecord corrupted = record;
+  corrupted.mqttUser[3] ^= 0x20;
+  ConfigRecord outdated = record;
+  outdated.version++;
+  ConfigRecord unterminated = record;
+  memset(unterminated.mqttPass, 'x', CONFIG_STRING_SIZE);
+  sealConfigRecord(unterminated);
+
+  TEST_ASSERT_TRUE(validConfigRecord(record));
+  TEST_ASSERT_FALSE(validConfigRecord(corrupted));
+  TEST_ASSERT_FALSE(validConfigRecord(outdated));
+  TEST_ASSERT_FALSE(validConfigRecord(unterminated));
+
+  file = LittleFS.open("/config.bin", "w");
+  file.write((const uint8_t *)&record, sizeof(record) - 1);
+  file.close();
+  TEST_ASSERT_FALSE(loadConfigRecord());
+
+  LittleFS.remove("/config.bin");
+}
+
+/**
+ * An older /config.json without some of the keys leaves those settings as they are
+ */
+static void test_config_json_partial(void)
+{
+  const char partial[] = "{\"mqttServer\":\"broker.local\",\"mqttPort\":1884}";
+  copyConfigString(otaPassword, "secret", CONFIG_STRING_SIZE);
+  copyConfigString(device_id, "flower-1", CONFIG_STRING_SIZE);
+  copyConfigString(mqtt_user, "user", CONFIG_STRING_SIZE);
+  otaPort = 8266;
+
+  File file = LittleFS.open("/config.json", "w");
+  file.write((const uint8_t *)partial, sizeof(partial) - 1);
+  file.close();
+
+  TEST_ASSERT_TRUE(importConfigJson());
+  TEST_ASSERT_EQUAL_STRING("broker.local", mqtt_server);
+  TEST_ASSERT_EQUAL(1884, mqtt_port);
+  TEST_ASSERT_EQUAL_STRING("secret", otaPassword);
+  TEST_ASSERT_EQUAL_STRING("flower-1", device_id);
+  TEST_ASSERT_EQUAL_STRING("user", mqtt_user);
+  TEST_ASSERT_EQUAL(8266, otaPort);
+
+  LittleFS.remove("/config.json");
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_settings_journal_endurance);
+  RUN_TEST(test_settings_without_effect);
+  RUN_TEST(test_settings_legacy_migration);
+  RUN_TEST(test_config_record_round_trip);
+  RUN_TEST(test_config_record_rejected);
+  RUN_TEST(test_config_json_partial);
+  return UNITY_END();
+}
@@ -0,0 +1,239 @@
+/**
+ * Lamp time sync: leader election, failover and synchronized movement starts over UDP multicast
+ * on the loopback interface, and the start of a scheduled movement on the lamp.
+ *
+ * Run with: pio test -e native
+ */
+
+#include <chrono>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <unity.h>
+
+#include "config.h"
+#include "flower.h"
+#include "time_sync.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/**
+ * A lamp of the test: own multicast socket and own clock, which runs with an offset and a drift
+ * against the real time.
+ */
+struct SyncLamp {
+  uint32_t id;
+  uint32_t clockOffset;
+  double drift;
+  int socket;
+  TimeSync timeSync;
+  bool running;
+  SyncCommand command;
+  bool scheduled;
+
+  SyncLamp(uint32_t id, uint32_t clockOffset, double drift, uint32_t intervalMicros)
+      : id(id), clockOffset(clockOffset), drift(drift), socket(-1), timeSync(id, intervalMicros), running(true),
+        command(), scheduled(false)
+  {
+  }
+
+  uint32_t clock(double realMicros) const { return clockOffset + (uint32_t)(realMicros * (1 + drift)); }
+
+  // Real time of a time on this clock
+  double realTime(uint32_t micros) const { return (uint32_t)(micros - clockOffset) / (1 + drift); }
+};
+
+static const in_addr_t syncTestGroup = htonl(0xefff2a2a); // 239.255.42.42
+
+static int openSyncSocket(uint16_t port)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int yes = 1;
+  sockaddr_in address = {};
+  ip_mreq membership = {};
+  in_addr loopback = {htonl(INADDR_LOOPBACK)};
+
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  membership.imr_multiaddr.s_addr = syncTestGroup;
+  membership.imr_interface = loopback;
+
+  if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0 ||
+      bind(fd, (sockaddr *)&address, sizeof(address)) != 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) != 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Run the lamps for the given real time: poll, multicast and receive like loop() does.
+ */
+static void runSyncLamps(std::vector<SyncLamp> &lamps, double &realMicros, double untilMicros, uint16_t port)
+{
+  auto start = std::chrono::steady_clock::now();
+  double startMicros = realMicros;
+  sockaddr_in group = {};
+
+  group.sin_family = AF_INET;
+  group.sin_port = htons(port);
+  group.sin_addr.s_addr = syncTestGroup;
+
+  while (realMicros < untilMicros) {
+    uint8_t packet[64];
+
+    for (SyncLamp &lamp : lamps) {
+      size_t length = lamp.running ? lamp.timeSync.poll(lamp.clock(realMicros), packet) : 0;
+      if (length) {
+        sendto(lamp.socket, packet, length, 0, (sockaddr *)&group, sizeof(group));
+      }
+    }
+
+    for (SyncLamp &lamp : lamps) {
+      ssize_t size;
+      while ((size = recv(lamp.socket, packet, sizeof(packet), 0)) > 0) {
+        if (!lamp.running) {
+          continue;
+        }
+
+        realMicros = startMicros + std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        SyncCommand command;
+        if (lamp.timeSync.receive(packet, size, lamp.clock(realMicros), command)) {
+          lamp.command = command;
+          lamp.scheduled = true;
+        }
+      }
+    }
+
+    usleep(200);
+    realMicros = startMicros + std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  }
+}
+
+/**
+ * Let one lamp trigger a movement and return the spread of the real start times of all running
+ * lamps in microseconds.
+ */
+static double syncedStartError(std::vector<SyncLamp> &lamps, SyncLamp &trigger, double &realMicros, uint16_t port)
+{
+  sockaddr_in group = {};
+  group.sin_family = AF_INET;
+  group.sin_port = htons(port);
+  group.sin_addr.s_addr = syncTestGroup;
+
+  for (SyncLamp &lamp : lamps) {
+    lamp.scheduled = false;
+  }
+
+  uint8_t packet[TIME_SYNC_PACKET_SIZE];
+  trigger.command = {(uint32_t)(trigger.clock(realMicros) + TIME_SYNC_LEAD * 1000UL), true, 42, 80};
+  trigger.scheduled = true;
+  sendto(trigger.socket, packet, trigger.timeSync.command(trigger.command, packet), 0, (sockaddr *)&group, sizeof(group));
+
+  runSyncLamps(lamps, realMicros, realMicros + 50000, port);
+
+  double first = 1e18, last = -1e18;
+  for (SyncLamp &lamp : lamps) {
+    if (!lamp.running) {
+      continue;
+    }
+    if (!lamp.scheduled) {
+      return 1e9;
+    }
+
+    double start = lamp.realTime(lamp.command.startMicros);
+    first = start < first ? start : first;
+    last = start > last ? start : last;
+  }
+
+  return last - first;
+}
+
+/**
+ * Four lamps with different clocks: the lowest id leads, a follower triggers a movement which
+ * starts on all lamps within a millisecond, then the leader goes away and the next one takes over.
+ */
+static void test_time_sync(void)
+{
+  const uint16_t port = TIME_SYNC_PORT;
+  const uint32_t interval = 50000;
+  std::vector<SyncLamp> lamps;
+
+  lamps.emplace_back(30, 0x12345678, 40e-6, interval);
+  lamps.emplace_back(10, 0xfffff000, -25e-6, interval);
+  lamps.emplace_back(20, 0x00000100, 10e-6, interval);
+  lamps.emplace_back(40, 0x80000000, 0, interval);
+
+  for (SyncLamp &lamp : lamps) {
+    lamp.socket = openSyncSocket(port);
+    TEST_ASSERT_TRUE_MESSAGE(lamp.socket >= 0, "no multicast on loopback");
+  }
+
+  double realMicros = 0;
+  runSyncLamps(lamps, realMicros, 500000, port);
+  TEST_ASSERT_TRUE(lamps[1].timeSync.leader());
+  TEST_ASSERT_FALSE(lamps[0].timeSync.leader());
+  TEST_ASSERT_FALSE(lamps[2].timeSync.leader());
+  TEST_ASSERT_LESS_THAN(1000, syncedStartError(lamps, lamps[3], realMicros, port));
+
+  // Leader gone: the next lowest id takes over after three intervals
+  lamps[1].running = false;
+  runSyncLamps(lamps, realMicros, realMicros + 500000, port);
+  TEST_ASSERT_TRUE(lamps[2].timeSync.leader());
+  TEST_ASSERT_FALSE(lamps[0].timeSync.leader());
+  TEST_ASSERT_FALSE(lamps[3].timeSync.leader());
+  TEST_ASSERT_LESS_THAN(1000, syncedStartError(lamps, lamps[0], realMicros, port));
+
+  for (SyncLamp &lamp : lamps) {
+    close(lamp.socket);
+  }
+}
+
+/**
+ * A received movement takes over the color and brightness when it arrives and only moves the
+ * flower at its start: a color turned in between stays.
+ */
+static void test_scheduled_movement(void)
+{
+  settings.flowerGoalState = false;
+  settings.wheelPosition = 10;
+  settings.brightnessMax = 200;
+
+  scheduleMovement({(uint32_t)(micros() + 100000), true, 40, 120});
+  TEST_ASSERT_EQUAL(40, settings.wheelPosition);
+  TEST_ASSERT_EQUAL(120, settings.brightnessMax);
+
+  settings.wheelPosition = 90;
+  settings.brightnessMax = 60;
+  hal::advanceMicros(50000);
+  updateScheduledMovement();
+  TEST_ASSERT_FALSE(settings.flowerGoalState);
+
+  hal::advanceMicros(60000);
+  updateScheduledMovement();
+  TEST_ASSERT_TRUE(settings.flowerGoalState);
+  TEST_ASSERT_EQUAL(90, settings.wheelPosition);
+  TEST_ASSERT_EQUAL(60, settings.brightnessMax);
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_time_sync);
+  RUN_TEST(test_scheduled_movement);
+  return UNITY_END();
+}